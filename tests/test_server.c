@@ -0,0 +1,944 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
+#include <unistd.h>
+
+#include "tftp_log.h"
+#include "tftp_server.h"
+#include "tftp_stats.h"
+#include "tftp_xfer.h"
+
+// the server in this process, driven over loopback by hand made packets
+// and tftp_xfer transfers. test_server case port [uring]
+
+#define TEST_FILE "data.bin"
+#define TEST_FILE_SIZE (300 * 1024)
+#define TEST_WAIT_MS 2000
+
+typedef struct _test_mem_t {
+  uint8_t *data;
+  int64_t size;
+  int64_t capacity;
+} test_mem_t;
+
+static char test_dir[] = "/tmp/tftp_test.XXXXXX";
+static uint16_t test_port;
+static uint8_t *test_data;
+
+static void test_path(char *path, size_t size, const char *name) {
+  snprintf(path, size, "%s/%s", test_dir, name);
+}
+
+static int test_write_file(const char *name, const uint8_t *data,
+                           int64_t size) {
+  char path[256];
+  test_path(path, sizeof(path), name);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  int ok = write(fd, data, (size_t)size) == (ssize_t)size;
+  close(fd);
+  return ok ? 0 : -1;
+}
+
+// compares a file of the server dir with the first size bytes of data
+static int test_check_file(const char *name, const uint8_t *data,
+                           int64_t size) {
+  char path[256];
+  test_path(path, sizeof(path), name);
+  struct stat st;
+  if ((stat(path, &st) < 0) || (st.st_size != size)) {
+    return -1;
+  }
+
+  uint8_t *buf = (uint8_t *)malloc((size_t)size + 1);
+  int fd = open(path, O_RDONLY);
+  int ok = (fd >= 0) && (read(fd, buf, (size_t)size) == (ssize_t)size) &&
+           (memcmp(buf, data, (size_t)size) == 0);
+  if (fd >= 0) {
+    close(fd);
+  }
+  free(buf);
+  return ok ? 0 : -1;
+}
+
+static int test_start(tftpd_config_t *config, int argc, char **argv) {
+  if (mkdtemp(test_dir) == NULL) {
+    printf("test_server: create work dir failed.\n");
+    return -1;
+  }
+
+  test_data = (uint8_t *)malloc(TEST_FILE_SIZE);
+  for (int i = 0; i < TEST_FILE_SIZE; i++) {
+    test_data[i] = (uint8_t)(i * 7 + (i >> 10));
+  }
+  if (test_write_file(TEST_FILE, test_data, TEST_FILE_SIZE) < 0) {
+    printf("test_server: write %s failed.\n", TEST_FILE);
+    return -1;
+  }
+
+  test_port = (uint16_t)atoi(argv[2]);
+  config->dir = test_dir;
+  config->port = test_port;
+  if ((argc > 3) && (strcmp(argv[3], "uring") == 0)) {
+    config->engine = TFTPD_ENGINE_URING;
+  }
+  if (tftpd_start_config(config) < 0) {
+    printf("test_server: start server failed.\n");
+    return -1;
+  }
+  return 0;
+}
+
+static void test_cleanup(void) {
+  char cmd[512];
+  snprintf(cmd, sizeof(cmd), "rm -rf %s", test_dir);
+  if (system(cmd) != 0) {
+    printf("test_server: remove %s failed.\n", test_dir);
+  }
+}
+
+static void test_server_addr(struct sockaddr_in *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sin_family = AF_INET;
+  addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr->sin_port = htons(test_port);
+}
+
+// a request with the options given as name, value pairs
+static int test_send_req(int sockfd, uint16_t op, const char *filename,
+                         const char **options) {
+  uint8_t buf[512];
+  tftp_packet_t *pkt = (tftp_packet_t *)buf;
+  pkt->opcode = htons(op);
+  int len = 2 + sprintf((char *)pkt->req.args, "%s", filename) + 1;
+  len += sprintf((char *)buf + len, "octet") + 1;
+  for (; options && *options; options++) {
+    len += sprintf((char *)buf + len, "%s", *options) + 1;
+  }
+
+  struct sockaddr_in addr;
+  test_server_addr(&addr);
+  return sendto(sockfd, buf, len, 0, (struct sockaddr *)&addr, sizeof(addr)) ==
+                 len
+             ? 0
+             : -1;
+}
+
+static ssize_t test_recv(int sockfd, void *buf, size_t size,
+                         struct sockaddr_in *from) {
+  struct pollfd pfd = {sockfd, POLLIN, 0};
+  if (poll(&pfd, 1, TEST_WAIT_MS) <= 0) {
+    return -1;
+  }
+  socklen_t len = sizeof(*from);
+  return recvfrom(sockfd, buf, size, 0, (struct sockaddr *)from, &len);
+}
+
+static ssize_t mem_read(void *ctx, int64_t offset, void *buf, size_t size) {
+  test_mem_t *mem = (test_mem_t *)ctx;
+  if (offset >= mem->size) {
+    return 0;
+  }
+  if ((int64_t)size > mem->size - offset) {
+    size = (size_t)(mem->size - offset);
+  }
+  memcpy(buf, mem->data + offset, size);
+  return (ssize_t)size;
+}
+
+static int mem_write(void *ctx, int64_t offset, const void *data,
+                     size_t size) {
+  test_mem_t *mem = (test_mem_t *)ctx;
+  if (offset + (int64_t)size > mem->capacity) {
+    return -1;
+  }
+  memcpy(mem->data + offset, data, size);
+  if (offset + (int64_t)size > mem->size) {
+    mem->size = offset + (int64_t)size;
+  }
+  return 0;
+}
+
+// a whole transfer through tftp_xfer_run. a get fills mem, a put sends
+// its size bytes, restarting at offset if the server agrees. sent, if
+// given, gets the bytes that crossed the wire after the agreed offset
+static int test_xfer(int is_read, const char *filename, test_mem_t *mem,
+                     int block_size, int window_size, int64_t offset,
+                     int64_t *sent) {
+  struct sockaddr_in addr;
+  test_server_addr(&addr);
+  int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sockfd < 0) {
+    return -1;
+  }
+
+  tftp_xfer_t xfer;
+  tftp_xfer_io_t io = {mem_read, mem_write, mem};
+  int err = tftp_xfer_init(&xfer, (struct sockaddr *)&addr, is_read, filename,
+                           block_size, window_size, 1,
+                           is_read ? offset : mem->size, &io);
+  if (err == 0) {
+    err = tftp_xfer_run(&xfer, sockfd);
+    if (sent != NULL) {
+      *sent = xfer.total_size;
+    }
+    tftp_xfer_free(&xfer);
+  }
+  close(sockfd);
+  return err;
+}
+
+static int test_get_data(void) {
+  test_mem_t mem = {(uint8_t *)malloc(TEST_FILE_SIZE), 0, TEST_FILE_SIZE};
+  int ok = (test_xfer(1, TEST_FILE, &mem, 1024, 8, 0, NULL) == 0) &&
+           (mem.size == TEST_FILE_SIZE) &&
+           (memcmp(mem.data, test_data, TEST_FILE_SIZE) == 0);
+  free(mem.data);
+  return ok ? 0 : -1;
+}
+
+// multicast sessions end by an error of their only member, by the member
+// acking the last block or by failing to send to the group. the server
+// must survive the close and go on serving the same client endpoint
+static int test_mcast(int argc, char **argv) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.mcast_addr = "239.255.42.1";
+  config.mcast_port = (uint16_t)(atoi(argv[2]) + 1);
+  if (test_start(&config, argc, argv) < 0) {
+    return -1;
+  }
+
+  int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  const char *options[] = {"multicast", "", "blksize", "1024", NULL};
+  uint8_t buf[2048];
+  tftp_packet_t *pkt = (tftp_packet_t *)buf;
+  for (int i = 0; i < 4; i++) {
+    struct sockaddr_in from;
+    if ((test_send_req(sockfd, TFTP_PKT_RRQ, TEST_FILE, options) < 0) ||
+        (test_recv(sockfd, buf, sizeof(buf), &from) < 4) ||
+        (ntohs(pkt->opcode) != TFTP_PKT_OACK)) {
+      printf("test_server: no multicast oack\n");
+      return -1;
+    }
+
+    // the first rounds end the session with an error, the others start
+    // the group transfer and ack the last block at once
+    if (i < 2) {
+      pkt->opcode = htons(TFTP_PKT_ERROR);
+      pkt->err.code = htons(TFTP_ERR_USER);
+      pkt->err.msg[0] = '\0';
+      sendto(sockfd, buf, 5, 0, (struct sockaddr *)&from, sizeof(from));
+    } else {
+      pkt->opcode = htons(TFTP_PKT_ACK);
+      pkt->ack.block = htons(0);
+      sendto(sockfd, buf, 4, 0, (struct sockaddr *)&from, sizeof(from));
+      pkt->ack.block = htons(TEST_FILE_SIZE / 1024 + 1);
+      sendto(sockfd, buf, 4, 0, (struct sockaddr *)&from, sizeof(from));
+    }
+    usleep(50 * 1000);
+  }
+
+  struct sockaddr_in from;
+  int ok = (test_send_req(sockfd, TFTP_PKT_RRQ, TEST_FILE, NULL) == 0) &&
+           (test_recv(sockfd, buf, sizeof(buf), &from) >= 4) &&
+           (ntohs(pkt->opcode) == TFTP_PKT_DATA);
+  close(sockfd);
+  if (!ok) {
+    printf("test_server: plain get after multicast failed\n");
+    return -1;
+  }
+
+  if (test_get_data() < 0) {
+    printf("test_server: get after multicast failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+// uploads in windows larger than the socket buffer lose the end of most
+// windows, the server acks what it got on its timer. a block larger than
+// the blksize agreed on ends the transfer with an error
+static int test_recv_window(int argc, char **argv) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  if (test_start(&config, argc, argv) < 0) {
+    return -1;
+  }
+
+  int64_t size = 3 * 1024 * 1024 + 100;
+  test_mem_t mem = {(uint8_t *)malloc(size), size, size};
+  for (int64_t i = 0; i < size; i++) {
+    mem.data[i] = (uint8_t)(i * 13 + (i >> 14));
+  }
+  int err = test_xfer(0, "put.bin", &mem, 8192, 16, 0, NULL);
+  if ((err < 0) || (test_check_file("put.bin", mem.data, size) < 0)) {
+    printf("test_server: windowed put failed\n");
+    free(mem.data);
+    return -1;
+  }
+  free(mem.data);
+
+  int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  uint8_t buf[2048];
+  tftp_packet_t *pkt = (tftp_packet_t *)buf;
+  struct sockaddr_in from;
+  if ((test_send_req(sockfd, TFTP_PKT_WRQ, "big_block.bin", NULL) < 0) ||
+      (test_recv(sockfd, buf, sizeof(buf), &from) < 4) ||
+      (ntohs(pkt->opcode) != TFTP_PKT_ACK)) {
+    printf("test_server: no ack of the request\n");
+    close(sockfd);
+    return -1;
+  }
+
+  pkt->opcode = htons(TFTP_PKT_DATA);
+  pkt->data.block = htons(1);
+  memset(pkt->data.data, 1, TFTP_DEF_BLKSIZE + 100);
+  sendto(sockfd, buf, 4 + TFTP_DEF_BLKSIZE + 100, 0, (struct sockaddr *)&from,
+         sizeof(from));
+  int ok = (test_recv(sockfd, buf, sizeof(buf), &from) >= 4) &&
+           (ntohs(pkt->opcode) == TFTP_PKT_ERROR);
+  close(sockfd);
+  if (!ok) {
+    printf("test_server: oversized block not refused\n");
+    return -1;
+  }
+  return 0;
+}
+
+// an upload cut short by a failed write keeps what reached the disk in a
+// .part file, the next upload of the file continues from its end
+static int test_resume(int argc, char **argv) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  if (test_start(&config, argc, argv) < 0) {
+    return -1;
+  }
+
+  int64_t size = 2 * 1024 * 1024 + 100;
+  test_mem_t mem = {(uint8_t *)malloc(size), size, size};
+  for (int64_t i = 0; i < size; i++) {
+    mem.data[i] = (uint8_t)(i * 11 + (i >> 12));
+  }
+
+  // writes past the file size limit fail with EFBIG instead of a signal
+  struct rlimit limit;
+  getrlimit(RLIMIT_FSIZE, &limit);
+  struct rlimit small = {1024 * 1024, limit.rlim_max};
+  signal(SIGXFSZ, SIG_IGN);
+  setrlimit(RLIMIT_FSIZE, &small);
+  int err = test_xfer(0, "resume.bin", &mem, 1024, 8, 0, NULL);
+  setrlimit(RLIMIT_FSIZE, &limit);
+  usleep(100 * 1000);
+
+  char path[256];
+  test_path(path, sizeof(path), "resume.bin.part");
+  struct stat st;
+  if ((err == 0) || (stat(path, &st) < 0) || (st.st_size == 0) ||
+      (st.st_size > (off_t)small.rlim_cur)) {
+    printf("test_server: no part file of the failed put\n");
+    free(mem.data);
+    return -1;
+  }
+  if (test_check_file("resume.bin.part", mem.data, st.st_size) < 0) {
+    printf("test_server: part file does not match the data sent\n");
+    free(mem.data);
+    return -1;
+  }
+
+  // a part file tagged with another tsize, or locked by its writer, is
+  // not resumed: the put starts over and sends the whole file
+  int64_t part = st.st_size;
+  int64_t sent = 0;
+  char tag[32];
+  ssize_t tag_size = getxattr(path, "user.tftpd.tsize", tag, sizeof(tag));
+  if ((tag_size <= 0) ||
+      (setxattr(path, "user.tftpd.tsize", "1", 1, 0) < 0)) {
+    printf("test_server: part file not tagged\n");
+    free(mem.data);
+    return -1;
+  }
+  err = test_xfer(0, "resume.bin", &mem, 1024, 8, 0, &sent);
+  if ((err < 0) || (sent != size) ||
+      (test_check_file("resume.bin", mem.data, size) < 0)) {
+    printf("test_server: put of a stale part file, sent %" PRId64 "\n", sent);
+    free(mem.data);
+    return -1;
+  }
+
+  setxattr(path, "user.tftpd.tsize", tag, tag_size, 0);
+  int lockfd = open(path, O_RDONLY);
+  if ((lockfd < 0) || (flock(lockfd, LOCK_EX) < 0)) {
+    printf("test_server: lock part file failed\n");
+    free(mem.data);
+    return -1;
+  }
+  err = test_xfer(0, "resume.bin", &mem, 1024, 8, 0, &sent);
+  close(lockfd);
+  if ((err < 0) || (sent != size) ||
+      (test_check_file("resume.bin", mem.data, size) < 0)) {
+    printf("test_server: put of a locked part file, sent %" PRId64 "\n",
+           sent);
+    free(mem.data);
+    return -1;
+  }
+
+  // the resumed put only sends what the part file lacks
+  err = test_xfer(0, "resume.bin", &mem, 1024, 8, 0, &sent);
+  if ((err < 0) || (sent != size - part) ||
+      (test_check_file("resume.bin", mem.data, size) < 0)) {
+    printf("test_server: resumed put failed, sent %" PRId64 " of %" PRId64
+           "\n",
+           sent, size - part);
+    free(mem.data);
+    return -1;
+  }
+  if (stat(path, &st) == 0) {
+    printf("test_server: part file left after the resumed put\n");
+    free(mem.data);
+    return -1;
+  }
+  free(mem.data);
+  return 0;
+}
+
+// a get of a file cut short while sent. the mapping the server sends from
+// loses the pages past the new end, the client must get an error packet
+// instead of a crash or a transfer that times out
+typedef struct _test_cut_t {
+  test_mem_t mem;
+  char path[256];
+  int64_t cut_at;
+  int cut;
+} test_cut_t;
+
+static int cut_write(void *ctx, int64_t offset, const void *data,
+                     size_t size) {
+  test_cut_t *cut = (test_cut_t *)ctx;
+  if (!cut->cut && (offset >= cut->cut_at)) {
+    cut->cut = truncate(cut->path, cut->cut_at / 2) == 0;
+  }
+  return mem_write(&cut->mem, offset, data, size);
+}
+
+static int test_truncate(int argc, char **argv) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  if (test_start(&config, argc, argv) < 0) {
+    return -1;
+  }
+
+  int64_t size = 8 * 1024 * 1024;
+  test_cut_t cut;
+  memset(&cut, 0, sizeof(cut));
+  cut.mem.data = (uint8_t *)malloc(size);
+  cut.mem.capacity = size;
+  for (int64_t i = 0; i < size; i++) {
+    cut.mem.data[i] = (uint8_t)(i * 13 + (i >> 11));
+  }
+  test_path(cut.path, sizeof(cut.path), "cut.bin");
+  cut.cut_at = 1024 * 1024;
+  if (test_write_file("cut.bin", cut.mem.data, size) < 0) {
+    free(cut.mem.data);
+    return -1;
+  }
+
+  struct sockaddr_in addr;
+  test_server_addr(&addr);
+  int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  tftp_xfer_t xfer;
+  tftp_xfer_io_t io = {mem_read, cut_write, &cut};
+  int err = tftp_xfer_init(&xfer, (struct sockaddr *)&addr, 1, "cut.bin", 1024,
+                           8, 1, 0, &io);
+  if ((sockfd < 0) || (err < 0)) {
+    printf("test_server: start get failed\n");
+    free(cut.mem.data);
+    return -1;
+  }
+  err = tftp_xfer_run(&xfer, sockfd);
+  close(sockfd);
+  free(cut.mem.data);
+
+  int ok = (err < 0) && cut.cut && (xfer.state == TFTP_XFER_FAILED) &&
+           (xfer.err_code == 0) && (strcmp(xfer.err_msg, "File changed") == 0);
+  if (!ok) {
+    printf("test_server: get of a cut file ended with %d \"%s\"\n",
+           xfer.err_code, xfer.err_msg);
+  }
+  tftp_xfer_free(&xfer);
+  if (!ok) {
+    return -1;
+  }
+
+  // the server lives on and serves the next request
+  if (test_get_data() < 0) {
+    printf("test_server: get after the cut file failed\n");
+    return -1;
+  }
+  return 0;
+}
+
+static int test_thread_count(void) {
+  DIR *dir = opendir("/proc/self/task");
+  if (dir == NULL) {
+    return -1;
+  }
+  int count = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    count += entry->d_name[0] != '.';
+  }
+  closedir(dir);
+  return count;
+}
+
+// a start that fails after some shards are open leaves no thread or socket
+// behind, a second start on the same port serves
+// loops with a stats block, as scraped
+static int test_stats_loops(void) {
+  static char buf[64 * 1024];
+  tftp_stats_format(buf, sizeof(buf));
+  int loops = 0;
+  for (char *line = strstr(buf, "tftpd_sessions_active{loop="); line;
+       line = strstr(line + 1, "tftpd_sessions_active{loop=")) {
+    loops++;
+  }
+  return loops;
+}
+
+static int test_start_fail(int argc, char **argv) {
+  char sock_path[256];
+  memset(sock_path, 'x', sizeof(sock_path) - 1);
+  sock_path[sizeof(sock_path) - 1] = '\0';
+
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.shards = 2;
+  config.stats_sock = sock_path;
+  // the first failure also starts the log thread
+  if (test_start(&config, argc, argv) == 0) {
+    printf("test_server: start with a bad stats socket did not fail\n");
+    return -1;
+  }
+  int threads = test_thread_count();
+  if ((tftpd_start_config(&config) == 0) ||
+      (test_thread_count() != threads)) {
+    printf("test_server: failed start left threads running\n");
+    return -1;
+  }
+  if (test_stats_loops() != 0) {
+    printf("test_server: failed start left %d loops in the stats\n",
+           test_stats_loops());
+    return -1;
+  }
+
+  config.stats_sock = NULL;
+  if ((tftpd_start_config(&config) < 0) || (test_get_data() < 0)) {
+    printf("test_server: start after a failed start failed\n");
+    return -1;
+  }
+  if (test_stats_loops() != config.shards) {
+    printf("test_server: %d loops in the stats of %d\n", test_stats_loops(),
+           config.shards);
+    return -1;
+  }
+  return 0;
+}
+
+#define TEST_FAIR_RATE (1024 * 1024)
+#define TEST_FAIR_DELAY_US 20000
+#define TEST_FAIR_RUN_US 3000000
+#define TEST_FAIR_QUEUE 512
+
+// a get of its own socket whose received packets can be held back for a
+// while, as on a longer path
+typedef struct _test_flow_t {
+  tftp_xfer_t xfer;
+  int sockfd;
+  test_mem_t mem;
+  int64_t delay_us;
+  uint8_t *queue;
+  int64_t due_us[TEST_FAIR_QUEUE];
+  size_t size[TEST_FAIR_QUEUE];
+  int head;
+  int count;
+} test_flow_t;
+
+static int test_flow_init(test_flow_t *flow, const char *filename,
+                          int64_t size, int64_t delay_us) {
+  memset(flow, 0, sizeof(*flow));
+  flow->delay_us = delay_us;
+  flow->mem.data = (uint8_t *)malloc(size);
+  flow->mem.capacity = size;
+  flow->queue = (uint8_t *)malloc((size_t)TEST_FAIR_QUEUE * 2048);
+  flow->sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+  struct sockaddr_in addr;
+  test_server_addr(&addr);
+  tftp_xfer_io_t io = {mem_read, mem_write, &flow->mem};
+  return tftp_xfer_init(&flow->xfer, (struct sockaddr *)&addr, 1, filename,
+                        1024, 16, 1, 0, &io);
+}
+
+static void test_flow_free(test_flow_t *flow) {
+  tftp_xfer_free(&flow->xfer);
+  close(flow->sockfd);
+  free(flow->mem.data);
+  free(flow->queue);
+}
+
+// send what the transfer has to send, take in what arrived and what is due
+static void test_flow_run(test_flow_t *flow, int64_t now) {
+  tftp_xfer_t *xfer = &flow->xfer;
+  const void *pkt;
+  size_t size;
+  while (tftp_xfer_next(xfer, now, &pkt, &size)) {
+    tftp_sendto(flow->sockfd, pkt, size, &xfer->tftp.remote);
+  }
+
+  struct sockaddr from;
+  ssize_t len;
+  uint8_t buf[2048];
+  while ((len = tftp_recvfrom(flow->sockfd, buf, sizeof(buf), MSG_DONTWAIT,
+                              &from)) >= 0) {
+    if (flow->count == TEST_FAIR_QUEUE) {
+      continue;
+    }
+    int idx = (flow->head + flow->count++) % TEST_FAIR_QUEUE;
+    memcpy(flow->queue + (size_t)idx * 2048, buf, (size_t)len);
+    flow->size[idx] = (size_t)len;
+    flow->due_us[idx] = now + flow->delay_us;
+    memcpy(&xfer->tftp.remote, &from, sizeof(from));
+  }
+
+  while (flow->count && (flow->due_us[flow->head] <= now)) {
+    int idx = flow->head;
+    flow->head = (flow->head + 1) % TEST_FAIR_QUEUE;
+    flow->count--;
+    tftp_xfer_feed(xfer, &xfer->tftp.remote, flow->queue + (size_t)idx * 2048,
+                   flow->size[idx], now);
+  }
+  tftp_xfer_timer(xfer, now);
+}
+
+// two gets under one aggregate rate limit, one of them on a path with a
+// longer round trip. each must get about half of the rate, the one that
+// asks more often must not take the other's share
+static int test_fair(int argc, char **argv) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.rate_limit = TEST_FAIR_RATE;
+  if (test_start(&config, argc, argv) < 0) {
+    return -1;
+  }
+
+  int64_t size = 4 * TEST_FAIR_RATE;
+  uint8_t *data = (uint8_t *)calloc(1, size);
+  int err = test_write_file("fair.bin", data, size);
+  free(data);
+  test_flow_t *flows = (test_flow_t *)calloc(2, sizeof(test_flow_t));
+  if ((err < 0) || (test_flow_init(&flows[0], "fair.bin", size, 0) < 0) ||
+      (test_flow_init(&flows[1], "fair.bin", size, TEST_FAIR_DELAY_US) < 0)) {
+    printf("test_server: set up fair gets failed\n");
+    return -1;
+  }
+
+  int64_t start = tftp_now_us();
+  int64_t now = start;
+  while (now - start < TEST_FAIR_RUN_US) {
+    struct pollfd pfds[2] = {{flows[0].sockfd, POLLIN, 0},
+                             {flows[1].sockfd, POLLIN, 0}};
+    poll(pfds, 2, 1);
+    now = tftp_now_us();
+    test_flow_run(&flows[0], now);
+    test_flow_run(&flows[1], now);
+  }
+
+  int64_t near = flows[0].xfer.total_size;
+  int64_t far = flows[1].xfer.total_size;
+  printf("test_server: fair gets %" PRId64 " and %" PRId64 " bytes\n", near,
+         far);
+  test_flow_free(&flows[0]);
+  test_flow_free(&flows[1]);
+  free(flows);
+
+  // each gets within a third of the other, and the two do not go over the
+  // limit by more than its burst
+  int64_t limit = TEST_FAIR_RATE * (TEST_FAIR_RUN_US / 1000000) + 256 * 1024;
+  if ((near * 2 > far * 3) || (far * 2 > near * 3) || (near + far > limit) ||
+      (near + far < limit / 2)) {
+    printf("test_server: rate not shared fairly\n");
+    return -1;
+  }
+  return 0;
+}
+
+// a client socket on an address of the loopback net, 127.0.0.x
+static int test_client(const char *ip) {
+  int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sockfd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  inet_pton(AF_INET, ip, &addr.sin_addr);
+  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sockfd);
+    return -1;
+  }
+  return sockfd;
+}
+
+// the opcode of the next packet within wait_ms, 0 if none came. from is
+// where the session sends from
+static int test_wait_op(int sockfd, int wait_ms, uint8_t *buf, size_t size,
+                        struct sockaddr_in *from) {
+  struct pollfd pfd = {sockfd, POLLIN, 0};
+  if (poll(&pfd, 1, wait_ms) <= 0) {
+    return 0;
+  }
+  socklen_t len = sizeof(*from);
+  ssize_t n = recvfrom(sockfd, buf, size, 0, (struct sockaddr *)from, &len);
+  return n >= 4 ? ntohs(((tftp_packet_t *)buf)->opcode) : 0;
+}
+
+// a get waits for the first data block, served or not
+static int test_get_first(int sockfd, const char *filename,
+                          struct sockaddr_in *from) {
+  uint8_t buf[1024];
+  if (test_send_req(sockfd, TFTP_PKT_RRQ, filename, NULL) < 0) {
+    return -1;
+  }
+  return test_wait_op(sockfd, TEST_WAIT_MS, buf, sizeof(buf), from) ==
+                 TFTP_PKT_DATA
+             ? 0
+             : -1;
+}
+
+// ends a session with an error, its client gave up
+static void test_end(int sockfd, const struct sockaddr_in *session) {
+  uint8_t buf[8];
+  tftp_packet_t *pkt = (tftp_packet_t *)buf;
+  pkt->opcode = htons(TFTP_PKT_ERROR);
+  pkt->err.code = htons(TFTP_ERR_USER);
+  pkt->err.msg[0] = '\0';
+  sendto(sockfd, buf, 5, 0, (const struct sockaddr *)session,
+         sizeof(*session));
+}
+
+static int test_quiet(int sockfd, int wait_ms) {
+  uint8_t buf[1024];
+  struct sockaddr_in from;
+  return test_wait_op(sockfd, wait_ms, buf, sizeof(buf), &from) == 0;
+}
+
+static uint64_t test_stat(const char *name) {
+  static char buf[64 * 1024];
+  tftp_stats_format(buf, sizeof(buf));
+  const char *line = strstr(buf, name);
+  return line ? strtoull(line + strlen(name), NULL, 10) : 0;
+}
+
+// one session at a time: the request past it waits in the queue, the one
+// past the queue is told the server is busy
+static int test_busy(int argc, char **argv) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.max_sessions = 1;
+  config.queue_size = 1;
+  if (test_start(&config, argc, argv) < 0) {
+    return -1;
+  }
+
+  int running = test_client("127.0.0.1");
+  int queued = test_client("127.0.0.1");
+  int busy = test_client("127.0.0.1");
+  struct sockaddr_in session;
+  int ok = test_get_first(running, TEST_FILE, &session) == 0;
+  if (ok) {
+    test_send_req(queued, TFTP_PKT_RRQ, TEST_FILE, NULL);
+    ok = test_quiet(queued, 100);
+  }
+
+  uint8_t buf[1024];
+  tftp_packet_t *pkt = (tftp_packet_t *)buf;
+  struct sockaddr_in from;
+  if (ok) {
+    test_send_req(busy, TFTP_PKT_RRQ, TEST_FILE, NULL);
+    ok = (test_wait_op(busy, TEST_WAIT_MS, buf, sizeof(buf) - 1, &from) ==
+          TFTP_PKT_ERROR) &&
+         (ntohs(pkt->err.code) == TFTP_ERR_OK) &&
+         (strcmp(pkt->err.msg, "Server busy") == 0);
+  }
+
+  // the queued request gets the session once it is free
+  if (ok) {
+    test_end(running, &session);
+    ok = test_wait_op(queued, TEST_WAIT_MS, buf, sizeof(buf), &from) ==
+         TFTP_PKT_DATA;
+    test_end(queued, &from);
+  }
+  close(running);
+  close(queued);
+  close(busy);
+  if (!ok) {
+    printf("test_server: session limit not kept\n");
+    return -1;
+  }
+  return 0;
+}
+
+// queued requests open in priority order: the priority net first, then
+// the smaller files. each waits until the one before it ended
+static int test_priority(int argc, char **argv) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.max_sessions = 1;
+  config.priority_net = "127.0.0.3/32";
+  if (test_start(&config, argc, argv) < 0) {
+    return -1;
+  }
+
+  // big.bin is not in the cache, its size is not known
+  uint8_t *big = (uint8_t *)calloc(1, 2 * TEST_FILE_SIZE);
+  int err = test_write_file("big.bin", big, 2 * TEST_FILE_SIZE);
+  free(big);
+  if (err < 0) {
+    return -1;
+  }
+
+  // arriving neither in the order served nor in its reverse: small, big
+  // from the priority net, big. served as 1, 0, 2
+  int running = test_client("127.0.0.1");
+  int clients[3] = {test_client("127.0.0.1"), test_client("127.0.0.3"),
+                    test_client("127.0.0.1")};
+  const char *files[3] = {TEST_FILE, "big.bin", "big.bin"};
+  int order[3] = {1, 0, 2};
+  struct sockaddr_in session;
+  int ok = test_get_first(running, TEST_FILE, &session) == 0;
+  for (int i = 0; ok && (i < 3); i++) {
+    ok = (test_send_req(clients[i], TFTP_PKT_RRQ, files[i], NULL) == 0) &&
+         test_quiet(clients[i], 50);
+  }
+  if (ok) {
+    test_end(running, &session);
+  }
+
+  for (int turn = 0; ok && (turn < 3); turn++) {
+    int next = order[turn];
+    uint8_t buf[1024];
+    ok = test_wait_op(clients[next], TEST_WAIT_MS, buf, sizeof(buf),
+                      &session) == TFTP_PKT_DATA;
+    for (int i = turn + 1; ok && (i < 3); i++) {
+      ok = test_quiet(clients[order[i]], 0);
+    }
+    if (!ok) {
+      printf("test_server: request %d not served in its turn\n", next);
+    }
+    test_end(clients[next], &session);
+  }
+  close(running);
+  for (int i = 0; i < 3; i++) {
+    close(clients[i]);
+  }
+  return ok ? 0 : -1;
+}
+
+// a request sent again while it is served or queued is merged with the
+// first: counted as a duplicate, served once
+static int test_duplicate(int argc, char **argv) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.max_sessions = 1;
+  if (test_start(&config, argc, argv) < 0) {
+    return -1;
+  }
+
+  int running = test_client("127.0.0.1");
+  int queued = test_client("127.0.0.1");
+  struct sockaddr_in session;
+  int ok = test_get_first(running, TEST_FILE, &session) == 0;
+  if (ok) {
+    test_send_req(running, TFTP_PKT_RRQ, TEST_FILE, NULL);
+    test_send_req(queued, TFTP_PKT_RRQ, TEST_FILE, NULL);
+    test_send_req(queued, TFTP_PKT_RRQ, TEST_FILE, NULL);
+    ok = test_quiet(queued, 100) &&
+         (test_stat("tftpd_dup_requests_total ") == 2);
+  }
+
+  // one session for the queued request, nothing from a second one after
+  // it ended
+  struct sockaddr_in first;
+  if (ok) {
+    test_end(running, &session);
+    uint8_t buf[1024];
+    ok = test_wait_op(queued, TEST_WAIT_MS, buf, sizeof(buf), &first) ==
+         TFTP_PKT_DATA;
+  }
+  if (ok) {
+    test_end(queued, &first);
+    struct sockaddr_in from;
+    uint8_t buf[1024];
+    while (ok && (test_wait_op(queued, 200, buf, sizeof(buf), &from) != 0)) {
+      ok = from.sin_port == first.sin_port;
+    }
+  }
+  close(running);
+  close(queued);
+  if (!ok) {
+    printf("test_server: duplicate requests not merged\n");
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  tftp_log_level = TFTP_LOG_ERROR;
+  if (argc < 3) {
+    printf("usage: %s mcast|recv|resume|start|fair|cut|busy|prio|dup port "
+           "[uring]\n",
+           argv[0]);
+    return 2;
+  }
+
+  int err = -1;
+  if (strcmp(argv[1], "mcast") == 0) {
+    err = test_mcast(argc, argv);
+  } else if (strcmp(argv[1], "recv") == 0) {
+    err = test_recv_window(argc, argv);
+  } else if (strcmp(argv[1], "resume") == 0) {
+    err = test_resume(argc, argv);
+  } else if (strcmp(argv[1], "start") == 0) {
+    err = test_start_fail(argc, argv);
+  } else if (strcmp(argv[1], "fair") == 0) {
+    err = test_fair(argc, argv);
+  } else if (strcmp(argv[1], "cut") == 0) {
+    err = test_truncate(argc, argv);
+  } else if (strcmp(argv[1], "busy") == 0) {
+    err = test_busy(argc, argv);
+  } else if (strcmp(argv[1], "prio") == 0) {
+    err = test_priority(argc, argv);
+  } else if (strcmp(argv[1], "dup") == 0) {
+    err = test_duplicate(argc, argv);
+  } else {
+    printf("test_server: unknown case %s\n", argv[1]);
+  }
+
+  tftp_log_flush();
+  test_cleanup();
+  printf("test_server: %s %s\n", argv[1], err < 0 ? "FAILED" : "ok");
+  return err < 0 ? 1 : 0;
+}
@@ -0,0 +1,494 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tftp_log.h"
+#include "tftp_xfer.h"
+
+// tftp_xfer against a simulated server on a simulated clock: no sockets,
+// packets get lost on purpose and time jumps to the next event. the server
+// follows tftpd: a window per ack, one rewind per window, the window again
+// on a get timeout and the last block in order acked on a put timeout
+
+#define SIM_DELAY_US 500
+#define SIM_RTO_US 20000
+#define SIM_MAX_RETRY 20
+#define SIM_QUEUE_SIZE 4096
+#define SIM_TIME_LIMIT_US (600LL * 1000000)
+#define SIM_SERVER_PORT 5000
+
+typedef struct _sim_packet_t {
+  int64_t due_us;
+  int to_server;
+  size_t size;
+  uint8_t *data;
+} sim_packet_t;
+
+// every packet is lost with probability drop. packets of one send burst
+// past the first burst are lost with probability overflow, as when a
+// window overruns the receive buffer
+typedef struct _sim_loss_t {
+  double drop;
+  int burst;
+  double overflow;
+} sim_loss_t;
+
+typedef struct _sim_case_t {
+  const char *name;
+  int is_read;
+  int64_t size;
+  int block_size;
+  int window_size;
+  sim_loss_t loss;
+} sim_case_t;
+
+typedef struct _sim_server_t {
+  int is_read;
+  uint8_t *file;
+  int64_t size;
+  int block_size;
+  int window_size;
+  // get: first block not acked, 0 before the oack is acked, blocks of the
+  // window sent and the last block. put: next block expected
+  int64_t base;
+  int sent;
+  int64_t last;
+  int rewound;
+  int gap_acked;
+  int win_count;
+  int done;
+  int64_t deadline_us;
+  int retry;
+  uint8_t pkt[TFTP_PKT_SIZE(TFTP_MAX_BLKSIZE)];
+} sim_server_t;
+
+typedef struct _sim_t {
+  sim_packet_t queue[SIM_QUEUE_SIZE];
+  int head;
+  int count;
+  // packets sent in the current burst of each side
+  int burst[2];
+  uint64_t rng;
+  sim_loss_t loss;
+  int64_t now_us;
+  sim_server_t server;
+} sim_t;
+
+typedef struct _sim_file_t {
+  uint8_t *data;
+  int64_t size;
+} sim_file_t;
+
+static double sim_random(sim_t *sim) {
+  sim->rng ^= sim->rng >> 12;
+  sim->rng ^= sim->rng << 25;
+  sim->rng ^= sim->rng >> 27;
+  return (double)((sim->rng * 0x2545f4914f6cdd1dULL) >> 11) /
+         (double)(1ULL << 53);
+}
+
+static void sim_send(sim_t *sim, int to_server, const void *data,
+                     size_t size) {
+  int burst = sim->burst[to_server]++;
+  if ((sim_random(sim) < sim->loss.drop) ||
+      ((burst >= sim->loss.burst) && (sim_random(sim) < sim->loss.overflow)) ||
+      (sim->count == SIM_QUEUE_SIZE)) {
+    return;
+  }
+
+  // one delay for all, the queue stays sorted by due time
+  sim_packet_t *pkt = &sim->queue[(sim->head + sim->count++) % SIM_QUEUE_SIZE];
+  pkt->due_us = sim->now_us + SIM_DELAY_US;
+  pkt->to_server = to_server;
+  pkt->size = size;
+  pkt->data = (uint8_t *)malloc(size);
+  memcpy(pkt->data, data, size);
+}
+
+// nothing but the oack sent yet
+static int server_waiting(sim_server_t *server) {
+  return server->base == (server->is_read ? 0 : 1);
+}
+
+static void server_send(sim_t *sim, size_t size) {
+  sim_server_t *server = &sim->server;
+  sim_send(sim, 0, server->pkt, size);
+  server->deadline_us = sim->now_us + SIM_RTO_US;
+}
+
+static void server_oack(sim_t *sim) {
+  sim_server_t *server = &sim->server;
+  tftp_packet_t *pkt = (tftp_packet_t *)server->pkt;
+  pkt->opcode = htons(TFTP_PKT_OACK);
+  int len = sprintf(pkt->oack.option, "blksize%c%d%ctsize%c%" PRId64
+                    "%cwindowsize%c%d",
+                    0, server->block_size, 0, 0, server->size, 0, 0,
+                    server->window_size);
+  server_send(sim, 2 + (size_t)len + 1);
+}
+
+static void server_ack(sim_t *sim, int64_t block) {
+  tftp_packet_t *pkt = (tftp_packet_t *)sim->server.pkt;
+  pkt->opcode = htons(TFTP_PKT_ACK);
+  pkt->ack.block = htons((uint16_t)block);
+  server_send(sim, 4);
+}
+
+static void server_window(sim_t *sim) {
+  sim_server_t *server = &sim->server;
+  tftp_packet_t *pkt = (tftp_packet_t *)server->pkt;
+
+  server->sent = 0;
+  while ((server->sent < server->window_size) &&
+         (server->base + server->sent <= server->last)) {
+    int64_t block = server->base + server->sent;
+    int64_t offset = (block - 1) * server->block_size;
+    int64_t len = server->size - offset;
+    if (len > server->block_size) {
+      len = server->block_size;
+    }
+    pkt->opcode = htons(TFTP_PKT_DATA);
+    pkt->data.block = htons((uint16_t)block);
+    memcpy(pkt->data.data, server->file + offset, (size_t)len);
+    server_send(sim, 4 + (size_t)len);
+    server->sent++;
+  }
+}
+
+static void server_on_ack(sim_t *sim, uint16_t got) {
+  sim_server_t *server = &sim->server;
+  if (server->base == 0) {
+    if (got == 0) {
+      server->base = 1;
+      server->retry = 0;
+      server_window(sim);
+    }
+    return;
+  }
+
+  uint16_t diff = got - (uint16_t)(server->base - 1);
+  if ((diff > server->sent) || ((diff == 0) && server->rewound)) {
+    return;
+  }
+  server->retry = 0;
+  if (diff == 0) {
+    server->rewound = 1;
+    server_window(sim);
+    return;
+  }
+
+  server->rewound = 0;
+  server->base += diff;
+  if (server->base > server->last) {
+    server->done = 1;
+    server->deadline_us = 0;
+    return;
+  }
+  server_window(sim);
+}
+
+static void server_on_data(sim_t *sim, const tftp_packet_t *pkt,
+                           size_t size) {
+  sim_server_t *server = &sim->server;
+  size_t len = size - 4;
+  if (server->done) {
+    // the final ack got lost
+    if (ntohs(pkt->data.block) == (uint16_t)(server->base - 1)) {
+      server_ack(sim, server->base - 1);
+    }
+    return;
+  }
+
+  if (ntohs(pkt->data.block) != (uint16_t)server->base) {
+    if (!server->gap_acked) {
+      server->gap_acked = 1;
+      server->win_count = 0;
+      server_ack(sim, server->base - 1);
+    }
+    return;
+  }
+
+  int64_t offset = (server->base - 1) * server->block_size;
+  if ((len > (size_t)server->block_size) ||
+      (offset + (int64_t)len > server->size)) {
+    printf("test_xfer: bad block %" PRId64 "\n", server->base);
+    exit(1);
+  }
+  memcpy(server->file + offset, pkt->data.data, len);
+  server->base++;
+  server->retry = 0;
+  server->gap_acked = 0;
+  server->deadline_us = sim->now_us + SIM_RTO_US;
+  if (len < (size_t)server->block_size) {
+    server->done = 1;
+    server_ack(sim, server->base - 1);
+    server->deadline_us = 0;
+  } else if (++server->win_count >= server->window_size) {
+    server->win_count = 0;
+    server_ack(sim, server->base - 1);
+  }
+}
+
+static void server_on_packet(sim_t *sim, const uint8_t *data, size_t size) {
+  sim_server_t *server = &sim->server;
+  const tftp_packet_t *pkt = (const tftp_packet_t *)data;
+  sim->burst[0] = 0;
+
+  switch (ntohs(pkt->opcode)) {
+    case TFTP_PKT_RRQ:
+    case TFTP_PKT_WRQ: {
+      // the request again, its oack was lost
+      if (server_waiting(server)) {
+        server_oack(sim);
+      }
+      break;
+    }
+    case TFTP_PKT_ACK: {
+      if (server->is_read && !server->done) {
+        server_on_ack(sim, ntohs(pkt->ack.block));
+      }
+      break;
+    }
+    case TFTP_PKT_DATA: {
+      if (!server->is_read) {
+        server_on_data(sim, pkt, size);
+      }
+      break;
+    }
+    default: {
+      break;
+    }
+  }
+}
+
+static void server_timer(sim_t *sim) {
+  sim_server_t *server = &sim->server;
+  if (!server->deadline_us || (sim->now_us < server->deadline_us)) {
+    return;
+  }
+
+  sim->burst[0] = 0;
+  server->deadline_us = 0;
+  if (++server->retry > SIM_MAX_RETRY) {
+    return;
+  }
+  if (server_waiting(server)) {
+    server_oack(sim);
+  } else if (server->is_read) {
+    server->rewound = 0;
+    server_window(sim);
+  } else {
+    server->win_count = 0;
+    server_ack(sim, server->base - 1);
+  }
+}
+
+static ssize_t file_read(void *ctx, int64_t offset, void *buf, size_t size) {
+  sim_file_t *file = (sim_file_t *)ctx;
+  if (offset >= file->size) {
+    return 0;
+  }
+  if ((int64_t)size > file->size - offset) {
+    size = (size_t)(file->size - offset);
+  }
+  memcpy(buf, file->data + offset, size);
+  return (ssize_t)size;
+}
+
+static int file_write(void *ctx, int64_t offset, const void *data,
+                      size_t size) {
+  sim_file_t *file = (sim_file_t *)ctx;
+  if (offset + (int64_t)size > file->size) {
+    return -1;
+  }
+  memcpy(file->data + offset, data, size);
+  return 0;
+}
+
+static int run_case(const sim_case_t *test, uint64_t seed) {
+  sim_t *sim = (sim_t *)calloc(1, sizeof(sim_t));
+  uint8_t *src = (uint8_t *)malloc(test->size + 1);
+  uint8_t *dst = (uint8_t *)calloc(1, test->size + 1);
+  for (int64_t i = 0; i < test->size; i++) {
+    src[i] = (uint8_t)(i * 31 + (i >> 12) + seed);
+  }
+
+  sim->rng = seed * 0x9e3779b97f4a7c15ULL | 1;
+  sim->loss = test->loss;
+  sim->now_us = 1000000;
+  sim_server_t *server = &sim->server;
+  server->is_read = test->is_read;
+  server->file = test->is_read ? src : dst;
+  server->size = test->size;
+  server->block_size = test->block_size;
+  server->window_size = test->window_size;
+  server->base = test->is_read ? 0 : 1;
+  server->last = test->size / test->block_size + 1;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(TFTP_DEF_PORT);
+
+  sim_file_t file = {test->is_read ? dst : src, test->size};
+  tftp_xfer_io_t io = {file_read, file_write, &file};
+  tftp_xfer_t xfer;
+  if (tftp_xfer_init(&xfer, (struct sockaddr *)&addr, test->is_read, "f",
+                     test->block_size, test->window_size, 1,
+                     test->is_read ? 0 : test->size, &io) < 0) {
+    printf("test_xfer: init failed\n");
+    return -1;
+  }
+
+  // replies come from the port of the transfer
+  addr.sin_port = htons(SIM_SERVER_PORT);
+  int64_t start_us = sim->now_us;
+  while ((xfer.state == TFTP_XFER_RUNNING) &&
+         (sim->now_us - start_us < SIM_TIME_LIMIT_US)) {
+    const void *pkt;
+    size_t size;
+    sim->burst[1] = 0;
+    while (tftp_xfer_next(&xfer, sim->now_us, &pkt, &size)) {
+      sim_send(sim, 1, pkt, size);
+    }
+
+    int64_t next = tftp_xfer_deadline(&xfer);
+    if (sim->count &&
+        ((next < 0) || (sim->queue[sim->head].due_us < next))) {
+      next = sim->queue[sim->head].due_us;
+    }
+    if (server->deadline_us && ((next < 0) || (server->deadline_us < next))) {
+      next = server->deadline_us;
+    }
+    if (next < 0) {
+      break;
+    }
+    if (next > sim->now_us) {
+      sim->now_us = next;
+    }
+
+    while (sim->count && (sim->queue[sim->head].due_us <= sim->now_us)) {
+      sim_packet_t *pkt = &sim->queue[sim->head];
+      sim->head = (sim->head + 1) % SIM_QUEUE_SIZE;
+      sim->count--;
+      if (pkt->to_server) {
+        server_on_packet(sim, pkt->data, pkt->size);
+      } else {
+        tftp_xfer_feed(&xfer, (struct sockaddr *)&addr, pkt->data, pkt->size,
+                       sim->now_us);
+      }
+      free(pkt->data);
+    }
+    tftp_xfer_timer(&xfer, sim->now_us);
+    server_timer(sim);
+  }
+
+  int ok = (xfer.state == TFTP_XFER_DONE) &&
+           (memcmp(src, dst, (size_t)test->size) == 0) &&
+           (xfer.total_size == test->size);
+  printf("test_xfer: %s seed %" PRIu64 ": %s, %" PRId64 " bytes in %.3f s\n",
+         test->name, seed, ok ? "ok" : "FAILED", xfer.total_size,
+         (sim->now_us - start_us) / 1e6);
+
+  tftp_xfer_free(&xfer);
+  while (sim->count) {
+    free(sim->queue[sim->head].data);
+    sim->head = (sim->head + 1) % SIM_QUEUE_SIZE;
+    sim->count--;
+  }
+  free(src);
+  free(dst);
+  free(sim);
+  return ok ? 0 : -1;
+}
+
+// a put that gets an oack with a blksize it cannot use must fail with an
+// error to the server before it reads any block
+static int run_bad_oack(const char *blksize) {
+  uint8_t data[4096];
+  memset(data, 7, sizeof(data));
+  sim_file_t file = {data, sizeof(data)};
+  tftp_xfer_io_t io = {file_read, file_write, &file};
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(TFTP_DEF_PORT);
+  tftp_xfer_t xfer;
+  if (tftp_xfer_init(&xfer, (struct sockaddr *)&addr, 0, "f", 1024, 4, 1,
+                     sizeof(data), &io) < 0) {
+    printf("test_xfer: init failed\n");
+    return -1;
+  }
+
+  int64_t now_us = 1000000;
+  const void *out;
+  size_t out_size;
+  while (tftp_xfer_next(&xfer, now_us, &out, &out_size)) {
+  }
+
+  uint8_t buf[512];
+  tftp_packet_t *pkt = (tftp_packet_t *)buf;
+  pkt->opcode = htons(TFTP_PKT_OACK);
+  int len = sprintf(pkt->oack.option, "blksize%c%s%ctsize%c%d", 0, blksize, 0,
+                    0, (int)sizeof(data));
+  addr.sin_port = htons(SIM_SERVER_PORT);
+  tftp_xfer_feed(&xfer, (struct sockaddr *)&addr, buf, 2 + (size_t)len + 1,
+                 now_us);
+
+  int ok = 0;
+  while (tftp_xfer_next(&xfer, now_us, &out, &out_size)) {
+    uint16_t opcode = ntohs(((const tftp_packet_t *)out)->opcode);
+    if (opcode == TFTP_PKT_ERROR) {
+      ok = 1;
+    } else if (opcode == TFTP_PKT_DATA) {
+      ok = 0;
+      break;
+    }
+  }
+  ok = ok && (xfer.state == TFTP_XFER_FAILED);
+  printf("test_xfer: bad oack blksize \"%s\": %s\n", blksize,
+         ok ? "ok" : "FAILED");
+  tftp_xfer_free(&xfer);
+  return ok ? 0 : -1;
+}
+
+int main(void) {
+  // the timeouts of the lossy cases are expected
+  tftp_log_level = TFTP_LOG_ERROR;
+
+  static const sim_case_t cases[] = {
+      {"get overflow", 1, 3 * 1024 * 1024, 8192, 16, {0, 8, 1}},
+      {"get overflow lossy", 1, 3 * 1024 * 1024, 8192, 16, {0.01, 4, 0.5}},
+      {"get lossy", 1, 1024 * 1024, 1024, 8, {0.05, 64, 0}},
+      {"get plain", 1, 100000, 512, 1, {0.05, 64, 0}},
+      {"get wrap", 1, 81 * 32 * 1024, 32, 16, {0.01, 8, 0.2}},
+      {"put overflow", 0, 3 * 1024 * 1024, 8192, 16, {0, 8, 1}},
+      {"put overflow lossy", 0, 3 * 1024 * 1024, 8192, 16, {0.01, 4, 0.5}},
+      {"put lossy", 0, 1024 * 1024, 512, 4, {0.05, 64, 0}},
+      {"put exact", 0, 64 * 1024, 1024, 8, {0.05, 64, 0}},
+  };
+
+  int failed = 0;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+    for (uint64_t seed = 1; seed <= 3; seed++) {
+      if (run_case(&cases[i], seed) < 0) {
+        failed++;
+      }
+    }
+  }
+
+  static const char *bad_blksizes[] = {"-1", "0", "4", "7", "2048", "512x",
+                                       "x512", "", "99999999999999999999"};
+  for (size_t i = 0; i < sizeof(bad_blksizes) / sizeof(bad_blksizes[0]); i++) {
+    if (run_bad_oack(bad_blksizes[i]) < 0) {
+      failed++;
+    }
+  }
+
+  tftp_log_flush();
+  return failed ? 1 : 0;
+}
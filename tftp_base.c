@@ -1,8 +1,14 @@
 #include "tftp_base.h"
 
+#include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "tftp_impair.h"
+#include "tftp_log.h"
 
 const char *tftp_err_msg(tftp_err_t err) {
   static const char *msg[] = {
@@ -23,12 +29,64 @@ const char *tftp_err_msg(tftp_err_t err) {
   return msg[err];
 }
 
+int64_t tftp_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void tftp_rtt_reset(tftp_t *tftp, int tmo_sec, int tmo_option) {
+  tftp->tmo_sec = tmo_sec;
+  tftp->tmo_option = tmo_option;
+  tftp->srtt_us = 0;
+  tftp->rttvar_us = 0;
+  tftp->rto_us = (int64_t)tmo_sec * 1000000;
+}
+
+// rfc 6298 estimator, the sample must come from a packet that was not
+// retransmitted
+void tftp_rtt_update(tftp_t *tftp, int64_t rtt_us) {
+  if (tftp->tmo_option) {
+    return;
+  }
+
+  if (tftp->srtt_us == 0) {
+    tftp->srtt_us = rtt_us;
+    tftp->rttvar_us = rtt_us / 2;
+  } else {
+    int64_t delta = tftp->srtt_us - rtt_us;
+    if (delta < 0) {
+      delta = -delta;
+    }
+    tftp->rttvar_us = (3 * tftp->rttvar_us + delta) / 4;
+    tftp->srtt_us = (7 * tftp->srtt_us + rtt_us) / 8;
+  }
+
+  tftp->rto_us = tftp->srtt_us + 4 * tftp->rttvar_us;
+  if (tftp->rto_us < TFTP_MIN_RTO_MS * 1000) {
+    tftp->rto_us = TFTP_MIN_RTO_MS * 1000;
+  } else if (tftp->rto_us > TFTP_MAX_RTO_MS * 1000) {
+    tftp->rto_us = TFTP_MAX_RTO_MS * 1000;
+  }
+}
+
+void tftp_rtt_backoff(tftp_t *tftp) {
+  if (tftp->tmo_option) {
+    return;
+  }
+
+  tftp->rto_us *= 2;
+  if (tftp->rto_us > TFTP_MAX_RTO_MS * 1000) {
+    tftp->rto_us = TFTP_MAX_RTO_MS * 1000;
+  }
+}
+
 static char *write_option(tftp_t *tftp, char *buf, const char *name,
-                          int value) {
-  char *buf_end = (char *)(&tftp->tx_packet + sizeof(tftp_packet_t));
+                          int64_t value) {
+  char *buf_end = (char *)tftp->tx_packet + tftp->buf_size;
   size_t len = strlen(name) + 1;
   if (buf + len >= buf_end) {
-    printf("tftp: send buffer too small\n");
+    tftp_log(TFTP_LOG_ERROR, "tftp: send buffer too small\n");
     return NULL;
   }
 
@@ -36,46 +94,78 @@ static char *write_option(tftp_t *tftp, char *buf, const char *name,
   buf += len;
 
   if (value >= 0) {
-    if (buf + 16 >= buf_end) {
-      printf("tftp: send buffer too small");
+    if (buf + 24 >= buf_end) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: send buffer too small\n");
       return NULL;
     }
 
-    sprintf(buf, "%d", value);
+    sprintf(buf, "%" PRId64, value);
     buf += strlen(buf) + 1;
   }
 
   return buf;
 }
 
+ssize_t tftp_sendto(int sockfd, const void *pkt, size_t size,
+                    const struct sockaddr *to) {
+  if (tftp_impair_active()) {
+    struct iovec iov = {(void *)pkt, size};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_name = (void *)to;
+    msg.msg_namelen = sizeof(struct sockaddr);
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return tftp_impair_sendmsg(sockfd, &msg, 0);
+  }
+
+  return sendto(sockfd, pkt, size, 0, to, sizeof(struct sockaddr));
+}
+
+ssize_t tftp_recvfrom(int sockfd, void *buf, size_t size, int flags,
+                      struct sockaddr *from) {
+  ssize_t len;
+  do {
+    socklen_t addr_len = sizeof(struct sockaddr);
+    len = recvfrom(sockfd, buf, size, flags, from, &addr_len);
+  } while ((len >= 0) && tftp_impair_active() && tftp_impair_rx_drop());
+
+  return len;
+}
+
 int tftp_send_packet(tftp_t *tftp, tftp_packet_t *pkt, int size) {
-  ssize_t snd_size = sendto(tftp->socket, (const void *)pkt, size, 0,
-                            &tftp->remote, sizeof(tftp->remote));
+  ssize_t snd_size = tftp_sendto(tftp->socket, pkt, size, &tftp->remote);
+  tftp->tx_size = size;
+  tftp->tx_time_us = tftp_now_us();
+  tftp->tx_resent = 0;
   if (snd_size < 0) {
-    printf("tftp: send error\n");
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      return 1;
+    }
+
+    tftp_log(TFTP_LOG_ERROR, "tftp: send error\n");
     return -1;
   }
 
-  tftp->tx_size = size;
   return 0;
 }
 
-int tftp_send_request(tftp_t *tftp, int is_read, const char *filename,
-                      uint32_t file_size, int option) {
-  tftp_packet_t *pkt = &tftp->tx_packet;
+int tftp_make_request(tftp_t *tftp, int is_read, const char *filename,
+                      int64_t file_size, int option) {
+  tftp_packet_t *pkt = tftp->tx_packet;
 
   pkt->opcode = htons(is_read ? TFTP_PKT_RRQ : TFTP_PKT_WRQ);
 
   char *buf = (char *)pkt->req.args;
   buf = write_option(tftp, buf, filename, -1);
   if (buf == NULL) {
-    printf("tftp: filename too long: %s\n", filename);
+    tftp_log(TFTP_LOG_ERROR, "tftp: filename too long: %s\n", filename);
     return -1;
   }
 
   buf = write_option(tftp, buf, "octet", -1);
   if (buf == NULL) {
-    printf("tftp: filename too long: %s\n", filename);
+    tftp_log(TFTP_LOG_ERROR, "tftp: filename too long: %s\n", filename);
     return -1;
   }
 
@@ -89,12 +179,35 @@ int tftp_send_request(tftp_t *tftp, int is_read, const char *filename,
     if (buf == NULL) {
       return -1;
     }
+
+    if (tftp->window_size > TFTP_DEF_WINSIZE) {
+      buf = write_option(tftp, buf, "windowsize", tftp->window_size);
+      if (buf == NULL) {
+        return -1;
+      }
+    }
+
+    if (tftp->offset_option) {
+      buf = write_option(tftp, buf, "offset", tftp->offset);
+      if (buf == NULL) {
+        return -1;
+      }
+    }
   }
 
-  int size = (int)(buf - (char *)pkt->req.args) + 2;
-  int err = tftp_send_packet(tftp, pkt, size);
+  return (int)(buf - (char *)pkt->req.args) + 2;
+}
+
+int tftp_send_request(tftp_t *tftp, int is_read, const char *filename,
+                      int64_t file_size, int option) {
+  int size = tftp_make_request(tftp, is_read, filename, file_size, option);
+  if (size < 0) {
+    return -1;
+  }
+
+  int err = tftp_send_packet(tftp, tftp->tx_packet, size);
   if (err < 0) {
-    printf("tftp: send req failed.\n");
+    tftp_log(TFTP_LOG_ERROR, "tftp: send req failed.\n");
     return -1;
   }
 
@@ -102,159 +215,267 @@ int tftp_send_request(tftp_t *tftp, int is_read, const char *filename,
 }
 
 int tftp_send_ack(tftp_t *tftp, uint16_t block_num) {
-  tftp_packet_t *pkt = &tftp->tx_packet;
+  tftp_packet_t *pkt = tftp->tx_packet;
 
   pkt->opcode = htons(TFTP_PKT_ACK);
   pkt->ack.block = htons(block_num);
 
   int err = tftp_send_packet(tftp, pkt, 4);
   if (err < 0) {
-    printf("tftp: send ack failed. block num=%d\n", block_num);
+    tftp_log(TFTP_LOG_ERROR, "tftp: send ack failed. block num=%d\n",
+             block_num);
     return -1;
   }
 
-  return 0;
+  return err;
 }
 
 int tftp_send_data(tftp_t *tftp, uint16_t block_num, size_t size) {
-  tftp_packet_t *pkt = &tftp->tx_packet;
+  tftp_packet_t *pkt = tftp->tx_packet;
 
   pkt->opcode = htons(TFTP_PKT_DATA);
   pkt->data.block = htons(block_num);
 
   int err = tftp_send_packet(tftp, pkt, 4 + (int)size);
   if (err < 0) {
-    printf("tftp: send data failed. block num=%d\n", block_num);
+    tftp_log(TFTP_LOG_ERROR, "tftp: send data failed. block num=%d\n",
+             block_num);
     return -1;
   }
 
-  return 0;
+  return err;
 }
 
 int tftp_send_error(tftp_t *tftp, uint16_t code) {
-  tftp_packet_t *pkt = &tftp->tx_packet;
+  return tftp_send_error_msg(tftp, code, tftp_err_msg(code));
+}
+
+// an error packet in tx_packet, msg NULL for the text of the code
+int tftp_make_error(tftp_t *tftp, uint16_t code, const char *msg) {
+  tftp_packet_t *pkt = tftp->tx_packet;
+  if (msg == NULL) {
+    msg = tftp_err_msg(code);
+  }
 
   pkt->opcode = htons(TFTP_PKT_ERROR);
   pkt->err.code = htons(code);
-
-  const char *msg = tftp_err_msg(code);
   strcpy(pkt->err.msg, msg);
+  return 4 + (int)strlen(msg) + 1;
+}
 
-  int err = tftp_send_packet(tftp, pkt, 4 + (int)strlen(msg) + 1);
+// an error with a message of its own, mostly for code 0 (not defined)
+int tftp_send_error_msg(tftp_t *tftp, uint16_t code, const char *msg) {
+  int size = tftp_make_error(tftp, code, msg);
+  int err = tftp_send_packet(tftp, tftp->tx_packet, size);
   if (err < 0) {
-    printf("tftp: send error failed. error code=%d\n", code);
+    tftp_log(TFTP_LOG_ERROR, "tftp: send error failed. error code=%d\n", code);
     return -1;
   }
 
-  return 0;
+  return err;
 }
 
 int tftp_resend(tftp_t *tftp) {
-  tftp_packet_t *pkt = &tftp->tx_packet;
+  tftp_packet_t *pkt = tftp->tx_packet;
 
-  if (tftp_send_packet(tftp, pkt, tftp->tx_size) < 0) {
-    printf("tftp: resend error.\n");
+  int err = tftp_send_packet(tftp, pkt, tftp->tx_size);
+  tftp->tx_resent = 1;
+  if (err < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: resend error.\n");
     return -1;
   }
 
+  return err;
+}
+
+int tftp_recv_packet(tftp_t *tftp, size_t *pkt_size) {
+  ssize_t size = tftp_recvfrom(tftp->socket, tftp->rx_packet, tftp->buf_size,
+                               0, &tftp->remote);
+  if (size < 0) {
+    return -1;
+  }
+
+  *pkt_size = (size_t)size;
   return 0;
 }
 
+// wait for the expected packet. anything else, like a duplicate of an
+// earlier block or ack, is only counted; resending on it would let one late
+// packet double the traffic for the rest of the transfer (sorcerer's
+// apprentice). only the retransmission timer resends
 int tftp_wait_packet(tftp_t *tftp, tftp_op_t op, uint16_t block,
                      size_t *pkt_size) {
-  tftp_packet_t *pkt = &tftp->rx_packet;
+  tftp_packet_t *pkt = tftp->rx_packet;
   tftp->tmo_retry = TFTP_MAX_RETRY;
+  int64_t tmo_us = tftp->rto_us;
   while (1) {
-    socklen_t len = sizeof(struct sockaddr);
-    ssize_t size = recvfrom(tftp->socket, (uint8_t *)pkt, sizeof(tftp_packet_t),
-                            0, &tftp->remote, &len);
-    if (size < 0) {
-      printf("recv tmo\n");
+    if (tftp->rcvtmo_us != tmo_us) {
+      struct timeval tmo;
+      tmo.tv_sec = tmo_us / 1000000;
+      tmo.tv_usec = tmo_us % 1000000;
+      setsockopt(tftp->socket, SOL_SOCKET, SO_RCVTIMEO, (const void *)&tmo,
+                 sizeof(tmo));
+      tftp->rcvtmo_us = tmo_us;
+    }
+
+    size_t size;
+    if (tftp_recv_packet(tftp, &size) < 0) {
+      tftp_log(TFTP_LOG_DEBUG, "recv tmo\n");
       if (--tftp->tmo_retry == 0) {
-        printf("tftp: wait tmo\n");
+        tftp_log(TFTP_LOG_WARN, "tftp: wait tmo\n");
         return -1;
-      } else {
-        tftp_resend(tftp);
-        continue;
       }
+
+      tftp_rtt_backoff(tftp);
+      tftp_resend(tftp);
+      tmo_us = tftp->rto_us;
+      continue;
     }
 
     uint16_t opcode = ntohs(pkt->opcode);
-    if (op == TFTP_PKT_REQ) {
-      if (opcode != TFTP_PKT_RRQ && opcode != TFTP_PKT_WRQ) {
-        continue;
+    int expected;
+    if (opcode == TFTP_PKT_ERROR) {
+      expected = 1;
+    } else if (op == TFTP_PKT_REQ) {
+      expected = (opcode == TFTP_PKT_RRQ) || (opcode == TFTP_PKT_WRQ);
+    } else if ((opcode == TFTP_PKT_DATA) || (opcode == TFTP_PKT_ACK)) {
+      expected = (opcode == op) && (ntohs(pkt->data.block) == block);
+    } else {
+      expected = opcode == op;
+    }
+
+    if (!expected) {
+      // keep the deadline of the packet last sent, a stream of duplicates
+      // must not hold off the timer
+      tftp->rx_dups++;
+      tmo_us = tftp->tx_time_us + tftp->rto_us - tftp_now_us();
+      if (tmo_us < 1000) {
+        tmo_us = 1000;
       }
-    } else if (opcode != op) {
-      tftp_resend(tftp);
       continue;
     }
 
-    *pkt_size = (size_t)size;
+    *pkt_size = size;
 
     switch (opcode) {
-      case TFTP_PKT_DATA:
-      case TFTP_PKT_ACK: {
-        if (ntohs(pkt->data.block) != block) {
-          tftp_resend(tftp);
-          break;
-        }
-        return 0;
-      }
       case TFTP_PKT_ERROR: {
-        pkt->err.msg[tftp->block_size - 1] = '\0';
-        printf("tftp: recv error = %d, reason: %s\n", ntohs(pkt->err.code),
-               pkt->err.msg);
+        ((char *)pkt)[size < tftp->buf_size ? size : tftp->buf_size - 1] = '\0';
+        tftp_log(TFTP_LOG_ERROR, "tftp: recv error = %d, reason: %s\n",
+                 ntohs(pkt->err.code), pkt->err.msg);
         return -1;
       }
-      case TFTP_PKT_RRQ:
-      case TFTP_PKT_WRQ: {
+      case TFTP_PKT_OACK: {
+        if (!tftp->tx_resent) {
+          tftp_rtt_update(tftp, tftp_now_us() - tftp->tx_time_us);
+        }
+        if (tftp_parse_oack(tftp, pkt, size) < 0) {
+          tftp_send_error(tftp, TFTP_ERR_OP);
+          return -1;
+        }
         return 0;
       }
-      case TFTP_PKT_OACK: {
-        tftp_parse_oack(tftp);
+      case TFTP_PKT_DATA:
+      case TFTP_PKT_ACK: {
+        if (!tftp->tx_resent) {
+          tftp_rtt_update(tftp, tftp_now_us() - tftp->tx_time_us);
+        }
         return 0;
       }
       default: {
-        tftp_resend(tftp);
-        break;
+        return 0;
       }
     }
   }
 }
 
-int tftp_parse_oack(tftp_t *tftp) {
-  char *buf = (char *)tftp->rx_packet.oack.option;
-  char *end = (char *)&tftp->rx_packet + sizeof(tftp_packet_t);
+// a whole decimal option value, nothing else may follow the digits
+static int oack_number(const char *value, int64_t *number) {
+  char *end;
+  errno = 0;
+  *number = strtoll(value, &end, 10);
+  return ((end == value) || (*end != '\0') || (errno != 0)) ? -1 : 0;
+}
+
+// the options of an oack of size bytes, a failure is answered with an error
+// by the caller
+int tftp_parse_oack(tftp_t *tftp, const tftp_packet_t *pkt, size_t size) {
+  const char *buf = pkt->oack.option;
+  const char *end = (const char *)pkt + size;
+  // the last option must end inside the packet
+  while ((end > buf) && (end[-1] != '\0')) {
+    end--;
+  }
+
+  // a server that leaves out the offset restarts from the beginning
+  int64_t offset = tftp->offset;
+  tftp->offset = 0;
 
   while ((buf < end) && (*buf)) {
+    // every option is a name and a value
+    const char *value = buf + strlen(buf) + 1;
+    if (value >= end) {
+      break;
+    }
+
+    // values are checked before use, the blksize sizes the reads of a put.
+    // other options, like multicast, are not numbers and not used here
+    int64_t number = 0;
+    int numeric = (strcmp(buf, "blksize") == 0) ||
+                  (strcmp(buf, "tsize") == 0) ||
+                  (strcmp(buf, "windowsize") == 0) ||
+                  (strcmp(buf, "timeout") == 0) ||
+                  (strcmp(buf, "offset") == 0);
+    if (numeric && (oack_number(value, &number) < 0)) {
+      tftp_log(TFTP_LOG_INFO, "tftp: bad %s value %s\n", buf, value);
+      return -1;
+    }
+
     if (strcmp(buf, "blksize") == 0) {
-      buf += strlen(buf) + 1;
-      int blksize = atoi(buf);
-      if (blksize == 0) {
-        printf("tftp: unknown blksize\n");
-        tftp_send_error(tftp, TFTP_ERR_OP);
-        return -1;
-      } else if (blksize < tftp->block_size) {
-        tftp->block_size = blksize;
-        printf("tftp: use new blksize %d\n", blksize);
-      } else if (blksize > tftp->block_size) {
-        printf("tftp: block size %d\n", blksize);
+      if ((number < TFTP_MIN_BLKSIZE) || (number > tftp->block_size)) {
+        tftp_log(TFTP_LOG_INFO, "tftp: block size %" PRId64 "\n", number);
         return -1;
       }
-      buf += strlen(buf) + 1;
+      if (number < tftp->block_size) {
+        tftp->block_size = (int)number;
+        tftp_log(TFTP_LOG_INFO, "tftp: use new blksize %d\n",
+                 tftp->block_size);
+      }
     } else if (strcmp(buf, "tsize") == 0) {
-      buf += strlen(buf) + 1;
-      tftp->file_size = atoi(buf);
-
-      buf += strlen(buf) + 1;
-    } else {
-      buf += strlen(buf) + 1;
+      if (number < 0) {
+        tftp_log(TFTP_LOG_INFO, "tftp: tsize %" PRId64 "\n", number);
+        return -1;
+      }
+      tftp->file_size = number;
+    } else if (strcmp(buf, "windowsize") == 0) {
+      if ((number <= 0) || (number > tftp->window_size)) {
+        tftp_log(TFTP_LOG_INFO, "tftp: window size %" PRId64 "\n", number);
+        return -1;
+      }
+      tftp->window_size = (int)number;
+    } else if (strcmp(buf, "timeout") == 0) {
+      if ((number <= 0) || (number > TFTP_MAX_TMO_SEC)) {
+        tftp_log(TFTP_LOG_INFO, "tftp: timeout %" PRId64 "\n", number);
+        return -1;
+      }
+      tftp_rtt_reset(tftp, (int)number, 1);
+    } else if (strcmp(buf, "offset") == 0) {
+      int64_t offset_value = number;
+      if (!tftp->offset_option || (offset_value < 0) ||
+          (offset_value > offset)) {
+        tftp_log(TFTP_LOG_INFO, "tftp: offset %" PRId64 "\n", offset_value);
+        return -1;
+      }
+      tftp->offset = offset_value;
     }
+
+    buf = value + strlen(value) + 1;
   }
+
+  return 0;
 }
 
 int tftp_send_oack(tftp_t *tftp) {
-  tftp_packet_t *pkt = &tftp->tx_packet;
+  tftp_packet_t *pkt = tftp->tx_packet;
 
   pkt->opcode = htons(TFTP_PKT_OACK);
   char *buf = pkt->oack.option;
@@ -266,12 +487,212 @@ int tftp_send_oack(tftp_t *tftp) {
   if (buf == NULL) {
     return -1;
   }
+  if (tftp->window_size > TFTP_DEF_WINSIZE) {
+    buf = write_option(tftp, buf, "windowsize", tftp->window_size);
+    if (buf == NULL) {
+      return -1;
+    }
+  }
+  if (tftp->tmo_option) {
+    buf = write_option(tftp, buf, "timeout", tftp->tmo_sec);
+    if (buf == NULL) {
+      return -1;
+    }
+  }
+  if (tftp->offset_option) {
+    buf = write_option(tftp, buf, "offset", tftp->offset);
+    if (buf == NULL) {
+      return -1;
+    }
+  }
+  if (tftp->mcast_option) {
+    buf = write_option(tftp, buf, "multicast", -1);
+    if (buf == NULL) {
+      return -1;
+    }
+    buf = write_option(tftp, buf, tftp->mcast_option, -1);
+    if (buf == NULL) {
+      return -1;
+    }
+  }
 
   int err = tftp_send_packet(tftp, pkt, buf - (char *)pkt);
   if (err < 0) {
-    printf("tftp: send oack failed.\n");
+    tftp_log(TFTP_LOG_ERROR, "tftp: send oack failed.\n");
+    return -1;
+  }
+
+  return err;
+}
+
+int tftp_batch_init(tftp_batch_t *batch, size_t pkt_size) {
+  memset(batch, 0, sizeof(tftp_batch_t));
+  batch->pkt_size = pkt_size;
+  batch->packets = (uint8_t *)malloc(TFTP_BATCH_SIZE * pkt_size);
+  if (batch->packets == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: alloc batch failed.\n");
     return -1;
   }
 
   return 0;
-}
\ No newline at end of file
+}
+
+void tftp_batch_free(tftp_batch_t *batch) {
+  free(batch->packets);
+  batch->packets = NULL;
+  batch->count = 0;
+}
+
+tftp_packet_t *tftp_batch_packet(tftp_batch_t *batch, int idx) {
+  return (tftp_packet_t *)(batch->packets + (size_t)idx * batch->pkt_size);
+}
+
+tftp_packet_t *tftp_batch_next(tftp_batch_t *batch) {
+  if (batch->count >= TFTP_BATCH_SIZE) {
+    return NULL;
+  }
+
+  return tftp_batch_packet(batch, batch->count);
+}
+
+void tftp_batch_push(tftp_batch_t *batch, size_t size) {
+  int idx = batch->count++;
+  struct msghdr *msg = &batch->msgs[idx].msg_hdr;
+  batch->iovs[idx][0].iov_base = tftp_batch_packet(batch, idx);
+  batch->iovs[idx][0].iov_len = size;
+  msg->msg_iov = batch->iovs[idx];
+  msg->msg_iovlen = 1;
+}
+
+// queue the 4 byte header from tftp_batch_next followed by data sent straight
+// from the caller's memory, which has to stay mapped until the send
+void tftp_batch_push_ref(tftp_batch_t *batch, const void *data, size_t size) {
+  int idx = batch->count++;
+  struct msghdr *msg = &batch->msgs[idx].msg_hdr;
+  batch->iovs[idx][0].iov_base = tftp_batch_packet(batch, idx);
+  batch->iovs[idx][0].iov_len = 4;
+  batch->iovs[idx][1].iov_base = (void *)data;
+  batch->iovs[idx][1].iov_len = size;
+  msg->msg_iov = batch->iovs[idx];
+  msg->msg_iovlen = size ? 2 : 1;
+}
+
+// send every queued packet with one sendmmsg, returns the number of packets
+// accepted by the socket; the batch is empty afterwards
+int tftp_batch_send(tftp_t *tftp, tftp_batch_t *batch, int flags) {
+  int count = batch->count;
+  batch->count = 0;
+  batch->zc_sent = 0;
+  if (count == 0) {
+    return 0;
+  }
+
+  for (int i = 0; i < count; i++) {
+    struct msghdr *msg = &batch->msgs[i].msg_hdr;
+    msg->msg_name = &tftp->remote;
+    msg->msg_namelen = sizeof(tftp->remote);
+    msg->msg_control = NULL;
+    msg->msg_controllen = 0;
+    msg->msg_flags = 0;
+  }
+
+  if (tftp_impair_active()) {
+    // dropped packets would take no zerocopy id
+    int sent = tftp_impair_sendmmsg(tftp->socket, batch->msgs, count,
+                                    flags & ~MSG_ZEROCOPY);
+    if (sent < 0) {
+      int err = errno;
+      tftp_log(TFTP_LOG_ERROR, "tftp: send batch error\n");
+      errno = err;
+    }
+    return sent;
+  }
+
+  int sent = sendmmsg(tftp->socket, batch->msgs, count, flags);
+  if ((sent < 0) && (errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+    // out of memory for zerocopy notifications, copy this batch
+    flags &= ~MSG_ZEROCOPY;
+    sent = sendmmsg(tftp->socket, batch->msgs, count, flags);
+  }
+  if ((sent > 0) && (flags & MSG_ZEROCOPY)) {
+    batch->zc_sent = sent;
+  }
+  if (sent < 0) {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      return 0;
+    }
+
+    int err = errno;
+    tftp_log(TFTP_LOG_ERROR, "tftp: send batch error\n");
+    errno = err;
+    return -1;
+  }
+
+  return sent;
+}
+
+// drop what the impairment loses of the n datagrams received at start,
+// returns the new end of the batch
+static int batch_rx_drop(tftp_batch_t *batch, int start, int n) {
+  if (!tftp_impair_active()) {
+    return start + n;
+  }
+
+  int kept = start;
+  for (int i = start; i < start + n; i++) {
+    if (tftp_impair_rx_drop()) {
+      continue;
+    }
+    if (kept != i) {
+      batch->msgs[kept].msg_len = batch->msgs[i].msg_len;
+      batch->remotes[kept] = batch->remotes[i];
+      memcpy(tftp_batch_packet(batch, kept), tftp_batch_packet(batch, i),
+             batch->msgs[i].msg_len);
+    }
+    kept++;
+  }
+
+  return kept;
+}
+
+// drain up to TFTP_BATCH_SIZE pending datagrams with one recvmmsg, returns
+// the number received (0 when nothing is pending). never blocks, also on a
+// blocking socket
+int tftp_batch_recv(tftp_t *tftp, tftp_batch_t *batch) {
+  for (int i = 0; i < TFTP_BATCH_SIZE; i++) {
+    struct msghdr *msg = &batch->msgs[i].msg_hdr;
+    memset(msg, 0, sizeof(struct msghdr));
+    batch->iovs[i][0].iov_base = tftp_batch_packet(batch, i);
+    batch->iovs[i][0].iov_len = batch->pkt_size;
+    msg->msg_name = &batch->remotes[i];
+    msg->msg_namelen = sizeof(batch->remotes[i]);
+    msg->msg_iov = batch->iovs[i];
+    msg->msg_iovlen = 1;
+  }
+
+  // a full batch tells the caller more may be pending, datagrams dropped by
+  // the impairment are refilled to keep that true
+  int count = 0;
+  do {
+    int want = TFTP_BATCH_SIZE - count;
+    int ret = recvmmsg(tftp->socket, batch->msgs + count, want, MSG_DONTWAIT,
+                       NULL);
+    if (ret < 0) {
+      if ((count > 0) || (errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+        break;
+      }
+
+      batch->count = 0;
+      tftp_log(TFTP_LOG_ERROR, "tftp: recv batch error\n");
+      return -1;
+    }
+
+    count = batch_rx_drop(batch, count, ret);
+    if (ret < want) {
+      break;
+    }
+  } while (count < TFTP_BATCH_SIZE);
+
+  batch->count = count;
+  return count;
+}
@@ -4,6 +4,7 @@
 #include <arpa/inet.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/types.h>
 
 typedef enum _tftp_err_t {
   TFTP_ERR_OK = 0,
@@ -29,11 +30,20 @@ typedef enum _tftp_op_t {
   TFTP_PKT_REQ,
 } tftp_op_t;
 
-#define TFTP_BLK_SIZE 8192
+// rfc 2348 blksize range, packets are sized at runtime from it
+#define TFTP_MIN_BLKSIZE 8
+#define TFTP_MAX_BLKSIZE 65464
 #define TFTP_DEF_BLKSIZE 512
+// bytes of a packet carrying blksize bytes of data
+#define TFTP_PKT_SIZE(blksize) (4 + (size_t)(blksize))
+#define TFTP_DEF_WINSIZE 1
+#define TFTP_MAX_WINSIZE 64
 #define TFTP_DEF_PORT 69
 #define TFTP_MAX_RETRY 10
-#define TFTP_TMO_SEC 3
+#define TFTP_TMO_SEC 1
+#define TFTP_MAX_TMO_SEC 255
+#define TFTP_MIN_RTO_MS 50
+#define TFTP_MAX_RTO_MS 10000
 
 #pragma pack(1)
 
@@ -47,7 +57,7 @@ typedef struct _tftp_packet_t {
 
     struct {
       uint16_t block;
-      uint8_t data[TFTP_BLK_SIZE];
+      uint8_t data[1];
     } data;
 
     struct {
@@ -71,34 +81,96 @@ typedef struct _tftp_t {
   int socket;
   struct sockaddr remote;
 
+  // retransmission timeout, estimated from the rtt unless the timeout
+  // option fixed it to tmo_sec
   int tmo_sec;
+  int tmo_option;
   int tmo_retry;
+  int64_t srtt_us;
+  int64_t rttvar_us;
+  int64_t rto_us;
+  int64_t rcvtmo_us;
+  int64_t tx_time_us;
+  int tx_resent;
+  // unexpected packets tftp_wait_packet ignored, mostly duplicates
+  int64_t rx_dups;
 
   int tx_size;
   int block_size;
-  int file_size;
-  tftp_packet_t tx_packet;
-  tftp_packet_t rx_packet;
+  int window_size;
+  int64_t file_size;
+  // byte offset the transfer restarts at, block 1 starts there
+  int64_t offset;
+  int offset_option;
+  const char *mcast_option;
+  // packet buffers of buf_size bytes each, owned by the caller. a server
+  // session only sends control packets from tx_packet and has no rx_packet
+  size_t buf_size;
+  tftp_packet_t *tx_packet;
+  tftp_packet_t *rx_packet;
 } tftp_t;
 
+#define TFTP_BATCH_SIZE 32
+
+typedef struct _tftp_batch_t {
+  int count;
+  struct mmsghdr msgs[TFTP_BATCH_SIZE];
+  // a packet, or the header of a packet and its data elsewhere
+  struct iovec iovs[TFTP_BATCH_SIZE][2];
+  struct sockaddr remotes[TFTP_BATCH_SIZE];
+  // TFTP_BATCH_SIZE packets of pkt_size bytes, see tftp_batch_packet
+  size_t pkt_size;
+  uint8_t *packets;
+  // packets of the last send that went with MSG_ZEROCOPY, each took the
+  // next zerocopy id of the socket
+  int zc_sent;
+} tftp_batch_t;
+
 #define TFTP_NAME_SIZE 128
 typedef struct _tftp_req_t {
   tftp_t tftp;
   tftp_op_t op;
   int option;
   int blksize;
-  int filesize;
+  int winsize;
+  int timeout;
+  int mcast;
+  int64_t offset;
+  int64_t filesize;
   char filename[TFTP_NAME_SIZE];
 } tftp_req_t;
 
+const char *tftp_err_msg(tftp_err_t err);
+int64_t tftp_now_us(void);
+void tftp_rtt_reset(tftp_t *tftp, int tmo_sec, int tmo_option);
+void tftp_rtt_update(tftp_t *tftp, int64_t rtt_us);
+void tftp_rtt_backoff(tftp_t *tftp);
+ssize_t tftp_sendto(int sockfd, const void *pkt, size_t size,
+                    const struct sockaddr *to);
+ssize_t tftp_recvfrom(int sockfd, void *buf, size_t size, int flags,
+                      struct sockaddr *from);
+int tftp_make_request(tftp_t *tftp, int is_read, const char *filename,
+                      int64_t file_size, int option);
 int tftp_send_request(tftp_t *tftp, int is_read, const char *filename,
-                      uint32_t file_size, int option);
+                      int64_t file_size, int option);
 int tftp_send_ack(tftp_t *tftp, uint16_t block_num);
 int tftp_send_data(tftp_t *tftp, uint16_t block_num, size_t size);
 int tftp_send_error(tftp_t *tftp, uint16_t code);
+int tftp_make_error(tftp_t *tftp, uint16_t code, const char *msg);
+int tftp_send_error_msg(tftp_t *tftp, uint16_t code, const char *msg);
+int tftp_resend(tftp_t *tftp);
+int tftp_recv_packet(tftp_t *tftp, size_t *pkt_size);
 int tftp_wait_packet(tftp_t *tftp, tftp_op_t op, uint16_t block,
                      size_t *pkt_size);
-int tftp_parse_oack(tftp_t *tftp);
+int tftp_parse_oack(tftp_t *tftp, const tftp_packet_t *pkt, size_t size);
+int tftp_batch_init(tftp_batch_t *batch, size_t pkt_size);
+void tftp_batch_free(tftp_batch_t *batch);
+tftp_packet_t *tftp_batch_packet(tftp_batch_t *batch, int idx);
+tftp_packet_t *tftp_batch_next(tftp_batch_t *batch);
+void tftp_batch_push(tftp_batch_t *batch, size_t size);
+void tftp_batch_push_ref(tftp_batch_t *batch, const void *data, size_t size);
+int tftp_batch_send(tftp_t *tftp, tftp_batch_t *batch, int flags);
+int tftp_batch_recv(tftp_t *tftp, tftp_batch_t *batch);
 int tftp_send_oack(tftp_t *tftp);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,479 @@
+#include <fcntl.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tftp_base.h"
+#include "tftp_impair.h"
+#include "tftp_log.h"
+#include "tftp_server.h"
+
+// loopback load generator: the server runs in this process, every client
+// thread runs transfers one after another through the base api, data is
+// neither read from nor written to disk on the client side
+
+#define BENCH_FILE "bench.dat"
+
+typedef enum _bench_mode_t {
+  BENCH_GET = 0,
+  BENCH_PUT,
+  BENCH_MIX,
+} bench_mode_t;
+
+typedef struct _bench_opts_t {
+  int clients;
+  int transfers;
+  int64_t file_size;
+  int block_size;
+  bench_mode_t mode;
+  uint16_t port;
+  int shards;
+  tftpd_engine_t engine;
+  double min_mbps;
+  int64_t rate_limit;
+  int64_t client_rate_limit;
+} bench_opts_t;
+
+typedef struct _bench_client_t {
+  int id;
+  pthread_t thread;
+  // transfer latencies in us, -1 for failed transfers
+  int64_t *latency;
+  int64_t bytes;
+  int failed;
+  int64_t cpu_ns;
+} bench_client_t;
+
+static bench_opts_t opts;
+static char bench_dir[] = "/tmp/tftp_bench.XXXXXX";
+static uint8_t *put_data;
+
+static int64_t bench_cpu_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_open(tftp_t *tftp, tftp_packet_t *tx, tftp_packet_t *rx,
+                      size_t buf_size) {
+  memset(tftp, 0, sizeof(tftp_t));
+  tftp->socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (tftp->socket < 0) {
+    printf("bench: create socket failed.\n");
+    return -1;
+  }
+
+  tftp->buf_size = buf_size;
+  tftp->tx_packet = tx;
+  tftp->rx_packet = rx;
+  tftp->block_size = opts.block_size;
+  tftp->window_size = TFTP_DEF_WINSIZE;
+  tftp->tmo_retry = TFTP_MAX_RETRY;
+  tftp_rtt_reset(tftp, TFTP_TMO_SEC, 0);
+
+  struct sockaddr_in *sockaddr = (struct sockaddr_in *)&tftp->remote;
+  sockaddr->sin_family = AF_INET;
+  sockaddr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  sockaddr->sin_port = htons(opts.port);
+  return 0;
+}
+
+static int64_t bench_get(tftp_t *tftp) {
+  size_t recv_size = 0;
+  if ((tftp_send_request(tftp, 1, BENCH_FILE, 0, 1) < 0) ||
+      (tftp_wait_packet(tftp, TFTP_PKT_OACK, 0, &recv_size) < 0) ||
+      (tftp_send_ack(tftp, 0) < 0)) {
+    return -1;
+  }
+
+  int64_t total_size = 0;
+  uint16_t block = 1;
+  while (1) {
+    if ((tftp_wait_packet(tftp, TFTP_PKT_DATA, block, &recv_size) < 0) ||
+        (tftp_send_ack(tftp, block) < 0)) {
+      return -1;
+    }
+
+    total_size += (int64_t)recv_size - 4;
+    block++;
+    if (recv_size - 4 < (size_t)tftp->block_size) {
+      break;
+    }
+  }
+
+  return total_size == opts.file_size ? total_size : -1;
+}
+
+static int64_t bench_put(tftp_t *tftp, int id, int idx) {
+  char filename[TFTP_NAME_SIZE];
+  snprintf(filename, sizeof(filename), "put_%d_%d.dat", id, idx);
+
+  size_t recv_size = 0;
+  if ((tftp_send_request(tftp, 0, filename, opts.file_size, 1) < 0) ||
+      (tftp_wait_packet(tftp, TFTP_PKT_OACK, 0, &recv_size) < 0)) {
+    return -1;
+  }
+
+  int64_t offset = 0;
+  uint16_t block = 1;
+  while (1) {
+    size_t size = opts.block_size;
+    if (opts.file_size - offset < (int64_t)size) {
+      size = (size_t)(opts.file_size - offset);
+    }
+    memcpy(tftp->tx_packet->data.data, put_data + offset, size);
+
+    if ((tftp_send_data(tftp, block, size) < 0) ||
+        (tftp_wait_packet(tftp, TFTP_PKT_ACK, block, &recv_size) < 0)) {
+      return -1;
+    }
+
+    offset += (int64_t)size;
+    block++;
+    if (size < (size_t)opts.block_size) {
+      break;
+    }
+  }
+
+  return offset;
+}
+
+static void *bench_client_thread(void *arg) {
+  bench_client_t *client = (bench_client_t *)arg;
+  size_t buf_size = TFTP_PKT_SIZE(
+      opts.block_size > TFTP_DEF_BLKSIZE ? opts.block_size : TFTP_DEF_BLKSIZE);
+  tftp_packet_t *tx = (tftp_packet_t *)malloc(buf_size);
+  tftp_packet_t *rx = (tftp_packet_t *)malloc(buf_size);
+  if ((tx == NULL) || (rx == NULL)) {
+    printf("bench: alloc client buffers failed.\n");
+    client->failed = opts.transfers;
+    goto client_exit;
+  }
+
+  for (int i = 0; i < opts.transfers; i++) {
+    int is_get = (opts.mode == BENCH_GET) ||
+                 ((opts.mode == BENCH_MIX) && ((client->id + i) % 2 == 0));
+
+    tftp_t tftp;
+    client->latency[i] = -1;
+    if (bench_open(&tftp, tx, rx, buf_size) < 0) {
+      client->failed++;
+      continue;
+    }
+
+    int64_t start = tftp_now_us();
+    int64_t size = is_get ? bench_get(&tftp) : bench_put(&tftp, client->id, i);
+    if (size < 0) {
+      client->failed++;
+    } else {
+      client->latency[i] = tftp_now_us() - start;
+      client->bytes += size;
+    }
+    close(tftp.socket);
+  }
+
+client_exit:
+  client->cpu_ns = bench_cpu_ns(CLOCK_THREAD_CPUTIME_ID);
+  free(tx);
+  free(rx);
+  return NULL;
+}
+
+static int bench_setup(void) {
+  if (mkdtemp(bench_dir) == NULL) {
+    printf("bench: create work dir failed.\n");
+    return -1;
+  }
+
+  put_data = (uint8_t *)malloc(opts.file_size + 1);
+  if (put_data == NULL) {
+    printf("bench: alloc file data failed.\n");
+    return -1;
+  }
+  for (int64_t i = 0; i < opts.file_size; i++) {
+    put_data[i] = (uint8_t)(i * 31 + (i >> 12));
+  }
+
+  char path[256];
+  snprintf(path, sizeof(path), "%s/%s", bench_dir, BENCH_FILE);
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    printf("bench: create %s failed.\n", path);
+    return -1;
+  }
+
+  int64_t written = 0;
+  while (written < opts.file_size) {
+    ssize_t ret = write(fd, put_data + written, opts.file_size - written);
+    if (ret <= 0) {
+      printf("bench: write %s failed.\n", path);
+      close(fd);
+      return -1;
+    }
+    written += ret;
+  }
+
+  close(fd);
+  return 0;
+}
+
+static void bench_cleanup(void) {
+  char path[512];
+  for (int id = 0; id < opts.clients; id++) {
+    for (int i = 0; i < opts.transfers; i++) {
+      snprintf(path, sizeof(path), "%s/put_%d_%d.dat", bench_dir, id, i);
+      unlink(path);
+    }
+  }
+  snprintf(path, sizeof(path), "%s/%s", bench_dir, BENCH_FILE);
+  unlink(path);
+  rmdir(bench_dir);
+}
+
+static int cmp_latency(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static void show_usage(const char *name) {
+  printf("usage: %s [options]\n", name);
+  printf("    -c clients -- concurrent clients, default 8\n");
+  printf("    -n count -- transfers per client, default 16\n");
+  printf("    -s size -- file size in bytes, k/m suffix, default 1m\n");
+  printf("    -b blksize -- block size, default %d\n", TFTP_DEF_BLKSIZE);
+  printf("    -m get|put|mix -- transfer direction, default get\n");
+  printf("    -p port -- server port, default 10169\n");
+  printf("    -j shards -- server shards, -1 for one per core, default 0\n");
+  printf("    -u -- run the server on io_uring\n");
+  printf("    -t mbps -- fail when the throughput is below it\n");
+  printf("    -i spec -- impair the network, e.g. drop=0.01,delay=20\n");
+  printf("    -r rate -- server send cap in bytes/s, k/m suffix\n");
+  printf("    -R rate -- server send cap per client address\n");
+  printf("    -l level -- log level, error|warn|info|debug, default warn\n");
+}
+
+static int64_t parse_size(const char *arg) {
+  char *end;
+  int64_t size = strtoll(arg, &end, 10);
+  if ((*end == 'k') || (*end == 'K')) {
+    size *= 1024;
+  } else if ((*end == 'm') || (*end == 'M')) {
+    size *= 1024 * 1024;
+  }
+
+  return size;
+}
+
+static int parse_opts(int argc, char **argv) {
+  opts.clients = 8;
+  opts.transfers = 16;
+  opts.file_size = 1024 * 1024;
+  opts.block_size = TFTP_DEF_BLKSIZE;
+  opts.mode = BENCH_GET;
+  opts.port = 10169;
+  // a line per transfer would be measured along with it
+  tftp_log_level = TFTP_LOG_WARN;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:s:b:m:p:j:ut:i:r:R:l:h")) != -1) {
+    switch (opt) {
+      case 'c': {
+        opts.clients = atoi(optarg);
+        break;
+      }
+      case 'n': {
+        opts.transfers = atoi(optarg);
+        break;
+      }
+      case 's': {
+        opts.file_size = parse_size(optarg);
+        break;
+      }
+      case 'b': {
+        opts.block_size = atoi(optarg);
+        break;
+      }
+      case 'm': {
+        if (strcmp(optarg, "get") == 0) {
+          opts.mode = BENCH_GET;
+        } else if (strcmp(optarg, "put") == 0) {
+          opts.mode = BENCH_PUT;
+        } else if (strcmp(optarg, "mix") == 0) {
+          opts.mode = BENCH_MIX;
+        } else {
+          printf("bench: unknown mode %s\n", optarg);
+          return -1;
+        }
+        break;
+      }
+      case 'p': {
+        opts.port = (uint16_t)atoi(optarg);
+        break;
+      }
+      case 'j': {
+        opts.shards = atoi(optarg);
+        break;
+      }
+      case 'u': {
+        opts.engine = TFTPD_ENGINE_URING;
+        break;
+      }
+      case 't': {
+        opts.min_mbps = atof(optarg);
+        break;
+      }
+      case 'r': {
+        opts.rate_limit = parse_size(optarg);
+        break;
+      }
+      case 'R': {
+        opts.client_rate_limit = parse_size(optarg);
+        break;
+      }
+      case 'l': {
+        tftp_log_level = tftp_log_parse_level(optarg);
+        if (tftp_log_level < 0) {
+          printf("bench: unknown log level %s\n", optarg);
+          return -1;
+        }
+        break;
+      }
+      case 'i': {
+        if (tftp_impair_init(optarg) < 0) {
+          return -1;
+        }
+        break;
+      }
+      default: {
+        show_usage(argv[0]);
+        return -1;
+      }
+    }
+  }
+
+  if ((opts.clients <= 0) || (opts.transfers <= 0) || (opts.file_size < 0) ||
+      (opts.block_size <= 0) || (opts.block_size > TFTP_MAX_BLKSIZE)) {
+    printf("bench: bad options\n");
+    show_usage(argv[0]);
+    return -1;
+  }
+
+  return 0;
+}
+
+int main(int argc, char **argv) {
+  if (parse_opts(argc, argv) < 0) {
+    return 2;
+  }
+
+  int ret = 1;
+  bench_client_t *clients =
+      (bench_client_t *)calloc(opts.clients, sizeof(bench_client_t));
+  int64_t *latency = (int64_t *)calloc(
+      (size_t)opts.clients * opts.transfers, sizeof(int64_t));
+  if ((clients == NULL) || (latency == NULL)) {
+    printf("bench: alloc clients failed.\n");
+    goto bench_exit;
+  }
+
+  if (bench_setup() < 0) {
+    goto bench_exit;
+  }
+
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.dir = bench_dir;
+  config.port = opts.port;
+  config.shards = opts.shards;
+  config.engine = opts.engine;
+  config.rate_limit = opts.rate_limit;
+  config.client_rate_limit = opts.client_rate_limit;
+  if (tftpd_start_config(&config) < 0) {
+    printf("bench: start server failed.\n");
+    goto bench_exit;
+  }
+
+  int64_t cpu_start = bench_cpu_ns(CLOCK_PROCESS_CPUTIME_ID);
+  int64_t start = tftp_now_us();
+  int started = 0;
+  for (; started < opts.clients; started++) {
+    bench_client_t *client = &clients[started];
+    client->id = started;
+    client->latency = latency + (size_t)started * opts.transfers;
+    if (pthread_create(&client->thread, NULL, bench_client_thread, client) !=
+        0) {
+      printf("bench: create client thread failed.\n");
+      break;
+    }
+  }
+
+  int64_t bytes = 0;
+  int64_t client_cpu_ns = 0;
+  int failed = 0;
+  for (int i = 0; i < started; i++) {
+    pthread_join(clients[i].thread, NULL);
+    bytes += clients[i].bytes;
+    client_cpu_ns += clients[i].cpu_ns;
+    failed += clients[i].failed;
+  }
+  int64_t elapsed_us = tftp_now_us() - start;
+  int64_t cpu_ns = bench_cpu_ns(CLOCK_PROCESS_CPUTIME_ID) - cpu_start;
+  if (started < opts.clients) {
+    goto bench_exit;
+  }
+
+  // failed transfers sort first and are left out of the percentiles
+  int count = opts.clients * opts.transfers;
+  qsort(latency, count, sizeof(int64_t), cmp_latency);
+  int64_t *done = latency + failed;
+  int done_count = count - failed;
+
+  double gb = (double)bytes / (1024.0 * 1024.0 * 1024.0);
+  double mbps = elapsed_us ? (double)bytes * 8 / elapsed_us : 0;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+
+  tftp_log_flush();
+  printf("\nbench: %d clients x %d %s transfers of %" PRId64
+         " bytes, blksize %d, %s engine\n",
+         opts.clients, opts.transfers,
+         opts.mode == BENCH_GET ? "get" : opts.mode == BENCH_PUT ? "put" : "mix",
+         opts.file_size, opts.block_size,
+         opts.engine == TFTPD_ENGINE_URING ? "io_uring" : "epoll");
+  printf("  transfers:   %d ok, %d failed\n", done_count, failed);
+  printf("  elapsed:     %.3f s\n", elapsed_us / 1e6);
+  printf("  throughput:  %.1f Mbit/s, %.1f transfers/s\n", mbps,
+         elapsed_us ? done_count * 1e6 / elapsed_us : 0);
+  if (done_count > 0) {
+    printf("  latency:     p50 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+           done[done_count / 2] / 1e3, done[(done_count - 1) * 99 / 100] / 1e3,
+           done[done_count - 1] / 1e3);
+  }
+  if (gb > 0) {
+    // the clients run in this process too, their own thread time is split
+    // out to leave what the server spent
+    printf("  cpu per GB:  %.3f s server, %.3f s total\n",
+           (cpu_ns - client_cpu_ns) / 1e9 / gb, cpu_ns / 1e9 / gb);
+  }
+  printf("  peak rss:    %ld KB\n", usage.ru_maxrss);
+
+  ret = failed ? 1 : 0;
+  if ((opts.min_mbps > 0) && (mbps < opts.min_mbps)) {
+    printf("bench: throughput %.1f Mbit/s below %.1f\n", mbps, opts.min_mbps);
+    ret = 1;
+  }
+
+bench_exit:
+  bench_cleanup();
+  free(put_data);
+  free(latency);
+  free(clients);
+  return ret;
+}
@@ -0,0 +1,209 @@
+#include "tftp_cache.h"
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "tftp_log.h"
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static tftp_file_t *cache_buckets[TFTP_CACHE_BUCKETS];
+static int cache_idle;
+
+static unsigned int cache_hash(const char *path) {
+  unsigned int hash = 5381;
+  while (*path) {
+    hash = hash * 33 + (unsigned char)*path++;
+  }
+
+  return hash % TFTP_CACHE_BUCKETS;
+}
+
+static void cache_unmap(tftp_file_t *file) {
+  if (file->data) {
+    munmap(file->data, file->size);
+  }
+  free(file);
+}
+
+static void cache_unlink(tftp_file_t *file) {
+  tftp_file_t **prev = &cache_buckets[cache_hash(file->path)];
+  while (*prev != file) {
+    prev = &(*prev)->next;
+  }
+
+  *prev = file->next;
+  file->cached = 0;
+  if (file->refs == 0) {
+    cache_idle--;
+  }
+}
+
+// drop mappings nobody is sending from, called with the cache locked
+static void cache_trim(void) {
+  for (int i = 0; (i < TFTP_CACHE_BUCKETS) && cache_idle; i++) {
+    tftp_file_t *file = cache_buckets[i];
+    while (file) {
+      tftp_file_t *next = file->next;
+      if (file->refs == 0) {
+        cache_unlink(file);
+        cache_unmap(file);
+      }
+      file = next;
+    }
+  }
+}
+
+static tftp_file_t *cache_map(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return NULL;
+  }
+
+  tftp_file_t *file = (tftp_file_t *)calloc(1, sizeof(tftp_file_t));
+  if (file == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: alloc cache file failed.\n");
+    close(fd);
+    return NULL;
+  }
+
+  snprintf(file->path, sizeof(file->path), "%s", path);
+  file->dev = st.st_dev;
+  file->ino = st.st_ino;
+  file->mtime = st.st_mtim;
+  file->size = st.st_size;
+
+  if (file->size) {
+    file->data = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+    if (file->data == MAP_FAILED) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: map file %s failed.\n", path);
+      close(fd);
+      free(file);
+      return NULL;
+    }
+    madvise(file->data, file->size, MADV_SEQUENTIAL);
+  }
+
+  close(fd);
+  return file;
+}
+
+// get a mapping of the file, shared with every other sender of the same
+// file. a cached mapping is replaced once the file on disk has another
+// inode, size or mtime; senders of the old one keep it until they close it
+tftp_file_t *tftp_cache_open(const char *path) {
+  struct stat st;
+  if ((stat(path, &st) < 0) || !S_ISREG(st.st_mode)) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+
+  tftp_file_t *file = cache_buckets[cache_hash(path)];
+  while (file && (strcmp(file->path, path) != 0)) {
+    file = file->next;
+  }
+
+  if (file) {
+    if ((file->dev == st.st_dev) && (file->ino == st.st_ino) &&
+        (file->size == st.st_size) &&
+        (file->mtime.tv_sec == st.st_mtim.tv_sec) &&
+        (file->mtime.tv_nsec == st.st_mtim.tv_nsec)) {
+      if (file->refs++ == 0) {
+        cache_idle--;
+      }
+      pthread_mutex_unlock(&cache_lock);
+      return file;
+    }
+
+    cache_unlink(file);
+    if (file->refs == 0) {
+      cache_unmap(file);
+    }
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+
+  // map outside of the lock, two senders racing here both map the file and
+  // the later one wins the cache slot
+  file = cache_map(path);
+  if (file == NULL) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&cache_lock);
+
+  tftp_file_t **bucket = &cache_buckets[cache_hash(path)];
+  tftp_file_t *old = *bucket;
+  while (old && (strcmp(old->path, path) != 0)) {
+    old = old->next;
+  }
+  if (old) {
+    cache_unlink(old);
+    if (old->refs == 0) {
+      cache_unmap(old);
+    }
+  }
+
+  file->refs = 1;
+  file->cached = 1;
+  file->next = *bucket;
+  *bucket = file;
+
+  pthread_mutex_unlock(&cache_lock);
+  return file;
+}
+
+// size of the file as last mapped, -1 when the cache holds no mapping of
+// it. looks at the disk no more than it did at that time
+off_t tftp_cache_size(const char *path) {
+  pthread_mutex_lock(&cache_lock);
+
+  tftp_file_t *file = cache_buckets[cache_hash(path)];
+  while (file && (strcmp(file->path, path) != 0)) {
+    file = file->next;
+  }
+  off_t size = file ? file->size : -1;
+
+  pthread_mutex_unlock(&cache_lock);
+  return size;
+}
+
+void tftp_cache_close(tftp_file_t *file) {
+  pthread_mutex_lock(&cache_lock);
+
+  if (--file->refs == 0) {
+    if (!file->cached) {
+      cache_unmap(file);
+    } else if (++cache_idle > TFTP_CACHE_MAX_IDLE) {
+      cache_trim();
+    }
+  }
+
+  pthread_mutex_unlock(&cache_lock);
+}
+
+// start reading a range of the file in the background, so the page faults
+// of the next windows hit the page cache instead of the disk
+void tftp_cache_prefetch(tftp_file_t *file, off_t offset, off_t size) {
+  if (offset + size > file->size) {
+    size = file->size - offset;
+  }
+  if (size <= 0) {
+    return;
+  }
+
+  off_t page = sysconf(_SC_PAGESIZE);
+  off_t start = offset & ~(page - 1);
+  madvise(file->data + start, size + offset - start, MADV_WILLNEED);
+}
@@ -0,0 +1,31 @@
+#ifndef TFTP_CACHE_H
+#define TFTP_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define TFTP_CACHE_BUCKETS 64
+#define TFTP_CACHE_MAX_IDLE 32
+// bytes a sender asks the kernel to read ahead of its window
+#define TFTP_CACHE_READAHEAD (1024 * 1024)
+
+typedef struct _tftp_file_t {
+  char path[256];
+  dev_t dev;
+  ino_t ino;
+  struct timespec mtime;
+  off_t size;
+  uint8_t *data;
+
+  int refs;
+  int cached;
+  struct _tftp_file_t *next;
+} tftp_file_t;
+
+tftp_file_t *tftp_cache_open(const char *path);
+void tftp_cache_close(tftp_file_t *file);
+off_t tftp_cache_size(const char *path);
+void tftp_cache_prefetch(tftp_file_t *file, off_t offset, off_t size);
+
+#endif
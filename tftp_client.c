@@ -1,135 +1,210 @@
 #include "tftp_client.h"
 
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <time.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-static tftp_t tftp;
+#include "tftp_log.h"
+#include "tftp_xfer.h"
+
+// blocks read ahead of the put, the next refill is prefetched by the kernel
+// while these go out
+#define TFTP_PUT_AHEAD 32
+
+// the local file of a transfer, see tftp_xfer_io_t
+typedef struct _tftp_file_t {
+  int fd;
+  uint8_t *ahead;
+  size_t ahead_size;
+  size_t ahead_len;
+  int64_t ahead_offset;
+  // end of the data moved so far, for the progress dots
+  int64_t done;
+  uint64_t blocks;
+} tftp_file_t;
+
+// largest blksize whose packets cross the path to the server unfragmented,
+// from the path mtu the kernel keeps for the route. the socket is connected
+// only to read it, the server answers from another port
+static int tftp_auto_blksize(int sockfd, const struct sockaddr *remote) {
+  int pmtu = IP_PMTUDISC_WANT;
+  setsockopt(sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &pmtu, sizeof(pmtu));
+
+  int mtu = 0;
+  socklen_t len = sizeof(mtu);
+  struct sockaddr unspec;
+  memset(&unspec, 0, sizeof(unspec));
+  unspec.sa_family = AF_UNSPEC;
+  if ((connect(sockfd, remote, sizeof(struct sockaddr)) < 0) ||
+      (getsockopt(sockfd, IPPROTO_IP, IP_MTU, &mtu, &len) < 0)) {
+    mtu = 0;
+  }
+  connect(sockfd, &unspec, sizeof(unspec));
+
+  // ip and udp headers, then the 4 byte tftp header
+  int block_size = mtu - 20 - 8 - 4;
+  if (block_size < TFTP_DEF_BLKSIZE) {
+    block_size = TFTP_DEF_BLKSIZE;
+  } else if (block_size > TFTP_MAX_BLKSIZE) {
+    block_size = TFTP_MAX_BLKSIZE;
+  }
 
-static int tftp_open(const char *ip, uint16_t port, int block_size) {
+  tftp_log(TFTP_LOG_INFO, "tftp: path mtu %d, blksize %d\n", mtu, block_size);
+  return block_size;
+}
+
+static int tftp_open(const char *ip, uint16_t port, struct sockaddr *remote,
+                     int *block_size) {
   int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
   if (sockfd < 0) {
-    printf("error: create socket failed.\n");
+    tftp_log(TFTP_LOG_ERROR, "error: create socket failed.\n");
     return -1;
   }
 
-  tftp.socket = sockfd;
-  tftp.block_size = block_size;
-  tftp.file_size = 0;
-  tftp.tmo_retry = TFTP_MAX_RETRY;
-  tftp.tmo_sec = TFTP_TMO_SEC;
-
-  struct sockaddr_in *sockaddr = (struct sockaddr_in *)(&tftp.remote);
+  struct sockaddr_in *sockaddr = (struct sockaddr_in *)remote;
   memset(sockaddr, 0, sizeof(struct sockaddr_in));
   sockaddr->sin_family = AF_INET;
   sockaddr->sin_addr.s_addr = inet_addr(ip);
   sockaddr->sin_port = htons(port);
 
-  struct timeval tmo;
-  tmo.tv_sec = tftp.tmo_sec;
-  tmo.tv_usec = 0;
-  setsockopt(tftp.socket, SOL_SOCKET, SO_RCVTIMEO, (const void *)&tmo,
-             sizeof(tmo));
+  if (*block_size == TFTP_BLKSIZE_AUTO) {
+    *block_size = tftp_auto_blksize(sockfd, remote);
+  }
+  return sockfd;
 }
 
-static void tftp_close() { close(tftp.socket); }
+static void tftp_progress(tftp_file_t *file, int64_t offset, size_t size) {
+  if (offset + (int64_t)size <= file->done) {
+    return;
+  }
 
-static int do_tftp_get(int block_size, const char *ip, uint16_t port,
-                       const char *filename, int option) {
-  if (tftp_open(ip, port, block_size) < 0) {
-    printf("tftp connect failed.\n");
-    return -1;
+  file->done = offset + size;
+  if (++file->blocks % 0x40 == 0) {
+    tftp_log(TFTP_LOG_DEBUG, ".");
   }
+}
 
-  int err = tftp_send_request(&tftp, 1, filename, 0, option);
-  if (err < 0) {
-    printf("tftp: send tftp request failed.\n");
-    goto get_error;
+static int tftp_file_write(void *ctx, int64_t offset, const void *data,
+                           size_t size) {
+  tftp_file_t *file = (tftp_file_t *)ctx;
+  if (pwrite(file->fd, data, size, offset) != (ssize_t)size) {
+    return -1;
   }
 
-  if (option) {
-    size_t recv_size = 0;
-    err = tftp_wait_packet(&tftp, TFTP_PKT_OACK, 0, &recv_size);
-    if (err < 0) {
-      printf("tftp: wait oack error, file %s\n", filename);
-      goto get_error;
-    }
+  tftp_progress(file, offset, size);
+  return 0;
+}
 
-    err = tftp_send_ack(&tftp, 0);
-    if (err < 0) {
-      printf("tftp: send ack failed. file: %s\n", filename);
-      goto get_error;
+// served from TFTP_PUT_AHEAD blocks read at once, a window sent again after
+// a loss is usually still there
+static ssize_t tftp_file_read(void *ctx, int64_t offset, void *buf,
+                              size_t size) {
+  tftp_file_t *file = (tftp_file_t *)ctx;
+  int64_t ahead_end = file->ahead_offset + (int64_t)file->ahead_len;
+  int at_eof = file->ahead_len < file->ahead_size;
+  if ((file->ahead_offset < 0) || (offset < file->ahead_offset) ||
+      ((offset + (int64_t)size > ahead_end) && !at_eof)) {
+    ssize_t len = pread(file->fd, file->ahead, file->ahead_size, offset);
+    if (len < 0) {
+      return -1;
     }
-
-    printf("tftp: file size %d bytes\n", tftp.file_size);
+    file->ahead_offset = offset;
+    file->ahead_len = (size_t)len;
+    ahead_end = offset + len;
+    posix_fadvise(file->fd, ahead_end, file->ahead_size, POSIX_FADV_WILLNEED);
   }
 
-  FILE *file = fopen(filename, "wb");
-  if (file == NULL) {
-    printf("tftp: create local file failed: %s\n", filename);
-    goto get_error;
+  if (offset >= ahead_end) {
+    return 0;
   }
+  if (offset + (int64_t)size > ahead_end) {
+    size = (size_t)(ahead_end - offset);
+  }
+  memcpy(buf, file->ahead + (offset - file->ahead_offset), size);
+  tftp_progress(file, offset, size);
+  return (ssize_t)size;
+}
 
-  uint16_t next_block = 1;
-  uint32_t total_size = 0;
-  uint32_t total_block = 0;
-  while (1) {
-    size_t recv_size = 0;
-    err = tftp_wait_packet(&tftp, TFTP_PKT_DATA, next_block, &recv_size);
-    if (err < 0) {
-      printf("tftp: wait error, block %d file %s\n", 0, filename);
-      goto get_error;
-    }
-
-    size_t block_size = recv_size - 4;
-    if (block_size) {
-      size_t size = fwrite(tftp.rx_packet.data.data, 1, block_size, file);
-      if (size < block_size) {
-        printf("tftp: write file failed: %s\n", filename);
-        goto get_error;
-      }
-    }
+static int do_tftp_get(int block_size, const char *ip, uint16_t port,
+                       const char *filename, int option) {
+  tftp_xfer_t xfer;
+  tftp_file_t file;
+  memset(&xfer, 0, sizeof(xfer));
+  memset(&file, 0, sizeof(file));
+  file.fd = -1;
+
+  struct sockaddr remote;
+  int sockfd = tftp_open(ip, port, &remote, &block_size);
+  if (sockfd < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp connect failed.\n");
+    return -1;
+  }
 
-    err = tftp_send_ack(&tftp, next_block);
+  // download into a part file, a failed download keeps it and the next get
+  // asks the server to restart at its end
+  char part_path[TFTP_NAME_SIZE + 8];
+  snprintf(part_path, sizeof(part_path), "%s.part", filename);
+  struct stat st;
+  int64_t offset = 0;
+  if (option && (stat(part_path, &st) == 0) && (st.st_size > 0)) {
+    offset = st.st_size;
+  }
 
-    if (err < 0) {
-      printf("tftp: send ack failed. ack block=%d\n", next_block);
-      goto get_error;
-    }
-    next_block++;
+  file.fd = open(part_path, O_WRONLY | O_CREAT | (offset ? 0 : O_TRUNC), 0644);
+  if (file.fd < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: create local file failed: %s\n", filename);
+    goto get_error;
+  }
 
-    total_size += (uint32_t)block_size;
-    if (++total_block % 0x40 == 0) {
-      printf(".");
-      fflush(stdout);
-    }
-    if (block_size < tftp.block_size) {
-      err = 0;
-      break;
-    }
+  tftp_xfer_io_t io = {NULL, tftp_file_write, &file};
+  if (tftp_xfer_init(&xfer, &remote, 1, filename, block_size,
+                     TFTP_DEF_WINSIZE, option, offset, &io) < 0) {
+    goto get_error;
+  }
+  if (tftp_xfer_run(&xfer, sockfd) < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: get failed, file %s\n", filename);
+    goto get_error;
   }
 
-  printf("\n\ttftp: total recv: %d bytes, %d block\n", total_size, total_block);
-  fclose(file);
-  tftp_close();
+  // ends the line of progress dots
+  tftp_log(TFTP_LOG_DEBUG, "\n");
+  tftp_log(TFTP_LOG_INFO,
+           "\ttftp: total recv: %" PRId64 " bytes, %" PRId64 " block, %" PRId64
+           " dup\n",
+           xfer.total_size, xfer.total_block, xfer.tftp.rx_dups);
+  if ((ftruncate(file.fd, xfer.tftp.offset + xfer.total_size) < 0) ||
+      (close(file.fd) != 0) || (rename(part_path, filename) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: save file failed: %s\n", filename);
+    file.fd = -1;
+    goto get_error;
+  }
+  tftp_xfer_free(&xfer);
+  close(sockfd);
   return 0;
 
 get_error:
-  if (file) {
-    fclose(file);
+  if (file.fd >= 0) {
+    close(file.fd);
+    // nothing to restart from
+    if (!offset && !xfer.total_size) {
+      unlink(part_path);
+    }
   }
-  tftp_close();
+  tftp_xfer_free(&xfer);
+  close(sockfd);
   return -1;
 }
 
 int tftp_get(const char *ip, uint16_t port, int block_size,
              const char *filename, int option) {
-  printf("try to get file %s from %s\n", filename, ip);
+  tftp_log(TFTP_LOG_INFO, "try to get file %s from %s\n", filename, ip);
 
-  if (block_size > TFTP_BLK_SIZE) {
-    block_size = TFTP_BLK_SIZE;
+  if (block_size > TFTP_MAX_BLKSIZE) {
+    block_size = TFTP_MAX_BLKSIZE;
   }
 
   return do_tftp_get(block_size, ip, port, filename, option);
@@ -137,97 +212,75 @@ int tftp_get(const char *ip, uint16_t port, int block_size,
 
 static int do_tftp_put(int block_size, const char *ip, uint16_t port,
                        const char *filename, int option) {
-  if (!option) {
-    block_size = TFTP_DEF_BLKSIZE;
-  }
+  tftp_xfer_t xfer;
+  tftp_file_t file;
+  memset(&xfer, 0, sizeof(xfer));
+  memset(&file, 0, sizeof(file));
 
-  if (tftp_open(ip, port, block_size) < 0) {
-    printf("tftp connect failed.\n");
+  struct sockaddr remote;
+  int sockfd = tftp_open(ip, port, &remote, &block_size);
+  if (sockfd < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp connect failed.\n");
     return -1;
   }
 
-  FILE *file = fopen(filename, "rb");
-  if (file == NULL) {
-    printf("tftp: create local file failed: %s\n", filename);
+  struct stat st;
+  file.fd = open(filename, O_RDONLY);
+  if ((file.fd < 0) || (fstat(file.fd, &st) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: open local file failed: %s\n", filename);
     goto put_error;
   }
 
-  printf("tftp: try to put file: %s\n", filename);
-
-  fseek(file, 0, SEEK_END);
-  long filesize = ftell(file);
-  fseek(file, 0, SEEK_SET);
-
-  int err = tftp_send_request(&tftp, 0, filename, filesize, option);
-  if (err < 0) {
-    printf("tftp: send tftp request failed.\n");
+  file.ahead_size = TFTP_PUT_AHEAD * (size_t)block_size;
+  file.ahead_offset = -1;
+  file.ahead = (uint8_t *)malloc(file.ahead_size);
+  if (file.ahead == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: alloc read buffer failed.\n");
     goto put_error;
   }
 
-  size_t recv_size;
-  err = tftp_wait_packet(&tftp, option ? TFTP_PKT_OACK : TFTP_PKT_ACK, 0,
-                         &recv_size);
-  if (err < 0) {
-    printf("tftp: wait error, block %d file: %s.\n", 0, filename);
+  tftp_log(TFTP_LOG_INFO, "tftp: try to put file: %s\n", filename);
+  posix_fadvise(file.fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+  // offer the whole file, the server answers how much of it a previous
+  // failed put left there
+  tftp_xfer_io_t io = {tftp_file_read, NULL, &file};
+  if (tftp_xfer_init(&xfer, &remote, 0, filename, block_size,
+                     TFTP_DEF_WINSIZE, option, st.st_size, &io) < 0) {
     goto put_error;
   }
-
-  uint16_t curr_block = 1;
-  uint32_t total_size = 0;
-  uint32_t total_block = 0;
-  while (1) {
-    size_t block_size =
-        fread(tftp.tx_packet.data.data, 1, tftp.block_size, file);
-    if (!feof(file) && (block_size != tftp.block_size)) {
-      err = -1;
-      printf("tftp: read file failed. %s\n", filename);
-      goto put_error;
-    }
-
-    err = tftp_send_data(&tftp, curr_block, block_size);
-    if (err < 0) {
-      printf("tftp: send data failed. block: %d\n", curr_block);
-      goto put_error;
-    }
-
-    err = tftp_wait_packet(&tftp, TFTP_PKT_ACK, curr_block, &recv_size);
-    if (err < 0) {
-      printf("tftp: wait error. block: %d file: %s\n", curr_block, filename);
-      goto put_error;
-    }
-
-    curr_block++;
-    total_size += (uint32_t)block_size;
-    if (++total_block % 0x40 == 0) {
-      printf(".");
-      fflush(stdout);
-    }
-
-    if (block_size < tftp.block_size) {
-      err = 0;
-      break;
-    }
+  if (tftp_xfer_run(&xfer, sockfd) < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: put failed, file %s\n", filename);
+    goto put_error;
   }
 
-  printf("\n\ttftp: total send: %d bytes, %d block\n", total_size, total_block);
-  fclose(file);
-  tftp_close();
+  tftp_log(TFTP_LOG_DEBUG, "\n");
+  tftp_log(TFTP_LOG_INFO,
+           "\ttftp: total send: %" PRId64 " bytes, %" PRId64 " block, %" PRId64
+           " dup\n",
+           xfer.total_size, xfer.total_block, xfer.tftp.rx_dups);
+  close(file.fd);
+  free(file.ahead);
+  tftp_xfer_free(&xfer);
+  close(sockfd);
   return 0;
 
 put_error:
-  if (file) {
-    fclose(file);
+  if (file.fd >= 0) {
+    close(file.fd);
   }
-  tftp_close();
+  free(file.ahead);
+  tftp_xfer_free(&xfer);
+  close(sockfd);
   return -1;
 }
 
 int tftp_put(const char *ip, uint16_t port, int block_size,
              const char *filename, int option) {
-  printf("try to get file %s from %s\n", filename, ip);
+  tftp_log(TFTP_LOG_INFO, "try to put file %s to %s\n", filename, ip);
 
-  if (block_size > TFTP_BLK_SIZE) {
-    block_size = TFTP_BLK_SIZE;
+  if (block_size > TFTP_MAX_BLKSIZE) {
+    block_size = TFTP_MAX_BLKSIZE;
   }
 
   return do_tftp_put(block_size, ip, port, filename, option);
@@ -237,7 +290,7 @@ void show_cmd_list() {
   printf("usage: cmd arg0 arg1...\n");
   printf("    get filename -- download file from server\n");
   printf("    put filename -- upload file from server\n");
-  printf("    blk size -- set block size\n");
+  printf("    blk size|auto -- set block size, auto fits the path mtu\n");
   printf("    quit -- quit\n");
 }
 
@@ -252,6 +305,7 @@ int tftp_start(const char *ip, uint16_t port) {
   show_cmd_list();
 
   while (1) {
+    tftp_log_flush();
     printf("tftp >>");
     fflush(stdout);
 
@@ -289,14 +343,17 @@ int tftp_start(const char *ip, uint16_t port) {
         }
       } else if (strcmp(cmd, "blk") == 0) {
         char *blk = strtok(NULL, split);
-        if (blk) {
+        if (blk && (strcmp(blk, "auto") == 0)) {
+          blksize = TFTP_BLKSIZE_AUTO;
+        } else if (blk) {
           int size = atoi(blk);
           if (size <= 0) {
             printf("blk size %d error", size);
             size = TFTP_DEF_BLKSIZE;
-          } else if (size > TFTP_BLK_SIZE) {
-            printf("blk size %d too long, set to %d\n", size, blksize);
-            size = TFTP_DEF_BLKSIZE;
+          } else if (size > TFTP_MAX_BLKSIZE) {
+            printf("blk size %d too long, set to %d\n", size,
+                   TFTP_MAX_BLKSIZE);
+            size = TFTP_MAX_BLKSIZE;
           }
 
           blksize = size;
@@ -4,6 +4,8 @@
 #include "tftp_base.h"
 
 #define TFTP_CMD_BUF_SIZE 128
+// block_size of tftp_get/tftp_put picked from the path mtu
+#define TFTP_BLKSIZE_AUTO 0
 
 int tftp_get(const char *ip, uint16_t port, int block_size,
              const char *filename, int option);
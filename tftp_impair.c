@@ -0,0 +1,372 @@
+#include "tftp_impair.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "tftp_log.h"
+
+typedef struct _tftp_delayed_t {
+  int64_t due_us;
+  int sockfd;
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  size_t size;
+  uint8_t data[];
+} tftp_delayed_t;
+
+static tftp_impair_t impair;
+static int impair_on;
+static pthread_once_t impair_once = PTHREAD_ONCE_INIT;
+
+// every thread draws from its own generator, seeded in the order threads
+// first use it, so a run with the same seed drops the same packets
+static __thread uint64_t impair_rng;
+static uint64_t impair_threads;
+
+// packets waiting to be sent late, a min heap on due_us
+static pthread_mutex_t delay_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delay_cond;
+static tftp_delayed_t **delay_heap;
+static int delay_count;
+static int delay_capacity;
+static int delay_started;
+
+// a delayed packet is copied, its data may point into the file mapping of
+// a sender. the copy of pages the file lost to a truncate fails with
+// EFAULT like sendmsg does instead of raising SIGBUS
+static __thread sigjmp_buf *volatile copy_jmp;
+static struct sigaction copy_old_action;
+static pthread_once_t copy_once = PTHREAD_ONCE_INIT;
+
+static int64_t impair_now_us(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static double impair_random(void) {
+  if (impair_rng == 0) {
+    uint64_t idx = __atomic_add_fetch(&impair_threads, 1, __ATOMIC_RELAXED);
+    impair_rng = (impair.seed ^ (idx * 0x9e3779b97f4a7c15ULL)) | 1;
+  }
+
+  // xorshift64*
+  impair_rng ^= impair_rng >> 12;
+  impair_rng ^= impair_rng << 25;
+  impair_rng ^= impair_rng >> 27;
+  return (double)((impair_rng * 0x2545f4914f6cdd1dULL) >> 11) /
+         (double)(1ULL << 53);
+}
+
+static int impair_parse(const char *spec) {
+  tftp_impair_t conf;
+  memset(&conf, 0, sizeof(conf));
+  conf.reorder_ms = 10;
+  conf.seed = 1;
+
+  char buf[256];
+  snprintf(buf, sizeof(buf), "%s", spec);
+  for (char *save, *item = strtok_r(buf, ",", &save); item;
+       item = strtok_r(NULL, ",", &save)) {
+    char *value = strchr(item, '=');
+    if (value == NULL) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: bad impairment %s\n", item);
+      return -1;
+    }
+    *value++ = '\0';
+
+    if (strcmp(item, "drop") == 0) {
+      conf.drop = atof(value);
+    } else if (strcmp(item, "rxdrop") == 0) {
+      conf.rx_drop = atof(value);
+    } else if (strcmp(item, "dup") == 0) {
+      conf.dup = atof(value);
+    } else if (strcmp(item, "reorder") == 0) {
+      conf.reorder = atof(value);
+    } else if (strcmp(item, "delay") == 0) {
+      conf.delay_ms = atoi(value);
+    } else if (strcmp(item, "jitter") == 0) {
+      conf.jitter_ms = atoi(value);
+    } else if (strcmp(item, "reorder_ms") == 0) {
+      conf.reorder_ms = atoi(value);
+    } else if (strcmp(item, "seed") == 0) {
+      conf.seed = strtoull(value, NULL, 0);
+    } else {
+      tftp_log(TFTP_LOG_ERROR, "tftp: unknown impairment %s\n", item);
+      return -1;
+    }
+  }
+
+  impair = conf;
+  impair_on = (conf.drop > 0) || (conf.rx_drop > 0) || (conf.dup > 0) ||
+              (conf.reorder > 0) || (conf.delay_ms > 0) || (conf.jitter_ms > 0);
+  if (impair_on) {
+    tftp_log(TFTP_LOG_INFO,
+             "tftp: impairment drop %.3f rxdrop %.3f dup %.3f reorder %.3f "
+             "delay %d+%d ms seed %llu\n", conf.drop, conf.rx_drop, conf.dup,
+             conf.reorder, conf.delay_ms, conf.jitter_ms,
+             (unsigned long long)conf.seed);
+  }
+  return 0;
+}
+
+static void impair_env(void) {
+  const char *spec = getenv(TFTP_IMPAIR_ENV);
+  if (spec && *spec) {
+    impair_parse(spec);
+  }
+}
+
+// overrides the environment, call it before any transfer starts
+int tftp_impair_init(const char *spec) {
+  pthread_once(&impair_once, impair_env);
+  return impair_parse(spec);
+}
+
+int tftp_impair_active(void) {
+  pthread_once(&impair_once, impair_env);
+  return impair_on;
+}
+
+static void heap_swap(int a, int b) {
+  tftp_delayed_t *tmp = delay_heap[a];
+  delay_heap[a] = delay_heap[b];
+  delay_heap[b] = tmp;
+}
+
+static void heap_push(tftp_delayed_t *pkt) {
+  int idx = delay_count++;
+  delay_heap[idx] = pkt;
+  while ((idx > 0) &&
+         (delay_heap[(idx - 1) / 2]->due_us > delay_heap[idx]->due_us)) {
+    heap_swap(idx, (idx - 1) / 2);
+    idx = (idx - 1) / 2;
+  }
+}
+
+static tftp_delayed_t *heap_pop(void) {
+  tftp_delayed_t *top = delay_heap[0];
+  delay_heap[0] = delay_heap[--delay_count];
+  int idx = 0;
+  while (1) {
+    int min = idx;
+    int left = 2 * idx + 1;
+    int right = left + 1;
+    if ((left < delay_count) &&
+        (delay_heap[left]->due_us < delay_heap[min]->due_us)) {
+      min = left;
+    }
+    if ((right < delay_count) &&
+        (delay_heap[right]->due_us < delay_heap[min]->due_us)) {
+      min = right;
+    }
+    if (min == idx) {
+      break;
+    }
+    heap_swap(idx, min);
+    idx = min;
+  }
+
+  return top;
+}
+
+// the socket may be closed by the time a late packet is due, it is then
+// lost like on a real network
+static void *delay_thread(void *arg) {
+  (void)arg;
+  pthread_mutex_lock(&delay_lock);
+  while (1) {
+    if (delay_count == 0) {
+      pthread_cond_wait(&delay_cond, &delay_lock);
+      continue;
+    }
+
+    int64_t due_us = delay_heap[0]->due_us;
+    if (due_us > impair_now_us()) {
+      struct timespec ts;
+      ts.tv_sec = due_us / 1000000;
+      ts.tv_nsec = (due_us % 1000000) * 1000;
+      pthread_cond_timedwait(&delay_cond, &delay_lock, &ts);
+      continue;
+    }
+
+    tftp_delayed_t *pkt = heap_pop();
+    pthread_mutex_unlock(&delay_lock);
+    sendto(pkt->sockfd, pkt->data, pkt->size, MSG_DONTWAIT,
+           (struct sockaddr *)&pkt->addr, pkt->addr_len);
+    free(pkt);
+    pthread_mutex_lock(&delay_lock);
+  }
+
+  return NULL;
+}
+
+static void copy_on_sigbus(int sig, siginfo_t *info, void *ucontext) {
+  if (copy_jmp != NULL) {
+    siglongjmp(*copy_jmp, 1);
+  }
+
+  // not a fault of the copy, the previous handler or the default action
+  // takes it. returning retries the access with that installed
+  if (copy_old_action.sa_flags & SA_SIGINFO) {
+    copy_old_action.sa_sigaction(sig, info, ucontext);
+  } else if ((copy_old_action.sa_handler != SIG_DFL) &&
+             (copy_old_action.sa_handler != SIG_IGN)) {
+    copy_old_action.sa_handler(sig);
+  } else {
+    signal(SIGBUS, SIG_DFL);
+  }
+}
+
+static void copy_init(void) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  sigemptyset(&action.sa_mask);
+  action.sa_sigaction = copy_on_sigbus;
+  action.sa_flags = SA_SIGINFO | SA_NODEFER;
+  sigaction(SIGBUS, &action, &copy_old_action);
+}
+
+static int copy_guarded(void *dst, const void *src, size_t size) {
+  pthread_once(&copy_once, copy_init);
+
+  sigjmp_buf jmp;
+  if (sigsetjmp(jmp, 0)) {
+    copy_jmp = NULL;
+    errno = EFAULT;
+    return -1;
+  }
+  copy_jmp = &jmp;
+  memcpy(dst, src, size);
+  copy_jmp = NULL;
+  return 0;
+}
+
+static int delay_start(void) {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&delay_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, delay_thread, NULL) != 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: create impairment thread failed.\n");
+    return -1;
+  }
+
+  pthread_detach(thread);
+  delay_started = 1;
+  return 0;
+}
+
+static int delay_packet(int sockfd, const struct msghdr *msg, int64_t delay_us) {
+  size_t size = 0;
+  for (size_t i = 0; i < msg->msg_iovlen; i++) {
+    size += msg->msg_iov[i].iov_len;
+  }
+
+  tftp_delayed_t *pkt = (tftp_delayed_t *)malloc(sizeof(tftp_delayed_t) + size);
+  if (pkt == NULL) {
+    errno = ENOBUFS;
+    return -1;
+  }
+
+  pkt->due_us = impair_now_us() + delay_us;
+  pkt->sockfd = sockfd;
+  pkt->addr_len = msg->msg_namelen;
+  memcpy(&pkt->addr, msg->msg_name, msg->msg_namelen);
+  pkt->size = 0;
+  for (size_t i = 0; i < msg->msg_iovlen; i++) {
+    if (copy_guarded(pkt->data + pkt->size, msg->msg_iov[i].iov_base,
+                     msg->msg_iov[i].iov_len) < 0) {
+      free(pkt);
+      return -1;
+    }
+    pkt->size += msg->msg_iov[i].iov_len;
+  }
+
+  pthread_mutex_lock(&delay_lock);
+  if (!delay_started && (delay_start() < 0)) {
+    goto delay_error;
+  }
+  if (delay_count == delay_capacity) {
+    int capacity = delay_capacity ? delay_capacity * 2 : 256;
+    tftp_delayed_t **heap = (tftp_delayed_t **)realloc(
+        delay_heap, capacity * sizeof(tftp_delayed_t *));
+    if (heap == NULL) {
+      goto delay_error;
+    }
+    delay_heap = heap;
+    delay_capacity = capacity;
+  }
+
+  heap_push(pkt);
+  pthread_cond_signal(&delay_cond);
+  pthread_mutex_unlock(&delay_lock);
+  return 0;
+
+delay_error:
+  pthread_mutex_unlock(&delay_lock);
+  free(pkt);
+  errno = ENOBUFS;
+  return -1;
+}
+
+// sendmsg through the impairment, a dropped or delayed packet counts as sent
+ssize_t tftp_impair_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+  size_t size = 0;
+  for (size_t i = 0; i < msg->msg_iovlen; i++) {
+    size += msg->msg_iov[i].iov_len;
+  }
+
+  if (impair_random() < impair.drop) {
+    return (ssize_t)size;
+  }
+
+  int copies = impair_random() < impair.dup ? 2 : 1;
+  int64_t delay_us = (int64_t)impair.delay_ms * 1000;
+  if (impair.jitter_ms > 0) {
+    delay_us += (int64_t)(impair_random() * impair.jitter_ms * 1000);
+  }
+  if (impair_random() < impair.reorder) {
+    delay_us += (int64_t)impair.reorder_ms * 1000;
+  }
+
+  while (copies--) {
+    if (delay_us > 0) {
+      if (delay_packet(sockfd, msg, delay_us) < 0) {
+        return -1;
+      }
+    } else {
+      ssize_t ret = sendmsg(sockfd, msg, flags);
+      if (ret < 0) {
+        return ret;
+      }
+    }
+  }
+
+  return (ssize_t)size;
+}
+
+// the impaired sendmmsg, one packet at a time
+int tftp_impair_sendmmsg(int sockfd, struct mmsghdr *msgs, int count,
+                         int flags) {
+  for (int i = 0; i < count; i++) {
+    ssize_t ret = tftp_impair_sendmsg(sockfd, &msgs[i].msg_hdr, flags);
+    if (ret < 0) {
+      return i ? i : -1;
+    }
+    msgs[i].msg_len = (unsigned int)ret;
+  }
+
+  return count;
+}
+
+int tftp_impair_rx_drop(void) { return impair_random() < impair.rx_drop; }
@@ -0,0 +1,33 @@
+#ifndef TFTP_IMPAIR_H
+#define TFTP_IMPAIR_H
+
+#include <stdint.h>
+#include <sys/socket.h>
+
+// network impairment for testing on one box, configured from the
+// TFTP_IMPAIR environment variable or tftp_impair_init, e.g.
+// "drop=0.01,delay=50,jitter=10,dup=0.001,reorder=0.01,seed=7".
+// drop, dup and reorder act on sent packets, rxdrop on received ones
+#define TFTP_IMPAIR_ENV "TFTP_IMPAIR"
+
+typedef struct _tftp_impair_t {
+  double drop;
+  double rx_drop;
+  double dup;
+  double reorder;
+  // every sent packet is late by delay plus up to jitter ms, a reordered
+  // one by another reorder_ms so the next packets overtake it
+  int delay_ms;
+  int jitter_ms;
+  int reorder_ms;
+  uint64_t seed;
+} tftp_impair_t;
+
+int tftp_impair_init(const char *spec);
+int tftp_impair_active(void);
+ssize_t tftp_impair_sendmsg(int sockfd, const struct msghdr *msg, int flags);
+int tftp_impair_sendmmsg(int sockfd, struct mmsghdr *msgs, int count,
+                         int flags);
+int tftp_impair_rx_drop(void);
+
+#endif
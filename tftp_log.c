@@ -0,0 +1,493 @@
+#include "tftp_log.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#define TFTP_LOG_RINGS 256
+// records per thread, a power of 2
+#define TFTP_LOG_RING_SIZE 1024
+#define TFTP_LOG_RECORD 128
+#define TFTP_LOG_FLUSH_MS 10
+
+// the format is kept by pointer, so it must be a literal. the arguments
+// follow packed: 8 bytes per number, strings copied with their nul
+typedef struct _log_record_t {
+  const char *fmt;
+  uint8_t size;
+  uint8_t cut;
+  uint8_t args[TFTP_LOG_RECORD - sizeof(const char *) - 2];
+} log_record_t;
+
+// single producer, the owning thread, and single consumer, the log thread
+// or a flush holding log_lock
+typedef struct _log_ring_t {
+  uint32_t head;
+  uint64_t dropped;
+  int orphan;
+  uint32_t tail __attribute__((aligned(64)));
+  uint64_t dropped_seen;
+  log_record_t records[TFTP_LOG_RING_SIZE];
+} log_ring_t;
+
+typedef enum _log_arg_t {
+  LOG_ARG_INT = 0,
+  LOG_ARG_LONG,
+  LOG_ARG_LLONG,
+  LOG_ARG_SIZE,
+  LOG_ARG_PTRDIFF,
+  LOG_ARG_DOUBLE,
+  LOG_ARG_STR,
+  LOG_ARG_PTR,
+  LOG_ARG_NONE,
+} log_arg_t;
+
+typedef struct _log_spec_t {
+  // flags, width and precision text without '%' and the conversion
+  const char *start;
+  int len;
+  int star_width;
+  int star_prec;
+  int long_double;
+  log_arg_t arg;
+  char conv;
+} log_spec_t;
+
+int tftp_log_level = TFTP_LOG_INFO;
+
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_key_t log_key;
+static log_ring_t *log_rings[TFTP_LOG_RINGS];
+static int log_ring_count;
+static uint64_t log_lost;
+static __thread log_ring_t *log_ring;
+static char log_out[1 << 16];
+
+static void __attribute__((constructor)) log_env(void) {
+  const char *name = getenv("TFTP_LOG");
+  if (name) {
+    int level = tftp_log_parse_level(name);
+    if (level >= 0) {
+      tftp_log_level = level;
+    }
+  }
+}
+
+int tftp_log_parse_level(const char *name) {
+  static const char *names[] = {"error", "warn", "info", "debug"};
+  for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+    if (strcasecmp(name, names[i]) == 0) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// reads one conversion at fmt, which points past the '%'
+static const char *log_spec(const char *fmt, log_spec_t *spec) {
+  memset(spec, 0, sizeof(log_spec_t));
+  spec->start = fmt;
+  while (*fmt && strchr("-+ #0", *fmt)) {
+    fmt++;
+  }
+  if (*fmt == '*') {
+    spec->star_width = 1;
+    fmt++;
+  }
+  while ((*fmt >= '0') && (*fmt <= '9')) {
+    fmt++;
+  }
+  if (*fmt == '.') {
+    fmt++;
+    if (*fmt == '*') {
+      spec->star_prec = 1;
+      fmt++;
+    }
+    while ((*fmt >= '0') && (*fmt <= '9')) {
+      fmt++;
+    }
+  }
+
+  log_arg_t arg = LOG_ARG_INT;
+  if ((fmt[0] == 'l') && (fmt[1] == 'l')) {
+    arg = LOG_ARG_LLONG;
+    fmt += 2;
+  } else if (*fmt == 'l') {
+    arg = LOG_ARG_LONG;
+    fmt++;
+  } else if ((*fmt == 'j') || (*fmt == 'q')) {
+    arg = LOG_ARG_LLONG;
+    fmt++;
+  } else if (*fmt == 'z') {
+    arg = LOG_ARG_SIZE;
+    fmt++;
+  } else if (*fmt == 't') {
+    arg = LOG_ARG_PTRDIFF;
+    fmt++;
+  } else {
+    // h only narrows what is printed, the argument is still an int
+    while (*fmt == 'h') {
+      fmt++;
+    }
+    if (*fmt == 'L') {
+      spec->long_double = 1;
+      fmt++;
+    }
+  }
+
+  spec->conv = *fmt;
+  if (*fmt == '\0') {
+    spec->arg = LOG_ARG_NONE;
+    spec->len = (int)(fmt - spec->start);
+    return fmt;
+  }
+  if (strchr("eEfFgGaA", *fmt)) {
+    arg = LOG_ARG_DOUBLE;
+  } else if (*fmt == 's') {
+    arg = LOG_ARG_STR;
+  } else if (*fmt == 'p') {
+    arg = LOG_ARG_PTR;
+  } else if (!strchr("diouxXc", *fmt)) {
+    arg = LOG_ARG_NONE;
+  }
+  spec->arg = arg;
+  fmt++;
+  spec->len = (int)(fmt - spec->start);
+  return fmt;
+}
+
+static void log_key_done(void *arg) {
+  log_ring_t *ring = (log_ring_t *)arg;
+  __atomic_store_n(&ring->orphan, 1, __ATOMIC_RELEASE);
+}
+
+static void log_drain(void);
+
+static void *log_thread(void *arg) {
+  (void)arg;
+  struct timespec ts = {0, TFTP_LOG_FLUSH_MS * 1000000L};
+  while (1) {
+    nanosleep(&ts, NULL);
+    log_drain();
+  }
+
+  return NULL;
+}
+
+static void log_start(void) {
+  pthread_key_create(&log_key, log_key_done);
+  atexit(tftp_log_flush);
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, log_thread, NULL) != 0) {
+    // still printed by tftp_log_flush and at exit
+    printf("tftp: create log thread failed.\n");
+    return;
+  }
+  pthread_detach(thread);
+}
+
+// a thread that exited leaves its ring to the next new one once drained
+static log_ring_t *log_ring_get(void) {
+  pthread_once(&log_once, log_start);
+
+  log_ring_t *ring = NULL;
+  pthread_mutex_lock(&log_lock);
+  for (int i = 0; i < log_ring_count; i++) {
+    log_ring_t *other = log_rings[i];
+    if (__atomic_load_n(&other->orphan, __ATOMIC_ACQUIRE) &&
+        (other->tail == other->head)) {
+      other->orphan = 0;
+      ring = other;
+      break;
+    }
+  }
+  if ((ring == NULL) && (log_ring_count < TFTP_LOG_RINGS)) {
+    ring = (log_ring_t *)calloc(1, sizeof(log_ring_t));
+    if (ring) {
+      log_rings[log_ring_count++] = ring;
+    }
+  }
+  pthread_mutex_unlock(&log_lock);
+
+  if (ring) {
+    pthread_setspecific(log_key, ring);
+  }
+  return ring;
+}
+
+void tftp_log_write(int level, const char *fmt, ...) {
+  (void)level;
+  log_ring_t *ring = log_ring;
+  if (ring == NULL) {
+    ring = log_ring = log_ring_get();
+    if (ring == NULL) {
+      __atomic_add_fetch(&log_lost, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
+
+  uint32_t head = ring->head;
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) ==
+      TFTP_LOG_RING_SIZE) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  log_record_t *rec = &ring->records[head & (TFTP_LOG_RING_SIZE - 1)];
+  rec->fmt = fmt;
+  rec->cut = 0;
+
+  // only the arguments are copied here, the text is made by the log thread
+  size_t size = 0;
+  va_list ap;
+  va_start(ap, fmt);
+  while ((fmt = strchr(fmt, '%')) != NULL) {
+    fmt++;
+    if (*fmt == '%') {
+      fmt++;
+      continue;
+    }
+
+    log_spec_t spec;
+    fmt = log_spec(fmt, &spec);
+    int64_t values[3];
+    int count = 0;
+    if (spec.star_width) {
+      values[count++] = va_arg(ap, int);
+    }
+    if (spec.star_prec) {
+      values[count++] = va_arg(ap, int);
+    }
+
+    const char *str = NULL;
+    switch (spec.arg) {
+      case LOG_ARG_INT:
+        values[count++] = va_arg(ap, int);
+        break;
+      case LOG_ARG_LONG:
+        values[count++] = va_arg(ap, long);
+        break;
+      case LOG_ARG_LLONG:
+        values[count++] = va_arg(ap, long long);
+        break;
+      case LOG_ARG_SIZE:
+        values[count++] = (int64_t)va_arg(ap, size_t);
+        break;
+      case LOG_ARG_PTRDIFF:
+        values[count++] = va_arg(ap, ptrdiff_t);
+        break;
+      case LOG_ARG_DOUBLE: {
+        double value = spec.long_double ? (double)va_arg(ap, long double)
+                                        : va_arg(ap, double);
+        memcpy(&values[count++], &value, sizeof(value));
+        break;
+      }
+      case LOG_ARG_STR:
+        str = va_arg(ap, const char *);
+        if (str == NULL) {
+          str = "(null)";
+        }
+        break;
+      case LOG_ARG_PTR:
+        values[count++] = (int64_t)(intptr_t)va_arg(ap, void *);
+        break;
+      case LOG_ARG_NONE:
+        break;
+    }
+
+    if (size + count * sizeof(int64_t) + (str ? 1 : 0) > sizeof(rec->args)) {
+      rec->cut = 1;
+      break;
+    }
+    memcpy(rec->args + size, values, count * sizeof(int64_t));
+    size += count * sizeof(int64_t);
+    if (str) {
+      size_t len = strlen(str);
+      if (len > sizeof(rec->args) - size - 1) {
+        len = sizeof(rec->args) - size - 1;
+        rec->cut = 1;
+      }
+      memcpy(rec->args + size, str, len);
+      size += len;
+      rec->args[size++] = '\0';
+    }
+  }
+  va_end(ap);
+  rec->size = (uint8_t)size;
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+static int64_t log_value(const log_record_t *rec, size_t *pos) {
+  int64_t value;
+  memcpy(&value, rec->args + *pos, sizeof(value));
+  *pos += sizeof(value);
+  return value;
+}
+
+// formats one record into out, returns the length
+static int log_format(const log_record_t *rec, char *out, int size) {
+  const char *fmt = rec->fmt;
+  size_t pos = 0;
+  int len = 0;
+
+#define LOG_PUT(...)                                                  \
+  do {                                                                \
+    int n = snprintf(out + len, size - len, __VA_ARGS__);             \
+    len = n < 0 ? len : (len + n >= size ? size - 1 : len + n);      \
+  } while (0)
+
+  while (*fmt && (len < size - 1)) {
+    const char *pct = strchr(fmt, '%');
+    int lit = pct ? (int)(pct - fmt) : (int)strlen(fmt);
+    LOG_PUT("%.*s", lit, fmt);
+    if (pct == NULL) {
+      break;
+    }
+    fmt = pct + 1;
+    if (*fmt == '%') {
+      LOG_PUT("%%");
+      fmt++;
+      continue;
+    }
+
+    log_spec_t spec;
+    fmt = log_spec(fmt, &spec);
+    if (spec.arg == LOG_ARG_NONE) {
+      continue;
+    }
+    size_t need = (spec.star_width + spec.star_prec) * sizeof(int64_t) +
+                  (spec.arg == LOG_ARG_STR ? 1 : sizeof(int64_t));
+    if (pos + need > rec->size) {
+      break;
+    }
+
+    // rebuilt without the * and the length modifier, the value is passed
+    // with the widest type of its kind
+    char conv[32];
+    int n = 0;
+    conv[n++] = '%';
+    const char *end = spec.start + spec.len - 1;
+    for (const char *c = spec.start; c < end; c++) {
+      if (n >= (int)sizeof(conv) - 16) {
+        break;
+      } else if (*c == '*') {
+        n += snprintf(conv + n, sizeof(conv) - n, "%d",
+                      (int)log_value(rec, &pos));
+      } else if (!strchr("hlLjzqt", *c)) {
+        conv[n++] = *c;
+      }
+    }
+
+    switch (spec.arg) {
+      case LOG_ARG_DOUBLE: {
+        conv[n++] = spec.conv;
+        conv[n] = '\0';
+        int64_t bits = log_value(rec, &pos);
+        double value;
+        memcpy(&value, &bits, sizeof(value));
+        LOG_PUT(conv, value);
+        break;
+      }
+      case LOG_ARG_STR: {
+        conv[n++] = 's';
+        conv[n] = '\0';
+        const char *str = (const char *)rec->args + pos;
+        pos += strlen(str) + 1;
+        LOG_PUT(conv, str);
+        break;
+      }
+      case LOG_ARG_PTR:
+        conv[n++] = 'p';
+        conv[n] = '\0';
+        LOG_PUT(conv, (void *)(intptr_t)log_value(rec, &pos));
+        break;
+      default: {
+        int64_t value = log_value(rec, &pos);
+        if (spec.conv == 'c') {
+          conv[n++] = 'c';
+          conv[n] = '\0';
+          LOG_PUT(conv, (int)value);
+          break;
+        }
+
+        conv[n++] = 'l';
+        conv[n++] = 'l';
+        conv[n++] = spec.conv;
+        conv[n] = '\0';
+        if (strchr("di", spec.conv)) {
+          LOG_PUT(conv, (long long)value);
+        } else {
+          // an unsigned int was widened with its sign, keep its own bits
+          uint64_t bits = (uint64_t)value;
+          if (spec.arg == LOG_ARG_INT) {
+            bits &= 0xffffffffu;
+          }
+          LOG_PUT(conv, (unsigned long long)bits);
+        }
+        break;
+      }
+    }
+  }
+
+  if (rec->cut && (len < size - 1)) {
+    LOG_PUT("...\n");
+  }
+#undef LOG_PUT
+
+  return len;
+}
+
+static void log_drain(void) {
+  pthread_mutex_lock(&log_lock);
+  size_t len = 0;
+  for (int i = 0; i < log_ring_count; i++) {
+    log_ring_t *ring = log_rings[i];
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint32_t tail = ring->tail;
+    for (; tail != head; tail++) {
+      if (sizeof(log_out) - len < TFTP_LOG_RECORD * 4) {
+        fwrite(log_out, 1, len, stdout);
+        len = 0;
+      }
+      len += log_format(&ring->records[tail & (TFTP_LOG_RING_SIZE - 1)],
+                        log_out + len, (int)(sizeof(log_out) - len));
+    }
+    __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+
+    uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    if (dropped != ring->dropped_seen) {
+      len += snprintf(log_out + len, sizeof(log_out) - len,
+                      "tftp: %" PRIu64 " log messages dropped\n",
+                      dropped - ring->dropped_seen);
+      ring->dropped_seen = dropped;
+    }
+  }
+
+  uint64_t lost = __atomic_exchange_n(&log_lost, 0, __ATOMIC_RELAXED);
+  if (lost) {
+    len += snprintf(log_out + len, sizeof(log_out) - len,
+                    "tftp: %" PRIu64 " log messages lost, too many threads\n",
+                    lost);
+  }
+
+  if (len) {
+    fwrite(log_out, 1, len, stdout);
+    fflush(stdout);
+  }
+  pthread_mutex_unlock(&log_lock);
+}
+
+void tftp_log_flush(void) {
+  log_drain();
+}
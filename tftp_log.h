@@ -0,0 +1,31 @@
+#ifndef TFTP_LOG_H
+#define TFTP_LOG_H
+
+typedef enum _tftp_log_level_t {
+  TFTP_LOG_ERROR = 0,
+  TFTP_LOG_WARN,
+  TFTP_LOG_INFO,
+  TFTP_LOG_DEBUG,
+} tftp_log_level_t;
+
+// messages above this level are skipped before their arguments are looked
+// at. TFTP_LOG=error|warn|info|debug sets it at startup, info by default
+extern int tftp_log_level;
+
+#define tftp_log(level, ...)                  \
+  do {                                        \
+    if ((int)(level) <= tftp_log_level) {     \
+      tftp_log_write((level), __VA_ARGS__);   \
+    }                                         \
+  } while (0)
+
+// queues the format and a copy of its arguments on the calling thread's
+// ring, the log thread formats and prints them to stdout. a full ring
+// drops the message
+void tftp_log_write(int level, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+int tftp_log_parse_level(const char *name);
+// prints everything logged so far before returning
+void tftp_log_flush(void);
+
+#endif
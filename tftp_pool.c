@@ -0,0 +1,78 @@
+#include "tftp_pool.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "tftp_log.h"
+
+#define TFTP_POOL_ALIGN 16
+
+void tftp_pool_init(tftp_pool_t *pool, size_t obj_size) {
+  if (obj_size < sizeof(void *)) {
+    obj_size = sizeof(void *);
+  }
+
+  pool->obj_size = (obj_size + TFTP_POOL_ALIGN - 1) & ~(TFTP_POOL_ALIGN - 1);
+  pool->slab_count = 0;
+  pool->used = 0;
+  pool->free_list = NULL;
+  pool->slabs = NULL;
+}
+
+static int pool_grow(tftp_pool_t *pool) {
+  size_t head = (sizeof(tftp_slab_t) + TFTP_POOL_ALIGN - 1) &
+                ~(TFTP_POOL_ALIGN - 1);
+  size_t count = (TFTP_POOL_SLAB_SIZE - head) / pool->obj_size;
+  if (count == 0) {
+    count = 1;
+  }
+
+  tftp_slab_t *slab = (tftp_slab_t *)malloc(head + count * pool->obj_size);
+  if (slab == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: alloc pool slab failed.\n");
+    return -1;
+  }
+  slab->next = pool->slabs;
+  pool->slabs = slab;
+  pool->slab_count++;
+
+  // thread the new objects onto the free list, lowest address first
+  uint8_t *obj = (uint8_t *)slab + head + (count - 1) * pool->obj_size;
+  for (size_t i = 0; i < count; i++) {
+    *(void **)obj = pool->free_list;
+    pool->free_list = obj;
+    obj -= pool->obj_size;
+  }
+
+  return 0;
+}
+
+void *tftp_pool_get(tftp_pool_t *pool) {
+  if ((pool->free_list == NULL) && (pool_grow(pool) < 0)) {
+    return NULL;
+  }
+
+  void *obj = pool->free_list;
+  pool->free_list = *(void **)obj;
+  pool->used++;
+  return obj;
+}
+
+void tftp_pool_put(tftp_pool_t *pool, void *obj) {
+  *(void **)obj = pool->free_list;
+  pool->free_list = obj;
+  pool->used--;
+}
+
+void tftp_pool_destroy(tftp_pool_t *pool) {
+  while (pool->slabs) {
+    tftp_slab_t *next = pool->slabs->next;
+    free(pool->slabs);
+    pool->slabs = next;
+  }
+
+  pool->slab_count = 0;
+  pool->used = 0;
+  pool->free_list = NULL;
+}
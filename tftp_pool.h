@@ -0,0 +1,27 @@
+#ifndef TFTP_POOL_H
+#define TFTP_POOL_H
+
+#include <stddef.h>
+
+#define TFTP_POOL_SLAB_SIZE (64 * 1024)
+
+typedef struct _tftp_slab_t {
+  struct _tftp_slab_t *next;
+} tftp_slab_t;
+
+// fixed size objects carved from slabs, freed objects go on a free list and
+// slabs are only returned by tftp_pool_destroy. not locked, one per thread
+typedef struct _tftp_pool_t {
+  size_t obj_size;
+  int slab_count;
+  int used;
+  void *free_list;
+  tftp_slab_t *slabs;
+} tftp_pool_t;
+
+void tftp_pool_init(tftp_pool_t *pool, size_t obj_size);
+void *tftp_pool_get(tftp_pool_t *pool);
+void tftp_pool_put(tftp_pool_t *pool, void *obj);
+void tftp_pool_destroy(tftp_pool_t *pool);
+
+#endif
@@ -0,0 +1,136 @@
+#include "tftp_rate.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tftp_base.h"
+#include "tftp_log.h"
+
+void tftp_rate_init(tftp_rate_t *rate, int64_t bytes_per_sec) {
+  memset(rate, 0, sizeof(tftp_rate_t));
+  pthread_mutex_init(&rate->lock, NULL);
+  rate->rate = bytes_per_sec;
+  // 20ms worth, but always room for a couple of the largest blocks
+  rate->burst = bytes_per_sec / 50;
+  if (rate->burst < 2 * (int64_t)TFTP_PKT_SIZE(TFTP_MAX_BLKSIZE)) {
+    rate->burst = 2 * (int64_t)TFTP_PKT_SIZE(TFTP_MAX_BLKSIZE);
+  }
+  rate->tokens = rate->burst;
+  rate->stamp_us = tftp_now_us();
+}
+
+// called with the lock held
+static void rate_refill(tftp_rate_t *rate) {
+  int64_t now = tftp_now_us();
+  rate->tokens += (now - rate->stamp_us) * rate->rate / 1000000;
+  rate->stamp_us = now;
+  if (rate->tokens > rate->burst) {
+    rate->tokens = rate->burst;
+  }
+}
+
+// grant up to size bytes, at most quantum and in whole units but at least
+// one, unless the bucket is in debt: then 0 is granted and *delay_us tells
+// when to ask again
+int64_t tftp_rate_take(tftp_rate_t *rate, int64_t size, int64_t unit,
+                       int64_t quantum, int64_t *delay_us) {
+  pthread_mutex_lock(&rate->lock);
+  rate_refill(rate);
+
+  if (rate->tokens <= 0) {
+    *delay_us = -rate->tokens * 1000000 / rate->rate + 1;
+    pthread_mutex_unlock(&rate->lock);
+    return 0;
+  }
+
+  if (size > quantum) {
+    size = quantum;
+  }
+  if (size > unit) {
+    size -= size % unit;
+  } else {
+    size = unit;
+  }
+  rate->tokens -= size;
+  pthread_mutex_unlock(&rate->lock);
+  return size;
+}
+
+// whether the bucket is more than half full, its users leave part of the
+// rate unused
+int tftp_rate_spare(tftp_rate_t *rate) {
+  pthread_mutex_lock(&rate->lock);
+  rate_refill(rate);
+  int spare = rate->tokens > rate->burst / 2;
+  pthread_mutex_unlock(&rate->lock);
+  return spare;
+}
+
+// give back what was granted but not sent
+void tftp_rate_put(tftp_rate_t *rate, int64_t size) {
+  pthread_mutex_lock(&rate->lock);
+  rate->tokens += size;
+  pthread_mutex_unlock(&rate->lock);
+}
+
+void tftp_rate_table_init(tftp_rate_table_t *table, int64_t bytes_per_sec,
+                          int prefix) {
+  memset(table, 0, sizeof(tftp_rate_table_t));
+  pthread_mutex_init(&table->lock, NULL);
+  table->rate = bytes_per_sec;
+  if ((prefix <= 0) || (prefix > 32)) {
+    prefix = 32;
+  }
+  table->mask = htonl(prefix == 32 ? 0xffffffffu : ~(0xffffffffu >> prefix));
+}
+
+// the bucket of the client or subnet of addr, released with
+// tftp_rate_release
+tftp_rate_t *tftp_rate_get(tftp_rate_table_t *table, in_addr_t addr) {
+  addr &= table->mask;
+  unsigned int idx = ntohl(addr) * 2654435761u % TFTP_RATE_BUCKETS;
+
+  pthread_mutex_lock(&table->lock);
+  tftp_rate_t *rate = table->buckets[idx];
+  while (rate && (rate->addr != addr)) {
+    rate = rate->next;
+  }
+
+  if (rate == NULL) {
+    rate = (tftp_rate_t *)malloc(sizeof(tftp_rate_t));
+    if (rate == NULL) {
+      pthread_mutex_unlock(&table->lock);
+      tftp_log(TFTP_LOG_ERROR, "tftp: alloc rate bucket failed.\n");
+      return NULL;
+    }
+    tftp_rate_init(rate, table->rate);
+    rate->addr = addr;
+    rate->next = table->buckets[idx];
+    table->buckets[idx] = rate;
+  }
+
+  rate->refs++;
+  pthread_mutex_unlock(&table->lock);
+  return rate;
+}
+
+void tftp_rate_release(tftp_rate_table_t *table, tftp_rate_t *rate) {
+  unsigned int idx = ntohl(rate->addr) * 2654435761u % TFTP_RATE_BUCKETS;
+
+  pthread_mutex_lock(&table->lock);
+  if (--rate->refs > 0) {
+    pthread_mutex_unlock(&table->lock);
+    return;
+  }
+
+  tftp_rate_t **prev = &table->buckets[idx];
+  while (*prev != rate) {
+    prev = &(*prev)->next;
+  }
+  *prev = rate->next;
+  pthread_mutex_unlock(&table->lock);
+
+  pthread_mutex_destroy(&rate->lock);
+  free(rate);
+}
@@ -0,0 +1,43 @@
+#ifndef TFTP_RATE_H
+#define TFTP_RATE_H
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+
+#define TFTP_RATE_BUCKETS 256
+
+// token bucket of bytes, shared by threads. a grant may leave it in debt,
+// the next one waits until the debt is paid off
+typedef struct _tftp_rate_t {
+  pthread_mutex_t lock;
+  int64_t rate;
+  int64_t burst;
+  int64_t tokens;
+  int64_t stamp_us;
+
+  // client buckets: the masked address they limit and the sessions using it
+  struct _tftp_rate_t *next;
+  in_addr_t addr;
+  int refs;
+} tftp_rate_t;
+
+// one bucket per client address or subnet, created while sessions use it
+typedef struct _tftp_rate_table_t {
+  pthread_mutex_t lock;
+  int64_t rate;
+  in_addr_t mask;
+  tftp_rate_t *buckets[TFTP_RATE_BUCKETS];
+} tftp_rate_table_t;
+
+void tftp_rate_init(tftp_rate_t *rate, int64_t bytes_per_sec);
+int64_t tftp_rate_take(tftp_rate_t *rate, int64_t size, int64_t unit,
+                       int64_t quantum, int64_t *delay_us);
+int tftp_rate_spare(tftp_rate_t *rate);
+void tftp_rate_put(tftp_rate_t *rate, int64_t size);
+void tftp_rate_table_init(tftp_rate_table_t *table, int64_t bytes_per_sec,
+                          int prefix);
+tftp_rate_t *tftp_rate_get(tftp_rate_table_t *table, in_addr_t addr);
+void tftp_rate_release(tftp_rate_table_t *table, tftp_rate_t *rate);
+
+#endif
@@ -1,266 +1,2293 @@
 #include "tftp_server.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <linux/errqueue.h>
+#include <sys/epoll.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/xattr.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "tftp_cache.h"
+#include "tftp_impair.h"
+#include "tftp_log.h"
+#include "tftp_pool.h"
+#include "tftp_rate.h"
+#include "tftp_stats.h"
+#include "tftp_uring.h"
+#include "tftp_writer.h"
+
+#define TFTPD_MAX_EVENTS 64
+#define TFTPD_LINGER_SEC 3
+#define TFTPD_MCAST_GROUPS 64
+#define TFTPD_TABLE_BUCKETS 1024
+// requests waiting for a session per loop when max_sessions is set, how
+// long one may wait and how often the loop looks for a free session
+#define TFTPD_QUEUE_SIZE 64
+#define TFTPD_QUEUE_WAIT_MS 5000
+#define TFTPD_ADMIT_POLL_MS 10
+#define TFTPD_BUSY_MSG "Server busy"
+#define TFTPD_CHANGED_MSG "File changed"
+// data goes out of the loop's batch buffers, a session only sends acks,
+// oacks and errors from its own buffer
+#define TFTPD_CTRL_SIZE (4 + TFTP_DEF_BLKSIZE)
+
+#define TFTPD_URING_ENTRIES 1024
+#define TFTPD_URING_CQ_ENTRIES 8192
+// DATA packets a loop may have queued to the io_uring at once
+#define TFTPD_URING_SLOTS 256
+
+// what an io_uring completion belongs to, kept in the low bits of user_data
+#define TFTPD_UD_POLL 0
+#define TFTPD_UD_SEND 1
+#define TFTPD_UD_WRITE 2
+#define TFTPD_UD_NONE 3
+#define TFTPD_UD_MASK 7
+
+// tsize of the upload a part file was written for
+#define TFTPD_PART_XATTR "user.tftpd.tsize"
+
+// DATA headers of epoll zerocopy sends one session may have in flight
+#define TFTPD_ZC_HEADERS 256
+
+// smallest block sent with zerocopy, below it pinning the pages and reaping
+// the notification cost more than the copy
+#define TFTPD_ZEROCOPY_MIN 8192
+
+typedef enum _tftp_state_t {
+  TFTP_STATE_OACK = 0,
+  TFTP_STATE_SEND,
+  TFTP_STATE_RECV,
+  TFTP_STATE_FLUSH,
+  TFTP_STATE_LINGER,
+  TFTP_STATE_DONE,
+} tftp_state_t;
+
+typedef struct _tftp_slot_t {
+  struct _tftp_slot_t *next;
+  struct _tftp_session_t *owner;
+  struct msghdr msg;
+  struct iovec iov[2];
+  struct sockaddr remote;
+  tftp_packet_t *packet;
+} tftp_slot_t;
+
+typedef struct _tftp_member_t {
+  struct sockaddr remote;
+  int done;
+} tftp_member_t;
+
+typedef struct _tftp_session_t {
+  tftp_state_t state;
+  int closed;
+  int fd;
+  tftp_file_t *cache;
+  char path[256];
+  // path with a ".part" or ".XXXXXX" suffix
+  char tmp_path[256 + 8];
+
+  // send: first unacked block, recv: next expected block
+  uint16_t base_blk;
+  off_t base_offset;
+  // end of the file range already handed to the kernel for read-ahead
+  off_t ra_offset;
+  int win_sent;
+  int win_last;
+  size_t last_size;
+  int rewound;
+  int win_count;
+  int gap_acked;
+  int wait_out;
+  // io_uring: the socket poll is armed, sends not completed yet, next
+  // session waiting for send slots
+  int polling;
+  int tx_pending;
+  struct _tftp_session_t *wait_next;
+  // closed while the sq was full, the poll is removed on the next iteration
+  int unwatch;
+  struct _tftp_session_t *unwatch_next;
+  // DATA leaves with MSG_ZEROCOPY (or SENDMSG_ZC) straight from the mapping
+  int zerocopy;
+  // MSG_ZEROCOPY pins the header of a DATA packet as well, until the
+  // kernel reports the send done. the headers live here, in the slot of the
+  // zerocopy id of their send: ids up to zc_done are reported, zc_bits
+  // marks those reported past it and zc_next is the id of the next send
+  uint8_t (*zc_headers)[4];
+  uint32_t zc_next;
+  uint32_t zc_done;
+  uint64_t zc_bits[TFTPD_ZC_HEADERS / 64];
+  // counted in server_senders, limited by the bucket of its client and
+  // waiting on the timer for tokens
+  int sender;
+  tftp_rate_t *rate;
+  int throttled;
+  // its share of the aggregate limit, tokens that come in at the rate
+  // divided by the sessions sending, and whether the last grant used them
+  int64_t share_tokens;
+  int64_t share_us;
+  int shared;
+
+  int64_t total_size;
+  int64_t total_block;
+  int64_t start_ms;
+
+  // write-behind of an upload: the chunk being filled, chunks queued to the
+  // writer oldest first and the end of the data known to be on disk
+  tftp_chunk_t *chunk;
+  tftp_chunk_t *wb_head;
+  tftp_chunk_t *wb_last;
+  off_t wb_offset;
+  off_t wb_synced;
+  int wb_pending;
+  int wb_held;
+  int wb_err;
+
+  int64_t deadline;
+  int timer_idx;
+
+  // in the loop's table of running transfers until closed, keyed on the
+  // client endpoint of the request. a multicast session points
+  // req.tftp.remote at its group, so the endpoint is kept here
+  int in_table;
+  struct sockaddr table_key;
+  struct _tftp_session_t *table_next;
+
+  // admission: priority and arrival while queued, counted in
+  // server_sessions once opened
+  int64_t rank;
+  int64_t queued_ms;
+  uint64_t queue_seq;
+  int admitted;
+
+  // rfc 2090 multicast: one session per file sends to the group, driven by
+  // the acks of the master client, the other members listen
+  int mcast;
+  int group_idx;
+  struct sockaddr_in group;
+  uint16_t last_blk;
+  tftp_member_t *members;
+  int member_count;
+  int master;
+  struct _tftp_session_t *mcast_next;
+
+  tftp_req_t req;
+} tftp_session_t;
+
+typedef struct _tftp_loop_t {
+  int epfd;
+  int cpu;
+  tftp_t listener;
+  tftp_batch_t rx_batch;
+  tftp_batch_t tx_batch;
+
+  tftp_session_t **timers;
+  int timer_count;
+  int timer_capacity;
+
+  tftp_session_t *mcast_list;
+
+  // running transfers by client endpoint and filename. so_reuseport sends
+  // all datagrams of an endpoint to the same loop, so it needs no lock
+  tftp_session_t *table[TFTPD_TABLE_BUCKETS];
+
+  // parsed requests waiting for a session, sorted with the next one last
+  tftp_session_t **queue;
+  int queue_count;
+  uint64_t queue_seq;
+
+  tftp_pool_t session_pool;
+  tftp_pool_t ctrl_pool;
+  tftp_writer_t writer;
+
+  int uring;
+  tftp_uring_t ring;
+  tftp_slot_t *slots;
+  tftp_slot_t *free_slots;
+  tftp_slot_t *tx_queue[TFTP_BATCH_SIZE];
+  int tx_count;
+  tftp_session_t *wait_head;
+  tftp_session_t **wait_tail;
+  tftp_session_t *unwatch_head;
+
+  tftp_stats_t *stats;
+
+  // the thread waits until every loop is open, a negative run stops it
+  // before serving
+  pthread_t thread;
+  int run;
+} tftp_loop_t;
+
 static const char *server_path;
 static uint16_t server_port;
-static tftp_t tftp;
+static int server_blksize;
+static mode_t server_umask;
+static struct in_addr mcast_base;
+static uint16_t mcast_port;
+static pthread_mutex_t mcast_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint8_t mcast_used[TFTPD_MCAST_GROUPS];
+// aggregate and per client send rate limits. the aggregate is shared
+// fairly by the sessions sending, see session_grant
+static tftp_rate_t server_rate;
+static tftp_rate_table_t client_rates;
+static int server_senders;
+// sessions of all loops against max_sessions, queued requests from
+// priority_net go first, then the smaller files
+static int server_sessions;
+static int server_max_sessions;
+static int server_queue_size;
+static in_addr_t prio_addr;
+static in_addr_t prio_mask;
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
 
-static int do_recv_file(tftp_req_t *req) {
-  tftp_t *tftp = &req->tftp;
+static int64_t now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_swap(tftp_loop_t *loop, int a, int b) {
+  tftp_session_t *sess = loop->timers[a];
+  loop->timers[a] = loop->timers[b];
+  loop->timers[b] = sess;
+  loop->timers[a]->timer_idx = a;
+  loop->timers[b]->timer_idx = b;
+}
+
+static void timer_sift(tftp_loop_t *loop, int idx) {
+  while (idx > 0) {
+    int parent = (idx - 1) / 2;
+    if (loop->timers[parent]->deadline <= loop->timers[idx]->deadline) {
+      break;
+    }
+    timer_swap(loop, idx, parent);
+    idx = parent;
+  }
+
+  while (1) {
+    int min = idx;
+    int left = idx * 2 + 1;
+    int right = left + 1;
+    if ((left < loop->timer_count) &&
+        (loop->timers[left]->deadline < loop->timers[min]->deadline)) {
+      min = left;
+    }
+    if ((right < loop->timer_count) &&
+        (loop->timers[right]->deadline < loop->timers[min]->deadline)) {
+      min = right;
+    }
+    if (min == idx) {
+      break;
+    }
+    timer_swap(loop, idx, min);
+    idx = min;
+  }
+}
+
+static void timer_del(tftp_loop_t *loop, tftp_session_t *sess) {
+  int idx = sess->timer_idx;
+  if (idx < 0) {
+    return;
+  }
+
+  sess->timer_idx = -1;
+  if (--loop->timer_count != idx) {
+    loop->timers[idx] = loop->timers[loop->timer_count];
+    loop->timers[idx]->timer_idx = idx;
+    timer_sift(loop, idx);
+  }
+}
+
+static int timer_set(tftp_loop_t *loop, tftp_session_t *sess, int64_t tmo) {
+  sess->deadline = now_ms() + tmo;
+  if (sess->timer_idx >= 0) {
+    timer_sift(loop, sess->timer_idx);
+    return 0;
+  }
+
+  if (loop->timer_count == loop->timer_capacity) {
+    int capacity = loop->timer_capacity ? loop->timer_capacity * 2 : 64;
+    tftp_session_t **timers =
+        realloc(loop->timers, capacity * sizeof(tftp_session_t *));
+    if (timers == NULL) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: alloc timer failed.\n");
+      return -1;
+    }
+    loop->timers = timers;
+    loop->timer_capacity = capacity;
+  }
+
+  sess->timer_idx = loop->timer_count++;
+  loop->timers[sess->timer_idx] = sess;
+  timer_sift(loop, sess->timer_idx);
+  return 0;
+}
+
+static unsigned int table_hash(const struct sockaddr *remote,
+                               const char *filename) {
+  const struct sockaddr_in *addr = (const struct sockaddr_in *)remote;
+  unsigned int hash = 2166136261u;
+  hash = (hash ^ addr->sin_addr.s_addr) * 16777619u;
+  hash = (hash ^ addr->sin_port) * 16777619u;
+  while (*filename) {
+    hash = (hash ^ (unsigned char)*filename++) * 16777619u;
+  }
+
+  return hash % TFTPD_TABLE_BUCKETS;
+}
+
+static tftp_session_t *table_find(tftp_loop_t *loop,
+                                  const struct sockaddr *remote,
+                                  const char *filename) {
+  const struct sockaddr_in *addr = (const struct sockaddr_in *)remote;
+  tftp_session_t *sess = loop->table[table_hash(remote, filename)];
+  for (; sess; sess = sess->table_next) {
+    const struct sockaddr_in *other =
+        (const struct sockaddr_in *)&sess->table_key;
+    if ((other->sin_addr.s_addr == addr->sin_addr.s_addr) &&
+        (other->sin_port == addr->sin_port) &&
+        (strcmp(sess->req.filename, filename) == 0)) {
+      return sess;
+    }
+  }
+
+  return NULL;
+}
+
+static void table_add(tftp_loop_t *loop, tftp_session_t *sess) {
+  memcpy(&sess->table_key, &sess->req.tftp.remote, sizeof(sess->table_key));
+  unsigned int idx = table_hash(&sess->table_key, sess->req.filename);
+  sess->table_next = loop->table[idx];
+  loop->table[idx] = sess;
+  sess->in_table = 1;
+}
+
+static void table_del(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_session_t **prev =
+      &loop->table[table_hash(&sess->table_key, sess->req.filename)];
+  while (*prev && (*prev != sess)) {
+    prev = &(*prev)->table_next;
+  }
+
+  if (*prev) {
+    *prev = sess->table_next;
+  }
+  sess->in_table = 0;
+}
+
+static int admit_take(void) {
+  int count = __atomic_load_n(&server_sessions, __ATOMIC_RELAXED);
+  do {
+    if (server_max_sessions && (count >= server_max_sessions)) {
+      return 0;
+    }
+  } while (!__atomic_compare_exchange_n(&server_sessions, &count, count + 1, 1,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  return 1;
+}
+
+static void admit_put(void) {
+  __atomic_sub_fetch(&server_sessions, 1, __ATOMIC_RELAXED);
+}
+
+static int session_arm(tftp_loop_t *loop, tftp_session_t *sess) {
+  return timer_set(loop, sess, (sess->req.tftp.rto_us + 999) / 1000);
+}
+
+static int set_nonblock(int sockfd) {
+  int flags = fcntl(sockfd, F_GETFL, 0);
+  if ((flags < 0) || (fcntl(sockfd, F_SETFL, flags | O_NONBLOCK) < 0)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// wait for a socket to become readable, events come back with ptr
+static int loop_watch(tftp_loop_t *loop, int sockfd, void *ptr) {
+  if (!loop->uring) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    return epoll_ctl(loop->epfd, EPOLL_CTL_ADD, sockfd, &ev);
+  }
+
+  struct io_uring_sqe *sqe = tftp_uring_sqe(&loop->ring);
+  if (sqe == NULL) {
+    return -1;
+  }
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = sockfd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = (uint64_t)(uintptr_t)ptr | TFTPD_UD_POLL;
+  return 0;
+}
+
+static void loop_unwatch(tftp_loop_t *loop, int sockfd, void *ptr) {
+  if (!loop->uring) {
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, sockfd, NULL);
+    return;
+  }
+
+  // the poll ends with a last completion, which releases the session. with
+  // no sqe to spare the session waits for the next iteration
+  struct io_uring_sqe *sqe = tftp_uring_sqe(&loop->ring);
+  if (sqe == NULL) {
+    tftp_session_t *sess = (tftp_session_t *)ptr;
+    sess->unwatch = 1;
+    sess->unwatch_next = loop->unwatch_head;
+    loop->unwatch_head = sess;
+    return;
+  }
+  sqe->opcode = IORING_OP_POLL_REMOVE;
+  sqe->addr = (uint64_t)(uintptr_t)ptr | TFTPD_UD_POLL;
+  sqe->user_data = TFTPD_UD_NONE;
+}
+
+static void wait_unlink(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_session_t **prev = &loop->wait_head;
+  while (*prev != sess) {
+    prev = &(*prev)->wait_next;
+  }
+
+  *prev = sess->wait_next;
+  if (loop->wait_tail == &sess->wait_next) {
+    loop->wait_tail = prev;
+  }
+}
+
+// packets of a window are staged in the sendmmsg batch, or with io_uring in
+// send slots that stay owned by the kernel until their send completes
+static tftp_packet_t *loop_tx_next(tftp_loop_t *loop) {
+  if (!loop->uring) {
+    return tftp_batch_next(&loop->tx_batch);
+  }
+
+  if ((loop->tx_count == TFTP_BATCH_SIZE) || (loop->free_slots == NULL)) {
+    return NULL;
+  }
+
+  return loop->free_slots->packet;
+}
+
+// queue the header in the packet of loop_tx_next and the data of the block,
+// which is sent from where it is
+static void loop_tx_push(tftp_loop_t *loop, const void *data, size_t size) {
+  if (!loop->uring) {
+    tftp_batch_push_ref(&loop->tx_batch, data, size);
+    return;
+  }
+
+  tftp_slot_t *slot = loop->free_slots;
+  loop->free_slots = slot->next;
+  slot->iov[1].iov_base = (void *)data;
+  slot->iov[1].iov_len = size;
+  slot->msg.msg_iovlen = size ? 2 : 1;
+  loop->tx_queue[loop->tx_count++] = slot;
+}
+
+// move the headers of the batch to free slots of the session, so the next
+// batch can reuse the loop's buffers while the kernel still reads these.
+// without enough free slots the batch is copied
+static int loop_tx_pin(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_batch_t *batch = &loop->tx_batch;
+  if ((sess->zc_next - sess->zc_done + (uint32_t)batch->count >
+       TFTPD_ZC_HEADERS)) {
+    return 0;
+  }
+
+  for (int i = 0; i < batch->count; i++) {
+    uint8_t *header = sess->zc_headers[(sess->zc_next + (uint32_t)i) %
+                                       TFTPD_ZC_HEADERS];
+    memcpy(header, batch->iovs[i][0].iov_base, 4);
+    batch->iovs[i][0].iov_base = header;
+  }
+  return MSG_ZEROCOPY;
+}
+
+static int loop_tx_send(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+  if (!loop->uring) {
+    int flags = sess->zerocopy ? loop_tx_pin(loop, sess) : 0;
+    int sent = tftp_batch_send(tftp, &loop->tx_batch, flags);
+    sess->zc_next += (uint32_t)loop->tx_batch.zc_sent;
+    return sent;
+  }
+
+  int count = loop->tx_count;
+  loop->tx_count = 0;
+  for (int i = 0; i < count; i++) {
+    tftp_slot_t *slot = loop->tx_queue[i];
+    struct io_uring_sqe *sqe = tftp_uring_sqe(&loop->ring);
+    if (sqe == NULL) {
+      for (int j = i; j < count; j++) {
+        loop->tx_queue[j]->next = loop->free_slots;
+        loop->free_slots = loop->tx_queue[j];
+      }
+      return i;
+    }
+
+    // the slot points into the mapping, the session stays until it is sent
+    memcpy(&slot->remote, &tftp->remote, sizeof(slot->remote));
+    slot->owner = sess;
+    sess->tx_pending++;
+    if (sess->zerocopy) {
+      sqe->opcode = IORING_OP_SENDMSG_ZC;
+      sqe->ioprio = IORING_SEND_ZC_REPORT_USAGE;
+    } else {
+      sqe->opcode = IORING_OP_SENDMSG;
+    }
+    sqe->fd = tftp->socket;
+    sqe->addr = (uint64_t)(uintptr_t)&slot->msg;
+    sqe->user_data = (uint64_t)(uintptr_t)slot | TFTPD_UD_SEND;
+  }
+
+  return count;
+}
+
+static void session_release(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  if (sess->fd >= 0) {
+    // keep what reached the disk of a failed upload, a later request can
+    // resume it. the part file is tagged with the tsize of the upload, a
+    // later one must announce the same to continue it
+    char tsize[32];
+    int len = snprintf(tsize, sizeof(tsize), "%" PRId64, sess->req.filesize);
+    if ((sess->wb_synced > 0) && (sess->req.filesize > 0) &&
+        (fsetxattr(sess->fd, TFTPD_PART_XATTR, tsize, len, 0) == 0)) {
+      char part_path[sizeof(sess->path) + 8];
+      snprintf(part_path, sizeof(part_path), "%s.part", sess->path);
+      if (ftruncate(sess->fd, sess->wb_synced) < 0) {
+        tftp_log(TFTP_LOG_ERROR, "tftpd: truncate %s failed.\n",
+                 sess->tmp_path);
+      }
+      rename(sess->tmp_path, part_path);
+    } else {
+      unlink(sess->tmp_path);
+    }
+    close(sess->fd);
+  }
+  if (sess->cache) {
+    tftp_cache_close(sess->cache);
+  }
+  free(sess->zc_headers);
+  tftp_pool_put(&loop->ctrl_pool, tftp->tx_packet);
+  tftp_pool_put(&loop->session_pool, sess);
+}
+
+// chunks queued to the writer, io_uring sends and polls point at a closed
+// session, it is released when the last of them completes
+static void session_unref(tftp_loop_t *loop, tftp_session_t *sess) {
+  if (sess->closed && (sess->wb_pending == 0) && (sess->tx_pending == 0) &&
+      !sess->polling && !sess->unwatch) {
+    session_release(loop, sess);
+  }
+}
+
+static void session_close(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  if (sess->mcast) {
+    tftp_log(TFTP_LOG_INFO,
+             "tftpd: multicast %s to %d clients, %" PRId64 " blocks sent\n",
+             sess->path, sess->member_count, sess->total_block);
+  } else if (sess->state == TFTP_STATE_DONE) {
+    tftp_log(TFTP_LOG_INFO,
+             "tftpd: %s %s %" PRId64 " bytes %" PRId64 " blocks\n",
+             sess->req.op == TFTP_PKT_WRQ ? "recv" : "send", sess->path,
+             sess->total_size, sess->total_block);
+  } else {
+    tftp_log(TFTP_LOG_WARN, "tftpd: %s %s failed\n",
+             sess->req.op == TFTP_PKT_WRQ ? "recv" : "send", sess->path);
+  }
+
+  tftp_stats_add(loop->stats, TFTP_STAT_SESSIONS_ACTIVE, -1);
+  if (!sess->mcast && (sess->state != TFTP_STATE_DONE)) {
+    tftp_stats_add(loop->stats, TFTP_STAT_SESSIONS_FAILED, 1);
+  }
+  if (tftp->srtt_us > 0) {
+    tftp_stats_observe(loop->stats, TFTP_HIST_RTT_US, tftp->srtt_us);
+  }
+  tftp_stats_observe(loop->stats, TFTP_HIST_DURATION_MS,
+                     now_ms() - sess->start_ms);
+
+  if (sess->mcast) {
+    tftp_session_t **prev = &loop->mcast_list;
+    while (*prev != sess) {
+      prev = &(*prev)->mcast_next;
+    }
+    *prev = sess->mcast_next;
+
+    pthread_mutex_lock(&mcast_lock);
+    mcast_used[sess->group_idx] = 0;
+    pthread_mutex_unlock(&mcast_lock);
+    free(sess->members);
+  }
+
+  if (sess->admitted) {
+    admit_put();
+    sess->admitted = 0;
+  }
+  if (sess->sender) {
+    __atomic_sub_fetch(&server_senders, 1, __ATOMIC_RELAXED);
+    sess->sender = 0;
+  }
+  if (sess->rate) {
+    tftp_rate_release(&client_rates, sess->rate);
+    sess->rate = NULL;
+  }
+
+  timer_del(loop, sess);
+  if (sess->in_table) {
+    table_del(loop, sess);
+  }
+  if (loop->uring && sess->wait_out) {
+    wait_unlink(loop, sess);
+  }
+  if (tftp->socket >= 0) {
+    loop_unwatch(loop, tftp->socket, sess);
+    close(tftp->socket);
+  }
+  if (sess->chunk) {
+    tftp_writer_release(&loop->writer, sess->chunk);
+    sess->chunk = NULL;
+  }
+
+  sess->closed = 1;
+  session_unref(loop, sess);
+}
+
+static int session_wait_out(tftp_loop_t *loop, tftp_session_t *sess,
+                            int wait_out) {
+  if (sess->wait_out == wait_out) {
+    return 0;
+  }
+
+  if (loop->uring) {
+    // out of send slots, resumed in turn as sends complete
+    if (wait_out) {
+      sess->wait_next = NULL;
+      *loop->wait_tail = sess;
+      loop->wait_tail = &sess->wait_next;
+    } else {
+      wait_unlink(loop, sess);
+    }
+    sess->wait_out = wait_out;
+    return 0;
+  }
+
+  struct epoll_event ev;
+  ev.events = wait_out ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+  ev.data.ptr = sess;
+  if (epoll_ctl(loop->epfd, EPOLL_CTL_MOD, sess->req.tftp.socket, &ev) < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: modify session events failed.\n");
+    return -1;
+  }
+
+  sess->wait_out = wait_out;
+  return 0;
+}
+
+// blocks of the next batch the rate limits let out now, 0 when the session
+// has to wait for delay_us first
+static int session_grant(tftp_session_t *sess, int blocks, int64_t *delay_us) {
+  int64_t unit = (int64_t)TFTP_PKT_SIZE(sess->req.tftp.block_size);
+  int64_t size = blocks * unit;
+  if (sess->rate) {
+    size = tftp_rate_take(sess->rate, size, unit, sess->rate->burst, delay_us);
+    if (size == 0) {
+      return 0;
+    }
+  }
+
+  // every session sending earns a share of the aggregate at its rate
+  // divided by the senders and only sends on it, so one that asks more
+  // often cannot take the share of the others. while the aggregate bucket
+  // fills up anyway the senders leave rate unused, and a session out of
+  // share may send on the spare
+  if (server_rate.rate > 0) {
+    int senders = __atomic_load_n(&server_senders, __ATOMIC_RELAXED);
+    if (senders < 1) {
+      senders = 1;
+    }
+    int64_t share_rate = server_rate.rate / senders;
+    int64_t share_burst = server_rate.burst / senders;
+    if (share_burst < unit) {
+      share_burst = unit;
+    }
+    int64_t now = tftp_now_us();
+    sess->share_tokens += (now - sess->share_us) * share_rate / 1000000;
+    sess->share_us = now;
+    if (sess->share_tokens > share_burst) {
+      sess->share_tokens = share_burst;
+    }
+
+    int64_t granted = 0;
+    sess->shared = sess->share_tokens >= unit;
+    if (sess->shared || tftp_rate_spare(&server_rate)) {
+      int64_t quantum = sess->shared ? sess->share_tokens : share_burst;
+      granted = tftp_rate_take(&server_rate, size, unit, quantum, delay_us);
+    } else {
+      *delay_us = (unit - sess->share_tokens) * 1000000 / share_rate + 1;
+    }
+    if (sess->shared) {
+      sess->share_tokens -= granted;
+    }
+    if (sess->rate && (granted < size)) {
+      tftp_rate_put(sess->rate, size - granted);
+    }
+    size = granted;
+  }
+
+  return (int)(size / unit);
+}
+
+static void session_ungrant(tftp_session_t *sess, int blocks) {
+  int64_t size = blocks * (int64_t)TFTP_PKT_SIZE(sess->req.tftp.block_size);
+  if (sess->rate) {
+    tftp_rate_put(sess->rate, size);
+  }
+  if (server_rate.rate > 0) {
+    tftp_rate_put(&server_rate, size);
+    if (sess->shared) {
+      sess->share_tokens += size;
+    }
+  }
+}
+
+// the mapping lost the pages of the window, the file was truncated while
+// sent. the client gets an error instead of waiting for the data
+static void session_changed(tftp_session_t *sess) {
+  tftp_log(TFTP_LOG_WARN, "tftpd: %s changed while sent\n", sess->path);
+  tftp_send_error_msg(&sess->req.tftp, TFTP_ERR_OK, TFTPD_CHANGED_MSG);
+}
+
+// send the rest of the current window in batches, stop early when the socket
+// (or the io_uring send slots) is full and continue once there is room
+static int session_send_window(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  // keep the next windows in flight from the disk while this one is sent
+  off_t win_end =
+      sess->base_offset + (off_t)tftp->window_size * tftp->block_size;
+  if (win_end + TFTP_CACHE_READAHEAD / 2 > sess->ra_offset) {
+    off_t start = sess->ra_offset > sess->base_offset ? sess->ra_offset
+                                                       : sess->base_offset;
+    sess->ra_offset = win_end + TFTP_CACHE_READAHEAD;
+    tftp_cache_prefetch(sess->cache, start, sess->ra_offset - start);
+  }
+
+  int limited = sess->rate || (server_rate.rate > 0);
+  sess->throttled = 0;
+  while (!sess->win_last && (sess->win_sent < tftp->window_size)) {
+    int granted = TFTP_BATCH_SIZE;
+    if (limited) {
+      int64_t delay_us = 0;
+      int blocks = tftp->window_size - sess->win_sent;
+      granted = session_grant(
+          sess, blocks < TFTP_BATCH_SIZE ? blocks : TFTP_BATCH_SIZE, &delay_us);
+      if (granted == 0) {
+        // out of tokens, the timer resumes the window
+        sess->throttled = 1;
+        if (timer_set(loop, sess, (delay_us + 999) / 1000) < 0) {
+          return -1;
+        }
+        return session_wait_out(loop, sess, 0);
+      }
+    }
+
+    int queued = 0;
+    size_t block_size = (size_t)tftp->block_size;
+    size_t size = block_size;
+    while ((sess->win_sent + queued < tftp->window_size) &&
+           (queued < granted) && (size == block_size)) {
+      tftp_packet_t *pkt = loop_tx_next(loop);
+      if (pkt == NULL) {
+        break;
+      }
+
+      int block = sess->win_sent + queued;
+      off_t offset = sess->base_offset + (off_t)block * (off_t)block_size;
+      const uint8_t *data = NULL;
+      size = 0;
+      if (offset < sess->cache->size) {
+        size = sess->cache->size - offset;
+        if (size > block_size) {
+          size = block_size;
+        }
+        data = sess->cache->data + offset;
+      }
+
+      pkt->opcode = htons(TFTP_PKT_DATA);
+      pkt->data.block = htons(sess->base_blk + block);
+      loop_tx_push(loop, data, size);
+      queued++;
+    }
+
+    int sent = loop_tx_send(loop, sess);
+    if (sent < 0) {
+      if (errno == EFAULT) {
+        session_changed(sess);
+      }
+      tftp_log(TFTP_LOG_ERROR, "tftp: send data block failed.\n");
+      return -1;
+    }
+    if (limited && (sent < granted)) {
+      session_ungrant(sess, granted - sent);
+    }
+    tftp->tx_time_us = tftp_now_us();
+
+    sess->win_sent += sent;
+    if (sess->mcast) {
+      sess->total_block += sent;
+    }
+    tftp_stats_add(loop->stats, TFTP_STAT_BLOCKS_SENT, sent);
+    int64_t bytes = (int64_t)sent * (int64_t)block_size;
+    if ((sent == queued) && (size < block_size)) {
+      bytes -= (int64_t)(block_size - size);
+    }
+    tftp_stats_add(loop->stats, TFTP_STAT_BYTES_SENT, bytes);
+
+    if ((sent < queued) || (queued == 0)) {
+      return session_wait_out(loop, sess, 1);
+    }
+
+    if (size < block_size) {
+      sess->win_last = 1;
+      sess->last_size = size;
+    }
+  }
+
+  return session_wait_out(loop, sess, 0);
+}
+
+static int session_rewind(tftp_loop_t *loop, tftp_session_t *sess) {
+  sess->win_sent = 0;
+  sess->win_last = 0;
+  return session_send_window(loop, sess);
+}
+
+static int mcast_member(tftp_session_t *sess, const struct sockaddr *remote) {
+  const struct sockaddr_in *addr = (const struct sockaddr_in *)remote;
+
+  for (int i = 0; i < sess->member_count; i++) {
+    struct sockaddr_in *member = (struct sockaddr_in *)&sess->members[i].remote;
+    if ((member->sin_addr.s_addr == addr->sin_addr.s_addr) &&
+        (member->sin_port == addr->sin_port)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+// the oack goes to one member only, everything else to the group
+static int mcast_send_oack(tftp_session_t *sess, int member, int master) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  char addr[INET_ADDRSTRLEN];
+  char option[40];
+  inet_ntop(AF_INET, &sess->group.sin_addr, addr, sizeof(addr));
+  snprintf(option, sizeof(option), "%s,%d,%d", addr,
+           ntohs(sess->group.sin_port), master);
+
+  tftp->mcast_option = option;
+  memcpy(&tftp->remote, &sess->members[member].remote, sizeof(tftp->remote));
+  int err = tftp_send_oack(tftp);
+  memcpy(&tftp->remote, &sess->group, sizeof(sess->group));
+  tftp->mcast_option = NULL;
+
+  if (err < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: send multicast oack failed.\n");
+    return -1;
+  }
+  return 0;
+}
+
+// hand the transfer to the next member that has not got the whole file,
+// the session ends when there is none left
+static int mcast_elect(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  sess->master = -1;
+  for (int i = 0; i < sess->member_count; i++) {
+    if (!sess->members[i].done) {
+      sess->master = i;
+      break;
+    }
+  }
+
+  if (sess->master < 0) {
+    sess->state = TFTP_STATE_DONE;
+    return 0;
+  }
+
+  sess->state = TFTP_STATE_OACK;
+  tftp->tmo_retry = TFTP_MAX_RETRY;
+  session_arm(loop, sess);
+  return mcast_send_oack(sess, sess->master, 1);
+}
+
+static int mcast_join(tftp_loop_t *loop, tftp_session_t *sess,
+                      const struct sockaddr *remote) {
+  int member = mcast_member(sess, remote);
+  if (member >= 0) {
+    // a retransmitted request, the member missed its oack
+    return mcast_send_oack(sess, member, member == sess->master);
+  }
+
+  tftp_member_t *members = (tftp_member_t *)realloc(
+      sess->members, (sess->member_count + 1) * sizeof(tftp_member_t));
+  if (members == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: alloc multicast member failed.\n");
+    return -1;
+  }
+
+  sess->members = members;
+  member = sess->member_count++;
+  memcpy(&members[member].remote, remote, sizeof(struct sockaddr));
+  members[member].done = 0;
+
+  if (sess->master < 0) {
+    return mcast_elect(loop, sess);
+  }
+  return mcast_send_oack(sess, member, 0);
+}
+
+static int mcast_start(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  // the master's acks must name blocks without ambiguity, so the file has
+  // to fit in the block number space. otherwise serve it by unicast
+  int64_t blocks = tftp->file_size / tftp->block_size + 1;
+  if (blocks > 0xffff) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&mcast_lock);
+  int idx = 0;
+  while ((idx < TFTPD_MCAST_GROUPS) && mcast_used[idx]) {
+    idx++;
+  }
+  if (idx < TFTPD_MCAST_GROUPS) {
+    mcast_used[idx] = 1;
+  }
+  pthread_mutex_unlock(&mcast_lock);
+  if (idx == TFTPD_MCAST_GROUPS) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: no free multicast group for %s\n",
+             sess->path);
+    return 0;
+  }
+
+  sess->mcast = 1;
+  sess->group_idx = idx;
+  sess->group.sin_family = AF_INET;
+  sess->group.sin_addr.s_addr = htonl(ntohl(mcast_base.s_addr) + idx);
+  sess->group.sin_port = htons(mcast_port);
+  sess->last_blk = (uint16_t)blocks;
+  sess->master = -1;
+  sess->mcast_next = loop->mcast_list;
+  loop->mcast_list = sess;
+
+  // the group transfer goes lock-step with the master as in rfc 2090, and
+  // members that did not ask for the timeout or offset option must not
+  // see it
+  tftp->window_size = TFTP_DEF_WINSIZE;
+  tftp_rtt_reset(tftp, TFTP_TMO_SEC, 0);
+  tftp->offset_option = 0;
+  tftp->offset = 0;
+  sess->base_offset = 0;
+
+  char addr[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &sess->group.sin_addr, addr, sizeof(addr));
+  tftp_log(TFTP_LOG_INFO, "tftpd: multicast file %s to %s...\n", sess->path,
+           addr);
+  return mcast_join(loop, sess, &tftp->remote) < 0 ? -1 : 1;
+}
+
+static int mcast_on_packet(tftp_loop_t *loop, tftp_session_t *sess,
+                           tftp_packet_t *pkt, const struct sockaddr *from) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  int member = mcast_member(sess, from);
+  if (member < 0) {
+    return 0;
+  }
+
+  uint16_t opcode = ntohs(pkt->opcode);
+  if (opcode == TFTP_PKT_ERROR) {
+    sess->members[member].done = 1;
+    return member == sess->master ? mcast_elect(loop, sess) : 0;
+  } else if (opcode != TFTP_PKT_ACK) {
+    return 0;
+  }
+
+  uint16_t block = ntohs(pkt->ack.block);
+  if (block == sess->last_blk) {
+    sess->members[member].done = 1;
+    return member == sess->master ? mcast_elect(loop, sess) : 0;
+  } else if ((member != sess->master) || (block > sess->last_blk)) {
+    return 0;
+  }
+
+  // the master has every block up to the acked one, go on from there
+  if (!tftp->tx_resent) {
+    tftp_rtt_update(tftp, tftp_now_us() - tftp->tx_time_us);
+  }
+
+  sess->state = TFTP_STATE_SEND;
+  sess->base_blk = block + 1;
+  sess->base_offset = (off_t)block * tftp->block_size;
+  tftp->tmo_retry = TFTP_MAX_RETRY;
+  tftp->tx_resent = 0;
+  session_arm(loop, sess);
+  return session_rewind(loop, sess);
+}
+
+static int mcast_on_timer(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  tftp_stats_add(loop->stats, TFTP_STAT_TIMEOUTS, 1);
+  if (--tftp->tmo_retry == 0) {
+    tftp_log(TFTP_LOG_WARN, "tftpd: multicast master of %s lost\n", sess->path);
+    sess->members[sess->master].done = 1;
+    return mcast_elect(loop, sess);
+  }
+
+  tftp_rtt_backoff(tftp);
+  tftp_stats_add(loop->stats, TFTP_STAT_RETRANSMITS, 1);
+  session_arm(loop, sess);
+  if (sess->state == TFTP_STATE_OACK) {
+    int err = mcast_send_oack(sess, sess->master, 1);
+    tftp->tx_resent = 1;
+    return err;
+  }
+
+  tftp->tx_resent = 1;
+  return session_rewind(loop, sess);
+}
+
+static int session_on_ack(tftp_loop_t *loop, tftp_session_t *sess,
+                          uint16_t block) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  if (sess->state == TFTP_STATE_OACK) {
+    if (block != 0) {
+      return 0;
+    }
+
+    if (!tftp->tx_resent) {
+      tftp_rtt_update(tftp, tftp_now_us() - tftp->tx_time_us);
+    }
+
+    sess->state = TFTP_STATE_SEND;
+    tftp->tmo_retry = TFTP_MAX_RETRY;
+    tftp->tx_resent = 0;
+    session_arm(loop, sess);
+    return session_send_window(loop, sess);
+  }
+
+  // number of blocks of this window covered by the ack, an ack of the
+  // block before the window asks for a rewind. once the window has been
+  // rewound, more acks of that block are stale duplicates
+  uint16_t diff = block - (uint16_t)(sess->base_blk - 1);
+  if ((diff > sess->win_sent) || ((diff == 0) && sess->rewound)) {
+    return 0;
+  }
+
+  if (diff == 0) {
+    sess->rewound = 1;
+    tftp->tx_resent = 1;
+    tftp_stats_add(loop->stats, TFTP_STAT_RETRANSMITS, 1);
+    return session_rewind(loop, sess);
+  }
+
+  // karn: acks of a retransmitted window give no rtt sample
+  if (!tftp->tx_resent) {
+    tftp_rtt_update(tftp, tftp_now_us() - tftp->tx_time_us);
+  }
+
+  int done = sess->win_last && (diff == sess->win_sent);
+  sess->base_blk += diff;
+  sess->base_offset += (off_t)diff * tftp->block_size;
+  sess->total_size += (int64_t)diff * tftp->block_size;
+  sess->total_block += diff;
+  sess->rewound = 0;
+  tftp->tmo_retry = TFTP_MAX_RETRY;
+
+  if (done) {
+    sess->total_size -= tftp->block_size - (int)sess->last_size;
+    sess->state = TFTP_STATE_DONE;
+    return 0;
+  }
+
+  tftp->tx_resent = 0;
+  session_arm(loop, sess);
+  return session_rewind(loop, sess);
+}
+
+static void session_flush(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_chunk_t *chunk = sess->chunk;
+  sess->chunk = NULL;
+  if (chunk == NULL) {
+    return;
+  }
+
+  if (chunk->size == 0) {
+    tftp_writer_release(&loop->writer, chunk);
+    return;
+  }
+
+  if (sess->wb_last) {
+    sess->wb_last->owner_next = chunk;
+  } else {
+    sess->wb_head = chunk;
+  }
+  sess->wb_last = chunk;
+  tftp_writer_submit(&loop->writer, chunk);
+  sess->wb_pending++;
+}
+
+static int session_write(tftp_loop_t *loop, tftp_session_t *sess,
+                         const uint8_t *data, size_t size) {
+  while (size) {
+    if (sess->chunk == NULL) {
+      sess->chunk =
+          tftp_writer_chunk(&loop->writer, sess, sess->fd, sess->wb_offset);
+      if (sess->chunk == NULL) {
+        return -1;
+      }
+    }
+
+    tftp_chunk_t *chunk = sess->chunk;
+    size_t count = chunk->capacity - chunk->size;
+    if (count > size) {
+      count = size;
+    }
+    memcpy(chunk->data + chunk->size, data, count);
+    chunk->size += count;
+    sess->wb_offset += (off_t)count;
+    data += count;
+    size -= count;
+
+    if (chunk->size == chunk->capacity) {
+      session_flush(loop, sess);
+    }
+  }
+
+  return 0;
+}
+
+// the whole upload is on disk, move it in place and send the final ack
+static int session_finish(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  // drop blocks preallocated past the data the client actually sent
+  int fd = sess->fd;
+  sess->fd = -1;
+  int err = ftruncate(fd, sess->wb_offset);
+  if ((close(fd) != 0) || (err < 0) ||
+      (rename(sess->tmp_path, sess->path) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: save file %s failed.\n", sess->path);
+    unlink(sess->tmp_path);
+    tftp_send_error(tftp, TFTP_ERR_DISK_FULL);
+    return -1;
+  }
+
+  sess->state = TFTP_STATE_LINGER;
+  if (tftp_send_ack(tftp, sess->base_blk - 1) < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: send ack failed.\n");
+    return -1;
+  }
+
+  return timer_set(loop, sess, TFTPD_LINGER_SEC * 1000);
+}
+
+static int session_on_write(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  if (sess->wb_err) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: write file %s failed: %s\n", sess->path,
+             strerror(sess->wb_err));
+    tftp_send_error(tftp, TFTP_ERR_DISK_FULL);
+    return -1;
+  }
+
+  if (sess->state == TFTP_STATE_FLUSH) {
+    return sess->wb_pending ? 0 : session_finish(loop, sess);
+  }
+
+  if (sess->wb_held && (sess->wb_pending < TFTP_WRITER_DEPTH)) {
+    sess->wb_held = 0;
+    if (tftp_send_ack(tftp, sess->base_blk - 1) < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: send ack failed.\n");
+      return -1;
+    }
+    return session_arm(loop, sess);
+  }
+
+  return 0;
+}
+
+static int session_on_data(tftp_loop_t *loop, tftp_session_t *sess,
+                           tftp_packet_t *pkt, size_t block_size) {
+  uint16_t block = ntohs(pkt->data.block);
+  tftp_t *tftp = &sess->req.tftp;
+
+  // more than the blksize agreed on would be written out and could never
+  // end the transfer
+  if (block_size > (size_t)tftp->block_size) {
+    tftp_log(TFTP_LOG_WARN, "tftpd: block of %zu bytes for %s too large\n",
+             block_size, sess->path);
+    tftp_send_error(tftp, TFTP_ERR_OP);
+    return -1;
+  }
+
+  if (sess->state == TFTP_STATE_LINGER) {
+    // the final ack got lost and the sender retransmitted the last block
+    if (block == (uint16_t)(sess->base_blk - 1)) {
+      tftp_stats_add(loop->stats, TFTP_STAT_RETRANSMITS, 1);
+      tftp_resend(tftp);
+    }
+    return 0;
+  }
+
+  if ((sess->state == TFTP_STATE_FLUSH) || sess->wb_held) {
+    // the ack waits for the writer, retransmissions are answered by it
+    return 0;
+  }
+
+  if (block != sess->base_blk) {
+    // a block of the window is lost, ack the last in-order block once so
+    // the sender rewinds to it
+    if (!sess->gap_acked) {
+      tftp_send_ack(tftp, sess->base_blk - 1);
+      sess->gap_acked = 1;
+      sess->win_count = 0;
+    }
+    return 0;
+  }
+
+  // the first block after our ack samples the rtt, once per ack
+  if ((sess->win_count == 0) && !tftp->tx_resent) {
+    tftp_rtt_update(tftp, tftp_now_us() - tftp->tx_time_us);
+    tftp->tx_resent = 1;
+  }
+
+  tftp->tmo_retry = TFTP_MAX_RETRY;
+  sess->gap_acked = 0;
+
+  if (session_write(loop, sess, pkt->data.data, block_size) < 0) {
+    tftp_send_error(tftp, TFTP_ERR_DISK_FULL);
+    return -1;
+  }
+
+  sess->total_size += block_size;
+  sess->total_block++;
+  sess->base_blk++;
+  tftp_stats_add(loop->stats, TFTP_STAT_BLOCKS_RECV, 1);
+  tftp_stats_add(loop->stats, TFTP_STAT_BYTES_RECV, block_size);
+
+  if (block_size < (size_t)tftp->block_size) {
+    // the final ack waits until the file is on disk, a write error can
+    // still be reported to the sender
+    session_flush(loop, sess);
+    sess->state = TFTP_STATE_FLUSH;
+    timer_del(loop, sess);
+    return session_on_write(loop, sess);
+  }
+
+  if (++sess->win_count >= tftp->window_size) {
+    sess->win_count = 0;
+    if (sess->wb_pending >= TFTP_WRITER_DEPTH) {
+      // the disk is behind, hold the ack until a chunk completes
+      sess->wb_held = 1;
+      timer_del(loop, sess);
+      return 0;
+    }
+    if (tftp_send_ack(tftp, sess->base_blk - 1) < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: send ack failed.\n");
+      return -1;
+    }
+  }
+
+  return session_arm(loop, sess);
+}
+
+static int session_on_packet(tftp_loop_t *loop, tftp_session_t *sess,
+                             tftp_packet_t *pkt, size_t pkt_size,
+                             const struct sockaddr *from) {
+  if (pkt_size < 4) {
+    return 0;
+  }
+
+  if (sess->mcast) {
+    return mcast_on_packet(loop, sess, pkt, from);
+  }
+
+  switch (ntohs(pkt->opcode)) {
+    case TFTP_PKT_ACK: {
+      if (sess->req.op != TFTP_PKT_RRQ) {
+        return 0;
+      }
+      return session_on_ack(loop, sess, ntohs(pkt->ack.block));
+    }
+    case TFTP_PKT_DATA: {
+      if (sess->req.op != TFTP_PKT_WRQ) {
+        return 0;
+      }
+      return session_on_data(loop, sess, pkt, pkt_size - 4);
+    }
+    case TFTP_PKT_ERROR: {
+      tftp_log(TFTP_LOG_WARN, "tftpd: recv error = %d\n", ntohs(pkt->err.code));
+      return -1;
+    }
+    default: {
+      return 0;
+    }
+  }
+}
+
+static int session_on_timer(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_t *tftp = &sess->req.tftp;
+
+  if (sess->throttled) {
+    // tokens again, go on with the window and wait for its ack
+    session_arm(loop, sess);
+    return session_send_window(loop, sess);
+  }
+
+  if (sess->mcast) {
+    return mcast_on_timer(loop, sess);
+  }
+
+  if (sess->state == TFTP_STATE_LINGER) {
+    sess->state = TFTP_STATE_DONE;
+    return 0;
+  }
+
+  if ((sess->state == TFTP_STATE_RECV) && sess->win_count) {
+    // blocks came in since the last ack but the end of the window did not.
+    // acking them is news to the sender, not a retransmission, so the rto
+    // stays
+    sess->win_count = 0;
+    if (tftp_send_ack(tftp, sess->base_blk - 1) < 0) {
+      return -1;
+    }
+    return session_arm(loop, sess);
+  }
+
+  tftp_stats_add(loop->stats, TFTP_STAT_TIMEOUTS, 1);
+  if (--tftp->tmo_retry == 0) {
+    tftp_log(TFTP_LOG_WARN, "tftpd: wait %s tmo\n",
+             sess->state == TFTP_STATE_RECV ? "data" : "ack");
+    return -1;
+  }
+
+  tftp_rtt_backoff(tftp);
+  tftp_stats_add(loop->stats, TFTP_STAT_RETRANSMITS, 1);
+  session_arm(loop, sess);
+  sess->rewound = 0;
+  if (sess->state == TFTP_STATE_SEND) {
+    tftp->tx_resent = 1;
+    return session_rewind(loop, sess);
+  }
+
+  // the oack again until the first block arrives, then an ack of the last
+  // block in order, the sender restarts its window after it
+  sess->win_count = 0;
+  if (sess->req.option && (sess->total_block == 0)) {
+    return tftp_resend(tftp) < 0 ? -1 : 0;
+  }
+  if (tftp_send_ack(tftp, sess->base_blk - 1) < 0) {
+    return -1;
+  }
+  tftp->tx_resent = 1;
+  return 0;
+}
+
+// the sends of zerocopy ids lo to hi are done, their header slots are free
+// once every earlier one is
+static void session_zc_done(tftp_session_t *sess, uint32_t lo, uint32_t hi) {
+  for (uint32_t id = lo; id - lo <= hi - lo; id++) {
+    if (id - sess->zc_done < sess->zc_next - sess->zc_done) {
+      uint32_t slot = id % TFTPD_ZC_HEADERS;
+      sess->zc_bits[slot / 64] |= 1ULL << (slot % 64);
+    }
+  }
+
+  while (sess->zc_done != sess->zc_next) {
+    uint32_t slot = sess->zc_done % TFTPD_ZC_HEADERS;
+    if (!(sess->zc_bits[slot / 64] & (1ULL << (slot % 64)))) {
+      break;
+    }
+    sess->zc_bits[slot / 64] &= ~(1ULL << (slot % 64));
+    sess->zc_done++;
+  }
+}
+
+// reap the zerocopy notifications of the socket. once the kernel reports it
+// copied the pages anyway (loopback, no scatter-gather) a plain send is
+// cheaper
+static void session_on_errqueue(tftp_session_t *sess) {
+  char control[128];
+
+  while (1) {
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    if (recvmsg(sess->req.tftp.socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      break;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+      if ((cmsg->cmsg_level != SOL_IP) || (cmsg->cmsg_type != IP_RECVERR)) {
+        continue;
+      }
+
+      struct sock_extended_err *serr =
+          (struct sock_extended_err *)CMSG_DATA(cmsg);
+      if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      session_zc_done(sess, serr->ee_info, serr->ee_data);
+      if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        sess->zerocopy = 0;
+      }
+    }
+  }
+}
+
+static void session_path(tftp_session_t *sess) {
+  if (server_path) {
+    snprintf(sess->path, sizeof(sess->path), "%s/%s", server_path,
+             sess->req.filename);
+  } else {
+    snprintf(sess->path, sizeof(sess->path), "%s", sess->req.filename);
+  }
+}
+
+// the part file at tmp_path when it was left by an upload of the same
+// tsize and no other session is resuming it. the lock holds until the fd
+// is closed
+static int part_open(tftp_session_t *sess, struct stat *st) {
+  int fd = open(sess->tmp_path, O_WRONLY);
+  if (fd < 0) {
+    return -1;
+  }
+
+  char tsize[32];
+  ssize_t len = -1;
+  if (flock(fd, LOCK_EX | LOCK_NB) == 0) {
+    len = fgetxattr(fd, TFTPD_PART_XATTR, tsize, sizeof(tsize) - 1);
+  }
+  if ((len > 0) && (fstat(fd, st) == 0)) {
+    tsize[len] = '\0';
+    if ((strtoll(tsize, NULL, 10) == sess->req.filesize) &&
+        (st->st_size <= sess->req.filesize)) {
+      return fd;
+    }
+  }
+
+  tftp_log(TFTP_LOG_INFO, "tftpd: part file of %s not resumed\n",
+           sess->path);
+  close(fd);
+  return -1;
+}
+
+static int session_start(tftp_loop_t *loop, tftp_session_t *sess) {
+  tftp_req_t *req = &sess->req;
+  tftp_t *tftp = &req->tftp;
+
+  session_path(sess);
+
+  if ((req->op == TFTP_PKT_WRQ) && (req->offset > 0) && (req->filesize > 0)) {
+    // resume the part file a failed upload of the same file left behind,
+    // as far as both sides have the data, else start over
+    snprintf(sess->tmp_path, sizeof(sess->tmp_path), "%s.part", sess->path);
+    struct stat st;
+    int fd = part_open(sess, &st);
+    if (fd >= 0) {
+      tftp->offset = st.st_size < req->offset ? st.st_size : req->offset;
+      if (ftruncate(fd, tftp->offset) == 0) {
+        sess->fd = fd;
+      } else {
+        close(fd);
+      }
+    }
+    if (sess->fd < 0) {
+      tftp->offset = 0;
+    }
+  }
+
+  if ((req->op == TFTP_PKT_WRQ) && (sess->fd < 0)) {
+    // upload into a temporary file and rename it when complete, so senders
+    // still mapping the old file never see it truncated
+    snprintf(sess->tmp_path, sizeof(sess->tmp_path), "%s.XXXXXX", sess->path);
+    sess->fd = mkstemp(sess->tmp_path);
+    if (sess->fd < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: create file %s failed\n", sess->path);
+      tftp_send_error(tftp, TFTP_ERR_ACC_VIO);
+      return -1;
+    }
+    fchmod(sess->fd, 0666 & ~server_umask);
+  }
+
+  if (req->op == TFTP_PKT_WRQ) {
+    // reserve the announced size up front, a full disk fails the request
+    // before any data is sent
+    sess->wb_offset = tftp->offset;
+    sess->wb_synced = tftp->offset;
+    if ((req->filesize > tftp->offset) &&
+        (fallocate(sess->fd, FALLOC_FL_KEEP_SIZE, tftp->offset,
+                   req->filesize - tftp->offset) < 0) &&
+        ((errno == ENOSPC) || (errno == EFBIG))) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: no space for %s\n", sess->path);
+      tftp_send_error(tftp, TFTP_ERR_DISK_FULL);
+      return -1;
+    }
+  } else if (req->op == TFTP_PKT_RRQ) {
+    sess->cache = tftp_cache_open(sess->path);
+    if (sess->cache == NULL) {
+      tftp_log(TFTP_LOG_WARN, "tftpd: file %s does not exist\n", sess->path);
+      tftp_send_error(tftp, TFTP_ERR_NO_FILE);
+      return -1;
+    }
+  }
+
+  sess->base_blk = 1;
+  tftp->tmo_retry = TFTP_MAX_RETRY;
+  tftp_rtt_reset(tftp, req->timeout ? req->timeout : TFTP_TMO_SEC,
+                 req->timeout != 0);
+  tftp->file_size = req->filesize;
+  tftp->block_size = req->blksize;
+  tftp->window_size = req->winsize;
+  tftp->offset_option = req->offset >= 0;
+
+  if (session_arm(loop, sess) < 0) {
+    return -1;
+  }
+
+  if (req->op == TFTP_PKT_WRQ) {
+    tftp_log(TFTP_LOG_INFO, "tftpd: recv file %s...\n", sess->path);
+
+    sess->state = TFTP_STATE_RECV;
+    int err = req->option ? tftp_send_oack(tftp) : tftp_send_ack(tftp, 0);
+    if (err < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: send ack failed.\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  tftp->file_size = sess->cache->size;
+  if (tftp->offset_option) {
+    tftp->offset = req->offset < tftp->file_size ? req->offset : tftp->file_size;
+    sess->base_offset = tftp->offset;
+  }
+
+  // big blocks leave from the mapped pages without a copy, the io_uring
+  // engine needs no socket option for it
+  if (tftp->block_size >= TFTPD_ZEROCOPY_MIN) {
+    int on = 1;
+    sess->zerocopy = loop->uring || (setsockopt(tftp->socket, SOL_SOCKET,
+                                                SO_ZEROCOPY, &on,
+                                                sizeof(on)) == 0);
+    if (sess->zerocopy && !loop->uring) {
+      sess->zc_headers =
+          (uint8_t(*)[4])malloc(TFTPD_ZC_HEADERS * sizeof(*sess->zc_headers));
+      sess->zerocopy = sess->zc_headers != NULL;
+    }
+  }
+
+  sess->sender = 1;
+  sess->share_us = tftp_now_us();
+  __atomic_add_fetch(&server_senders, 1, __ATOMIC_RELAXED);
+  if (client_rates.rate > 0) {
+    struct sockaddr_in *addr = (struct sockaddr_in *)&tftp->remote;
+    sess->rate = tftp_rate_get(&client_rates, addr->sin_addr.s_addr);
+  }
+
+  if (req->mcast && mcast_port) {
+    int err = mcast_start(loop, sess);
+    if (err != 0) {
+      return err < 0 ? -1 : 0;
+    }
+  }
+
+  tftp_log(TFTP_LOG_INFO, "tftpd: sending file %s...\n", sess->path);
+
+  if (req->option) {
+    sess->state = TFTP_STATE_OACK;
+    if (tftp_send_oack(tftp) < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: send oack failed.\n");
+      return -1;
+    }
+    return 0;
+  }
+
+  sess->state = TFTP_STATE_SEND;
+  return session_send_window(loop, sess);
+}
+
+static int parse_req(tftp_t *tftp, tftp_packet_t *pkt, size_t pkt_size,
+                     tftp_req_t *req) {
+  req->op = ntohs(pkt->opcode);
+  req->option = 0;
+  req->blksize = TFTP_DEF_BLKSIZE;
+  req->winsize = TFTP_DEF_WINSIZE;
+  req->timeout = 0;
+  req->mcast = 0;
+  req->offset = -1;
+  req->filesize = 0;
+  memset(req->filename, 0, sizeof(req->filename));
+  memcpy(&req->tftp.remote, &tftp->remote, sizeof(tftp->remote));
+
+  struct sockaddr_in *addr = (struct sockaddr_in *)&tftp->remote;
+  tftp_log(TFTP_LOG_INFO, "tftp: recv req %s from %s %d\n",
+           req->op == TFTP_PKT_RRQ ? "get" : "put", inet_ntoa(addr->sin_addr),
+           ntohs(addr->sin_port));
+
+  char *buf = (char *)pkt->req.args;
+  char *end = (char *)pkt + pkt_size;
+  strncpy(req->filename, buf, sizeof(req->filename));
+  buf += strlen(req->filename) + 1;
+
+  if (strcmp(buf, "octet") != 0) {
+    tftp_send_error(tftp, TFTP_ERR_OP);
+    tftp_log(TFTP_LOG_WARN, "tftp: unknown transfer mode %s\n", buf);
+    return -1;
+  }
+
+  buf += strlen("octet") + 1;
+
+  while ((buf < end) && (*buf)) {
+    req->option = 1;
+    if (strcmp(buf, "blksize") == 0) {
+      buf += strlen("blksize") + 1;
+      int blksize = atoi(buf);
+
+      if (blksize <= 0) {
+        tftp_send_error(tftp, TFTP_ERR_OP);
+        return -1;
+      } else if (blksize < TFTP_MIN_BLKSIZE) {
+        blksize = TFTP_MIN_BLKSIZE;
+      } else if (blksize > server_blksize) {
+        tftp_log(TFTP_LOG_INFO, "blk size %d too long, set to %d\n", blksize,
+                 server_blksize);
+        blksize = server_blksize;
+      }
+
+      req->blksize = blksize;
+      buf += strlen(buf) + 1;
+    } else if (strcmp(buf, "tsize") == 0) {
+      buf += strlen(buf) + 1;
+      req->filesize = strtoll(buf, NULL, 10);
+      buf += strlen(buf) + 1;
+    } else if (strcmp(buf, "windowsize") == 0) {
+      buf += strlen("windowsize") + 1;
+      int winsize = atoi(buf);
+
+      if (winsize <= 0) {
+        tftp_send_error(tftp, TFTP_ERR_OP);
+        return -1;
+      } else if (winsize > TFTP_MAX_WINSIZE) {
+        tftp_log(TFTP_LOG_INFO, "window size %d too large, set to %d\n",
+                 winsize, TFTP_MAX_WINSIZE);
+        winsize = TFTP_MAX_WINSIZE;
+      }
+
+      req->winsize = winsize;
+      buf += strlen(buf) + 1;
+    } else if (strcmp(buf, "timeout") == 0) {
+      buf += strlen("timeout") + 1;
+      int timeout = atoi(buf);
+
+      // an invalid timeout is left out of the oack
+      if ((timeout > 0) && (timeout <= TFTP_MAX_TMO_SEC)) {
+        req->timeout = timeout;
+      }
+      buf += strlen(buf) + 1;
+    } else if (strcmp(buf, "offset") == 0) {
+      buf += strlen("offset") + 1;
+      int64_t offset = strtoll(buf, NULL, 10);
+      if (offset >= 0) {
+        req->offset = offset;
+      }
+      buf += strlen(buf) + 1;
+    } else if (strcmp(buf, "multicast") == 0) {
+      buf += strlen("multicast") + 1;
+      req->mcast = 1;
+      buf += strlen(buf) + 1;
+    } else {
+      buf += strlen(buf) + 1;
+    }
+  }
+
+  return 0;
+}
+
+// a running group of the same, unchanged file this request can join
+static tftp_session_t *mcast_find(tftp_loop_t *loop, tftp_session_t *sess) {
+  session_path(sess);
+
+  tftp_session_t *group = loop->mcast_list;
+  while (group) {
+    if ((strcmp(group->path, sess->path) == 0) &&
+        (group->req.tftp.block_size <= sess->req.blksize) &&
+        (group->state != TFTP_STATE_DONE)) {
+      tftp_file_t *file = tftp_cache_open(sess->path);
+      if (file) {
+        tftp_cache_close(file);
+      }
+      if (file == group->cache) {
+        return group;
+      }
+    }
+    group = group->mcast_next;
+  }
+
+  return NULL;
+}
+
+// refuses a request right away, the client may try again later
+static void send_busy(tftp_loop_t *loop, const struct sockaddr *addr) {
+  tftp_t *tftp = &loop->listener;
+  if (addr != &tftp->remote) {
+    memcpy(&tftp->remote, addr, sizeof(tftp->remote));
+  }
+  tftp_send_error_msg(tftp, TFTP_ERR_OK, TFTPD_BUSY_MSG);
+  tftp_stats_add(loop->stats, TFTP_STAT_BUSY, 1);
+}
+
+// lower goes first: requests from priority_net, then by the size of the
+// file to send or receive, so short transfers do not wait behind images.
+// the size to send is the one the cache knows, the loop does not wait on
+// the disk for a request it cannot serve yet. files not in the cache rank
+// behind those that are
+static int64_t queue_rank(tftp_session_t *sess) {
+  int64_t size = sess->req.filesize;
+  if (sess->req.op == TFTP_PKT_RRQ) {
+    session_path(sess);
+    size = tftp_cache_size(sess->path);
+    if (size < 0) {
+      size = INT64_MAX / 4;
+    }
+  }
+
+  const struct sockaddr_in *addr =
+      (const struct sockaddr_in *)&sess->req.tftp.remote;
+  if (prio_mask && ((addr->sin_addr.s_addr & prio_mask) == prio_addr)) {
+    return size;
+  }
+  return INT64_MAX / 2 + size / 2;
+}
+
+static int queue_before(tftp_session_t *a, tftp_session_t *b) {
+  return (a->rank < b->rank) ||
+         ((a->rank == b->rank) && (a->queue_seq < b->queue_seq));
+}
+
+static void queue_remove(tftp_loop_t *loop, int idx) {
+  memmove(&loop->queue[idx], &loop->queue[idx + 1],
+          (loop->queue_count - idx - 1) * sizeof(tftp_session_t *));
+  loop->queue_count--;
+  tftp_stats_add(loop->stats, TFTP_STAT_QUEUED, -1);
+}
+
+// keeps the queue sorted worst first, the next request to open is the last
+static void queue_push(tftp_loop_t *loop, tftp_session_t *sess) {
+  const struct sockaddr_in *addr =
+      (const struct sockaddr_in *)&sess->req.tftp.remote;
+  for (int i = 0; i < loop->queue_count; i++) {
+    tftp_session_t *queued = loop->queue[i];
+    const struct sockaddr_in *other =
+        (const struct sockaddr_in *)&queued->req.tftp.remote;
+    if ((other->sin_addr.s_addr == addr->sin_addr.s_addr) &&
+        (other->sin_port == addr->sin_port) &&
+        (strcmp(queued->req.filename, sess->req.filename) == 0)) {
+      tftp_stats_add(loop->stats, TFTP_STAT_DUP_REQUESTS, 1);
+      tftp_pool_put(&loop->session_pool, sess);
+      return;
+    }
+  }
+
+  sess->rank = queue_rank(sess);
+  sess->queue_seq = loop->queue_seq++;
+  sess->queued_ms = now_ms();
+
+  if (loop->queue_count == server_queue_size) {
+    tftp_session_t *worst = loop->queue[0];
+    if (!queue_before(sess, worst)) {
+      send_busy(loop, &sess->req.tftp.remote);
+      tftp_pool_put(&loop->session_pool, sess);
+      return;
+    }
+    queue_remove(loop, 0);
+    send_busy(loop, &worst->req.tftp.remote);
+    tftp_pool_put(&loop->session_pool, worst);
+  }
+
+  int idx = loop->queue_count;
+  while ((idx > 0) && queue_before(loop->queue[idx - 1], sess)) {
+    loop->queue[idx] = loop->queue[idx - 1];
+    idx--;
+  }
+  loop->queue[idx] = sess;
+  loop->queue_count++;
+  tftp_stats_add(loop->stats, TFTP_STAT_QUEUED, 1);
+}
+
+static void session_open(tftp_loop_t *loop, tftp_session_t *sess) {
+  int sockfd = -1;
+  sess->req.tftp.buf_size = TFTPD_CTRL_SIZE;
+  sess->req.tftp.tx_packet = (tftp_packet_t *)tftp_pool_get(&loop->ctrl_pool);
+  if (sess->req.tftp.tx_packet == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: alloc session buffer failed.\n");
+    goto open_error;
+  }
+
+  sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+  if (sockfd < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: create working socket failed.\n");
+    goto open_error;
+  }
+  sess->req.tftp.socket = sockfd;
 
-  char path_buf[256];
-  if (server_path) {
-    snprintf(path_buf, sizeof(path_buf), "%s/%s", server_path, req->filename);
-  } else {
-    snprintf(path_buf, sizeof(path_buf), "%s", req->filename);
+  // io_uring sends wait for room in the kernel, so its sockets stay blocking
+  if ((!loop->uring && (set_nonblock(sockfd) < 0)) ||
+      (loop_watch(loop, sockfd, sess) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: add working socket failed.\n");
+    goto open_error;
   }
+  sess->polling = loop->uring;
+  sess->admitted = 1;
 
-  FILE *file = fopen(path_buf, "wb");
-  if (file == NULL) {
-    printf("tftpd: file %s does not exist\n", path_buf);
-    tftp_send_error(tftp, TFTP_ERR_NO_FILE);
-    return -1;
+  sess->start_ms = now_ms();
+  table_add(loop, sess);
+  tftp_stats_add(loop->stats, TFTP_STAT_SESSIONS_ACTIVE, 1);
+  tftp_stats_add(loop->stats, TFTP_STAT_SESSIONS_TOTAL, 1);
+  tftp_stats_add(loop->stats,
+                 sess->req.op == TFTP_PKT_WRQ ? TFTP_STAT_WRQ : TFTP_STAT_RRQ,
+                 1);
+  if (session_start(loop, sess) < 0) {
+    session_close(loop, sess);
   }
+  return;
 
-  printf("tftpd: recv file %s...\n", path_buf);
+open_error:
+  if (sockfd >= 0) {
+    close(sockfd);
+  }
+  if (sess->req.tftp.tx_packet) {
+    tftp_pool_put(&loop->ctrl_pool, sess->req.tftp.tx_packet);
+  }
+  tftp_pool_put(&loop->session_pool, sess);
+  admit_put();
+}
 
-  int err = req->option ? tftp_send_oack(tftp) : tftp_send_ack(tftp, 0);
-  if (err < 0) {
-    printf("tftpd: send ack failed.\n");
-    fclose(file);
-    return -1;
+// opens queued requests while sessions are free, and turns away those that
+// waited so long their client has likely given up
+static void loop_admit(tftp_loop_t *loop) {
+  if (loop->queue_count == 0) {
+    return;
   }
 
-  uint16_t curr_blk = 1;
-  int total_size = 0;
-  int total_block = 0;
-  while (1) {
-    size_t pkt_size;
-    err = tftp_wait_packet(tftp, TFTP_PKT_DATA, curr_blk, &pkt_size);
-    if (err < 0) {
-      printf("tftp: wait data failed.\n");
-      goto recv_failed;
+  int64_t now = now_ms();
+  for (int i = loop->queue_count - 1; i >= 0; i--) {
+    tftp_session_t *sess = loop->queue[i];
+    if (now - sess->queued_ms >= TFTPD_QUEUE_WAIT_MS) {
+      queue_remove(loop, i);
+      send_busy(loop, &sess->req.tftp.remote);
+      tftp_pool_put(&loop->session_pool, sess);
     }
+  }
+
+  while ((loop->queue_count > 0) && admit_take()) {
+    tftp_session_t *sess = loop->queue[loop->queue_count - 1];
+    queue_remove(loop, loop->queue_count - 1);
+    session_open(loop, sess);
+  }
+}
+
+static void accept_req(tftp_loop_t *loop, tftp_packet_t *pkt,
+                       size_t pkt_size) {
+  tftp_t *tftp = &loop->listener;
+
+  uint16_t opcode = ntohs(pkt->opcode);
+  if ((opcode != TFTP_PKT_RRQ) && (opcode != TFTP_PKT_WRQ)) {
+    return;
+  }
+
+  tftp_session_t *sess = (tftp_session_t *)tftp_pool_get(&loop->session_pool);
+  if (sess == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: alloc session failed.\n");
+    send_busy(loop, &tftp->remote);
+    return;
+  }
+
+  memset(sess, 0, sizeof(tftp_session_t));
+  sess->fd = -1;
+  sess->timer_idx = -1;
+  if (parse_req(tftp, pkt, pkt_size, &sess->req) < 0) {
+    tftp_pool_put(&loop->session_pool, sess);
+    return;
+  }
 
-    size_t block_size = pkt_size - 4;
-    if (block_size) {
-      size_t size = fwrite(tftp->rx_packet.data.data, 1, block_size, file);
-      if (size < block_size) {
-        printf("tftpd: write file failed: %s\n", path_buf);
-        goto recv_failed;
+  if (sess->req.mcast && mcast_port && (sess->req.op == TFTP_PKT_RRQ)) {
+    tftp_session_t *group = mcast_find(loop, sess);
+    if (group) {
+      if (mcast_join(loop, group, &tftp->remote) < 0) {
+        tftp_log(TFTP_LOG_ERROR, "tftpd: join multicast group failed.\n");
       }
+      tftp_pool_put(&loop->session_pool, sess);
+      return;
     }
+  }
 
-    int err = tftp_send_ack(tftp, curr_blk++);
-    if (err < 0) {
-      printf("tftp: send ack failed.\n");
-      goto recv_failed;
+  // a client that retransmits its request before our oack arrived is
+  // already being served
+  if (table_find(loop, &tftp->remote, sess->req.filename)) {
+    tftp_stats_add(loop->stats, TFTP_STAT_DUP_REQUESTS, 1);
+    tftp_pool_put(&loop->session_pool, sess);
+    return;
+  }
+
+  // past the session limit requests wait their turn, behind those already
+  // waiting
+  if ((loop->queue_count > 0) || !admit_take()) {
+    queue_push(loop, sess);
+    return;
+  }
+
+  session_open(loop, sess);
+}
+
+static void loop_accept(tftp_loop_t *loop) {
+  tftp_t *tftp = &loop->listener;
+  tftp_batch_t *batch = &loop->rx_batch;
+
+  int count;
+  do {
+    count = tftp_batch_recv(tftp, batch);
+    for (int i = 0; i < count; i++) {
+      memcpy(&tftp->remote, &batch->remotes[i], sizeof(tftp->remote));
+      accept_req(loop, tftp_batch_packet(batch, i), batch->msgs[i].msg_len);
     }
+  } while (count == TFTP_BATCH_SIZE);
+}
 
-    total_size += (int)block_size;
-    total_block++;
+static void loop_session(tftp_loop_t *loop, tftp_session_t *sess,
+                         uint32_t events) {
+  tftp_t *tftp = &sess->req.tftp;
+  tftp_batch_t *batch = &loop->rx_batch;
+  int err = 0;
 
-    if (block_size < tftp->block_size) {
-      break;
+  if (events & EPOLLERR) {
+    session_on_errqueue(sess);
+  }
+  if (events & EPOLLOUT) {
+    err = session_send_window(loop, sess);
+  }
+
+  int count = TFTP_BATCH_SIZE;
+  while ((err == 0) && (sess->state != TFTP_STATE_DONE) &&
+         (count == TFTP_BATCH_SIZE)) {
+    count = tftp_batch_recv(tftp, batch);
+    for (int i = 0; (i < count) && (err == 0); i++) {
+      if (sess->state == TFTP_STATE_DONE) {
+        break;
+      }
+      err = session_on_packet(loop, sess, tftp_batch_packet(batch, i),
+                              batch->msgs[i].msg_len, &batch->remotes[i]);
     }
   }
 
-  printf("tftpd: recv %s %d bytes %d blocks\n", path_buf, total_size,
-         total_block);
-  fclose(file);
-  return 0;
-recv_failed:
-  fclose(file);
-  return -1;
+  if ((err < 0) || (sess->state == TFTP_STATE_DONE)) {
+    session_close(loop, sess);
+  }
 }
 
-static int do_send_file(tftp_req_t *req) {
-  tftp_t *tftp = &req->tftp;
+static void loop_timers(tftp_loop_t *loop) {
+  int64_t now = now_ms();
 
-  char path_buf[256];
-  if (server_path) {
-    snprintf(path_buf, sizeof(path_buf), "%s/%s", server_path, req->filename);
-  } else {
-    snprintf(path_buf, sizeof(path_buf), "%s", req->filename);
-  }
+  while (loop->timer_count && (loop->timers[0]->deadline <= now)) {
+    tftp_session_t *sess = loop->timers[0];
+    timer_del(loop, sess);
 
-  FILE *file = fopen(path_buf, "rb");
-  if (file == NULL) {
-    printf("tftpd: file %s does not exist\n", path_buf);
-    tftp_send_error(tftp, TFTP_ERR_NO_FILE);
-    return -1;
+    if ((session_on_timer(loop, sess) < 0) ||
+        (sess->state == TFTP_STATE_DONE)) {
+      session_close(loop, sess);
+    }
   }
+}
 
-  printf("tftpd: sending file %s...\n", path_buf);
+static void loop_writer(tftp_loop_t *loop) {
+  tftp_chunk_t *chunk = tftp_writer_reap(&loop->writer);
+  while (chunk) {
+    tftp_chunk_t *next = chunk->next;
+    tftp_session_t *sess = (tftp_session_t *)chunk->owner;
 
-  fseek(file, 0, SEEK_END);
-  long filesize = ftell(file);
-  fseek(file, 0, SEEK_SET);
-  tftp->file_size = filesize;
+    // io_uring may complete the chunks of a file in any order, the data on
+    // disk only grows by the finished chunks in front of the oldest one
+    // still writing, and ends before the first error
+    chunk->finished = 1;
+    while (sess->wb_head && sess->wb_head->finished) {
+      tftp_chunk_t *head = sess->wb_head;
+      sess->wb_head = head->owner_next;
+      if (sess->wb_head == NULL) {
+        sess->wb_last = NULL;
+      }
 
-  if (req->option) {
-    int err = tftp_send_oack(tftp);
-    if (err < 0) {
-      printf("tftpd: send oack failed.\n");
-      goto send_failed;
+      sess->wb_pending--;
+      if (head->err && !sess->wb_err) {
+        sess->wb_err = head->err;
+      } else if (!sess->wb_err) {
+        sess->wb_synced = head->offset + (off_t)head->size;
+      }
+      tftp_writer_release(&loop->writer, head);
     }
 
-    size_t pkt_size;
-    err = tftp_wait_packet(tftp, TFTP_PKT_ACK, 0, &pkt_size);
-    if (err < 0) {
-      printf("tftp: wait ack failed.\n");
-      goto send_failed;
+    if (sess->closed) {
+      session_unref(loop, sess);
+    } else if (session_on_write(loop, sess) < 0) {
+      session_close(loop, sess);
     }
+    chunk = next;
   }
+}
 
-  uint16_t curr_blk = 1;
-  int total_size = 0;
-  int total_block = 0;
-  while (1) {
-    size_t size = fread(tftp->tx_packet.data.data, 1, tftp->block_size, file);
-    if (size < 0) {
-      printf("tftpd: read file %s failed.\n", path_buf);
-      tftp_send_error(tftp, TFTP_ERR_ACC_VIO);
-      goto send_failed;
-    }
+static void loop_event(tftp_loop_t *loop, void *ptr, uint32_t events) {
+  if (ptr == NULL) {
+    loop_accept(loop);
+  } else if (ptr == &loop->writer) {
+    loop_writer(loop);
+  } else {
+    loop_session(loop, (tftp_session_t *)ptr, events);
+  }
+}
 
-    int err = tftp_send_data(tftp, curr_blk, size);
-    if (err < 0) {
-      printf("tftp: send data block failed.\n");
-      goto send_failed;
+// hand freed send slots to the sessions waiting for them, oldest first
+static void loop_resume(tftp_loop_t *loop) {
+  while (loop->free_slots && loop->wait_head) {
+    tftp_session_t *sess = loop->wait_head;
+    loop->wait_head = sess->wait_next;
+    if (loop->wait_head == NULL) {
+      loop->wait_tail = &loop->wait_head;
     }
 
-    size_t pkt_size;
-    err = tftp_wait_packet(tftp, TFTP_PKT_ACK, curr_blk++, &pkt_size);
-    if (err < 0) {
-      printf("tftp: wait ack failed.\n");
-      goto send_failed;
+    sess->wait_out = 0;
+    if (session_send_window(loop, sess) < 0) {
+      session_close(loop, sess);
     }
+  }
+}
 
-    total_size += (int)size;
-    total_block++;
+static void loop_poll(tftp_loop_t *loop, void *ptr, int res, uint32_t flags) {
+  tftp_session_t *sess = (tftp_session_t *)ptr;
 
-    if (size < tftp->block_size) {
-      break;
+  if ((res > 0) && !(sess && sess->closed)) {
+    loop_event(loop, ptr, (uint32_t)res);
+  }
+  if (flags & IORING_CQE_F_MORE) {
+    return;
+  }
+
+  // the multishot poll ended, arm it again while the socket is in use
+  if (sess == NULL) {
+    if (loop_watch(loop, loop->listener.socket, NULL) < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: watch server socket failed.\n");
     }
+    return;
   }
 
-  printf("tftpd: send %s %d bytes %d blocks\n", path_buf, total_size,
-         total_block);
-  fclose(file);
-  return 0;
-send_failed:
-  printf("tftpd: send failed\n");
-  fclose(file);
-  return -1;
+  if (sess->closed) {
+    sess->polling = 0;
+    session_unref(loop, sess);
+  } else if (loop_watch(loop, sess->req.tftp.socket, sess) < 0) {
+    sess->polling = 0;
+    session_close(loop, sess);
+  }
 }
 
-static int wait_req(tftp_t *tftp, tftp_req_t *req) {
-  tftp_packet_t *pkt = &tftp->rx_packet;
-  size_t pkt_size;
-  int err = tftp_wait_packet(tftp, TFTP_PKT_REQ, 0, &pkt_size);
+// a zerocopy send completes twice, with its result and, once the kernel is
+// done with the pages, with a notification. a failed send is a lost packet
+// that the retransmit timer recovers
+static void loop_sent(tftp_loop_t *loop, tftp_slot_t *slot, int res,
+                      uint32_t flags) {
+  tftp_session_t *sess = slot->owner;
 
-  req->op = ntohs(pkt->opcode);
-  req->option = 0;
-  req->blksize = TFTP_DEF_BLKSIZE;
-  req->filesize = 0;
-  memset(req->filename, 0, sizeof(req->filename));
-  memset(&req->tftp, 0, sizeof(req->tftp));
-  memcpy(&req->tftp.remote, &tftp->remote, sizeof(tftp->remote));
+  if (!sess->closed) {
+    if ((flags & IORING_CQE_F_NOTIF) && (res & IORING_NOTIF_USAGE_ZC_COPIED)) {
+      sess->zerocopy = 0;
+    } else if ((res == -EINVAL) || (res == -EOPNOTSUPP)) {
+      sess->zerocopy = 0;
+    } else if (res == -EFAULT) {
+      session_changed(sess);
+      session_close(loop, sess);
+    }
+  }
+  if (flags & IORING_CQE_F_MORE) {
+    return;
+  }
 
-  struct sockaddr_in *addr = (struct sockaddr_in *)&tftp->remote;
-  printf("tftp: recv req %s from %s %d\n",
-         req->op == TFTP_PKT_RRQ ? "get" : "put", inet_ntoa(addr->sin_addr),
-         ntohs(addr->sin_port));
+  slot->next = loop->free_slots;
+  loop->free_slots = slot;
+  sess->tx_pending--;
+  session_unref(loop, sess);
+}
 
-  char *buf = (char *)pkt->req.args;
-  char *end = (char *)pkt + pkt_size;
-  strncpy(req->filename, buf, sizeof(req->filename));
-  buf += strlen(req->filename) + 1;
+static void loop_cqe(tftp_loop_t *loop, uint64_t user_data, int res,
+                     uint32_t flags) {
+  void *ptr = (void *)(uintptr_t)(user_data & ~(uint64_t)TFTPD_UD_MASK);
 
-  if (strcmp(buf, "octet") != 0) {
-    tftp_send_error(tftp, TFTP_ERR_OP);
-    printf("tftp: unknown transfer mode %s\n", buf);
-    return -1;
+  switch (user_data & TFTPD_UD_MASK) {
+    case TFTPD_UD_POLL: {
+      loop_poll(loop, ptr, res, flags);
+      break;
+    }
+    case TFTPD_UD_SEND: {
+      loop_sent(loop, (tftp_slot_t *)ptr, res, flags);
+      break;
+    }
+    case TFTPD_UD_WRITE: {
+      tftp_writer_complete(&loop->writer, (tftp_chunk_t *)ptr, res);
+      break;
+    }
+    default: {
+      break;
+    }
   }
+}
 
-  buf += strlen("octet") + 1;
+static int loop_open_uring(tftp_loop_t *loop) {
+  if (tftp_uring_init(&loop->ring, TFTPD_URING_ENTRIES,
+                      TFTPD_URING_CQ_ENTRIES) < 0) {
+    return -1;
+  }
 
-  while ((buf < end) && (*buf)) {
-    req->option = 1;
-    if (strcmp(buf, "blksize") == 0) {
-      buf += strlen("blksize") + 1;
-      int blksize = atoi(buf);
+  if (tftp_writer_init_uring(&loop->writer, &loop->ring, TFTPD_UD_WRITE) < 0) {
+    tftp_uring_free(&loop->ring);
+    tftp_writer_free(&loop->writer);
+    return -1;
+  }
 
-      if (blksize <= 0) {
-        tftp_send_error(tftp, TFTP_ERR_OP);
-        return -1;
-      } else if (blksize > TFTP_BLK_SIZE) {
-        printf("blk size %d too long, set to %d\n", blksize, TFTP_DEF_BLKSIZE);
-        blksize = TFTP_DEF_BLKSIZE;
-      }
+  tftp_slot_t *slots =
+      (tftp_slot_t *)calloc(TFTPD_URING_SLOTS, sizeof(tftp_slot_t));
+  tftp_packet_t *packets =
+      (tftp_packet_t *)malloc(TFTPD_URING_SLOTS * sizeof(tftp_packet_t));
+  if ((slots == NULL) || (packets == NULL)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: alloc send slots failed.\n");
+    free(slots);
+    free(packets);
+    tftp_uring_free(&loop->ring);
+    tftp_writer_free(&loop->writer);
+    return -1;
+  }
 
-      req->blksize = blksize;
-      buf += strlen(buf) + 1;
-    } else if (strcmp(buf, "tsize") == 0) {
-      buf += strlen(buf) + 1;
-      req->filesize = atoi(buf);
-      buf += strlen(buf) + 1;
-    } else {
-      buf += strlen(buf) + 1;
-    }
+  loop->slots = slots;
+  for (int i = 0; i < TFTPD_URING_SLOTS; i++) {
+    tftp_slot_t *slot = &slots[i];
+    slot->packet = &packets[i];
+    slot->iov[0].iov_base = slot->packet;
+    slot->iov[0].iov_len = 4;
+    slot->msg.msg_name = &slot->remote;
+    slot->msg.msg_namelen = sizeof(slot->remote);
+    slot->msg.msg_iov = slot->iov;
+    slot->msg.msg_iovlen = 1;
+    slot->next = loop->free_slots;
+    loop->free_slots = slot;
   }
+
+  loop->wait_head = NULL;
+  loop->wait_tail = &loop->wait_head;
+  return 0;
 }
 
-static void *tftp_working_thread(void *arg) {
-  tftp_req_t *req = (tftp_req_t *)arg;
-  tftp_t *tftp = &req->tftp;
+static int loop_open(tftp_loop_t *loop, int reuseport) {
+  tftp_t *tftp = &loop->listener;
 
-  int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-  if (sockfd < 0) {
-    printf("tftp: create working socket failed.\n");
-    goto init_error;
+  // what a failed open leaves behind is freed by loop_close
+  loop->epfd = -1;
+  loop->writer.event_fd = -1;
+  tftp->socket = -1;
+
+  // only headers and control packets are copied into the send batch, the
+  // data of a block is sent from the file mapping
+  if ((tftp_batch_init(&loop->rx_batch, TFTP_PKT_SIZE(server_blksize)) < 0) ||
+      (tftp_batch_init(&loop->tx_batch, TFTPD_CTRL_SIZE) < 0)) {
+    return -1;
   }
 
-  tftp->socket = sockfd;
-  tftp->tmo_retry = TFTP_MAX_RETRY;
-  tftp->tmo_sec = TFTP_TMO_SEC;
-  tftp->file_size = req->filesize;
-  tftp->block_size = req->blksize;
+  if (loop->uring && tftp_impair_active()) {
+    // io_uring sends would bypass the impairment layer
+    tftp_log(TFTP_LOG_WARN, "tftpd: impairment active, using epoll.\n");
+    loop->uring = 0;
+  }
+  if (loop->uring && (loop_open_uring(loop) < 0)) {
+    tftp_log(TFTP_LOG_WARN, "tftpd: io_uring unavailable, using epoll.\n");
+    loop->uring = 0;
+  }
 
-  struct timeval tmo;
-  tmo.tv_sec = tftp->tmo_sec;
-  tmo.tv_usec = 0;
-  setsockopt(tftp->socket, SOL_SOCKET, SO_RCVTIMEO, (const void *)&tmo,
-             sizeof(tmo));
+  if (!loop->uring) {
+    if (tftp_writer_init(&loop->writer) < 0) {
+      return -1;
+    }
 
-  if (req->op == TFTP_PKT_WRQ) {
-    do_recv_file(req);
-  } else {
-    do_send_file(req);
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: create epoll failed.\n");
+      return -1;
+    }
   }
 
-init_error:
-  if (sockfd >= 0) {
-    close(sockfd);
+  loop->stats = tftp_stats_new();
+  if (loop->stats == NULL) {
+    return -1;
   }
-  free(req);
-  return NULL;
-}
 
-static void *tftp_server_thread(void *arg) {
-  printf("tftp server is running...\n");
+  loop->queue =
+      (tftp_session_t **)calloc(server_queue_size, sizeof(tftp_session_t *));
+  if (loop->queue == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: alloc request queue failed.\n");
+    return -1;
+  }
+
+  tftp_pool_init(&loop->session_pool, sizeof(tftp_session_t));
+  tftp_pool_init(&loop->ctrl_pool, TFTPD_CTRL_SIZE);
+  tftp->buf_size = TFTPD_CTRL_SIZE;
+  tftp->tx_packet = (tftp_packet_t *)tftp_pool_get(&loop->ctrl_pool);
+  if (tftp->tx_packet == NULL) {
+    return -1;
+  }
 
   int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
   if (sockfd < 0) {
-    printf("tftpd: create server socket failed.\n");
-    return NULL;
+    tftp_log(TFTP_LOG_ERROR, "tftpd: create server socket failed.\n");
+    return -1;
+  }
+  tftp->socket = sockfd;
+
+  int on = 1;
+  if (reuseport &&
+      (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: set reuseport failed.\n");
+    return -1;
   }
 
   struct sockaddr_in sockaddr;
@@ -268,45 +2295,306 @@ static void *tftp_server_thread(void *arg) {
   sockaddr.sin_addr.s_addr = INADDR_ANY;
   sockaddr.sin_port = htons(server_port);
   if (bind(sockfd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) < 0) {
-    printf("tftpd: bind error, port: %d\n", server_port);
-    close(sockfd);
-    return NULL;
+    tftp_log(TFTP_LOG_ERROR, "tftpd: bind error, port: %d\n", server_port);
+    return -1;
+  }
+
+  if ((set_nonblock(sockfd) < 0) || (loop_watch(loop, sockfd, NULL) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: add server socket failed.\n");
+    return -1;
+  }
+
+  if (!loop->uring &&
+      (loop_watch(loop, loop->writer.event_fd, &loop->writer) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: add writer event failed.\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+// free a loop that never served, opened or only partly opened
+static void loop_close(tftp_loop_t *loop) {
+  if (loop->listener.socket >= 0) {
+    close(loop->listener.socket);
+  }
+  if (loop->epfd >= 0) {
+    close(loop->epfd);
+  }
+  if (loop->uring) {
+    tftp_uring_free(&loop->ring);
+    free(loop->slots[0].packet);
+    free(loop->slots);
+  }
+  tftp_writer_free(&loop->writer);
+  free(loop->queue);
+  tftp_pool_destroy(&loop->ctrl_pool);
+  tftp_pool_destroy(&loop->session_pool);
+  tftp_batch_free(&loop->rx_batch);
+  tftp_batch_free(&loop->tx_batch);
+  tftp_stats_free(loop->stats);
+}
+
+static int loop_timeout(tftp_loop_t *loop) {
+  // sessions closed by other loops free no event here, so queued requests
+  // are looked at every TFTPD_ADMIT_POLL_MS
+  int timeout = loop->queue_count ? TFTPD_ADMIT_POLL_MS : -1;
+  if (loop->timer_count == 0) {
+    return timeout;
   }
 
-  tftp.socket = sockfd;
+  int64_t delta = loop->timers[0]->deadline - now_ms();
+  if (delta < 0) {
+    delta = 0;
+  }
+  return ((timeout < 0) || (delta < timeout)) ? (int)delta : timeout;
+}
 
+static void loop_run_epoll(tftp_loop_t *loop) {
+  struct epoll_event events[TFTPD_MAX_EVENTS];
   while (1) {
-    tftp_req_t *req = (tftp_req_t *)malloc(sizeof(tftp_req_t));
-    if (req == NULL) {
-      continue;
+    int count =
+        epoll_wait(loop->epfd, events, TFTPD_MAX_EVENTS, loop_timeout(loop));
+    if ((count < 0) && (errno != EINTR)) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: epoll wait failed.\n");
+      break;
     }
 
-    int err = wait_req(&tftp, req);
-    if (err < 0) {
-      free(req);
-      continue;
+    for (int i = 0; i < count; i++) {
+      loop_event(loop, events[i].data.ptr, events[i].events);
     }
 
-    pthread_t thread;
-    err = pthread_create(&thread, NULL, tftp_working_thread, req);
-    if (err != 0) {
-      printf("tftpd: create working thread failed.\n");
-      free(req);
-      continue;
+    loop_timers(loop);
+    loop_admit(loop);
+  }
+}
+
+// polls of closed sessions left armed when the sq was full
+static void loop_unwatch_retry(tftp_loop_t *loop) {
+  tftp_session_t *list = loop->unwatch_head;
+  loop->unwatch_head = NULL;
+  while (list) {
+    tftp_session_t *sess = list;
+    list = sess->unwatch_next;
+    sess->unwatch = 0;
+    if (sess->polling) {
+      loop_unwatch(loop, -1, sess);
+    } else {
+      session_unref(loop, sess);
+    }
+  }
+}
+
+// one io_uring_enter per iteration submits the sends, writes and polls
+// queued by the last one and waits for the next completions
+static void loop_run_uring(tftp_loop_t *loop) {
+  while (1) {
+    if (tftp_uring_wait(&loop->ring, loop_timeout(loop)) < 0) {
+      break;
+    }
+
+    struct io_uring_cqe *cqe;
+    while ((cqe = tftp_uring_peek(&loop->ring)) != NULL) {
+      uint64_t user_data = cqe->user_data;
+      int res = cqe->res;
+      uint32_t flags = cqe->flags;
+      tftp_uring_seen(&loop->ring);
+      loop_cqe(loop, user_data, res, flags);
+    }
+
+    loop_writer(loop);
+    loop_unwatch_retry(loop);
+    loop_resume(loop);
+    loop_timers(loop);
+    loop_admit(loop);
+  }
+}
+
+static void *tftp_server_thread(void *arg) {
+  tftp_loop_t *loop = (tftp_loop_t *)arg;
+
+  pthread_mutex_lock(&start_lock);
+  while (loop->run == 0) {
+    pthread_cond_wait(&start_cond, &start_lock);
+  }
+  int run = loop->run;
+  pthread_mutex_unlock(&start_lock);
+  if (run < 0) {
+    return NULL;
+  }
+
+  if (loop->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(loop->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: pin server thread to cpu %d failed.\n",
+               loop->cpu);
     }
+    tftp_log(TFTP_LOG_INFO, "tftp server is running on cpu %d...\n", loop->cpu);
+  } else {
+    tftp_log(TFTP_LOG_INFO, "tftp server is running...\n");
+  }
+
+  if (loop->uring) {
+    loop_run_uring(loop);
+  } else {
+    loop_run_epoll(loop);
   }
+
   return NULL;
 }
 
-int tftpd_start(const char *dir, uint16_t port) {
-  pthread_t server_thread;
-  server_path = dir;
-  server_port = port ? port : TFTP_DEF_PORT;
-  int err = pthread_create(&server_thread, NULL, tftp_server_thread, NULL);
-  if (err != 0) {
-    printf("tftpd: create server thread failed.\n");
+// "a.b.c.d/len", a plain address is a /32
+static int parse_net(const char *net, in_addr_t *addr, in_addr_t *mask) {
+  char buf[INET_ADDRSTRLEN + 4];
+  snprintf(buf, sizeof(buf), "%s", net);
+
+  int len = 32;
+  char *slash = strchr(buf, '/');
+  if (slash) {
+    *slash = '\0';
+    char *end;
+    len = (int)strtol(slash + 1, &end, 10);
+    if ((*end != '\0') || (len < 0) || (len > 32)) {
+      return -1;
+    }
+  }
+
+  struct in_addr in;
+  if (inet_aton(buf, &in) == 0) {
+    return -1;
+  }
+
+  // a /0 would put everyone first
+  if (len == 0) {
+    return -1;
+  }
+  *mask = htonl(0xffffffffu << (32 - len));
+  *addr = in.s_addr & *mask;
+  return 0;
+}
+
+int tftpd_start_config(const tftpd_config_t *config) {
+  server_path = config->dir;
+  server_port = config->port ? config->port : TFTP_DEF_PORT;
+  tftp_rate_init(&server_rate, config->rate_limit);
+  tftp_rate_table_init(&client_rates, config->client_rate_limit,
+                       config->client_prefix);
+  server_max_sessions = config->max_sessions > 0 ? config->max_sessions : 0;
+  server_queue_size =
+      config->queue_size > 0 ? config->queue_size : TFTPD_QUEUE_SIZE;
+  if (config->priority_net &&
+      (parse_net(config->priority_net, &prio_addr, &prio_mask) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: bad priority network %s\n",
+             config->priority_net);
     return -1;
   }
+  server_blksize = TFTP_MAX_BLKSIZE;
+  if ((config->max_blksize >= TFTP_MIN_BLKSIZE) &&
+      (config->max_blksize < TFTP_MAX_BLKSIZE)) {
+    server_blksize = config->max_blksize;
+  }
+  server_umask = umask(0);
+  umask(server_umask);
+
+  if (config->mcast_addr) {
+    if (inet_aton(config->mcast_addr, &mcast_base) == 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: bad multicast address %s\n",
+               config->mcast_addr);
+      return -1;
+    }
+    mcast_port = config->mcast_port ? config->mcast_port : server_port;
+  }
+
+  // shards are pinned round robin to the cpus the process may run on
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  int shards = config->shards;
+  if (shards != 0) {
+    if (sched_getaffinity(0, sizeof(cpus), &cpus) < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: get cpu affinity failed.\n");
+      return -1;
+    }
+    if (shards < 0) {
+      shards = CPU_COUNT(&cpus);
+    }
+  }
+
+  int count = shards ? shards : 1;
+  tftp_loop_t *loops = (tftp_loop_t *)calloc(count, sizeof(tftp_loop_t));
+  if (loops == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: alloc server loops failed.\n");
+    return -1;
+  }
+
+  // every loop is opened and its thread created before any serves, a
+  // failure stops and frees what was started
+  int opened = 0;
+  int started = 0;
+  int cpu = 0;
+  for (int i = 0; i < count; i++) {
+    tftp_loop_t *loop = &loops[i];
+    loop->cpu = -1;
+    loop->uring = config->engine == TFTPD_ENGINE_URING;
+    if (shards) {
+      while (!CPU_ISSET(cpu % CPU_SETSIZE, &cpus)) {
+        cpu++;
+      }
+      loop->cpu = cpu++ % CPU_SETSIZE;
+    }
+
+    opened++;
+    if (loop_open(loop, shards != 0) < 0) {
+      goto start_error;
+    }
+  }
+
+  for (int i = 0; i < count; i++) {
+    if (pthread_create(&loops[i].thread, NULL, tftp_server_thread,
+                       &loops[i]) != 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: create server thread failed.\n");
+      goto start_error;
+    }
+    started++;
+  }
 
+  if ((config->stats_sock || config->stats_file) &&
+      (tftp_stats_serve(config->stats_sock, config->stats_file,
+                        config->stats_interval) < 0)) {
+    goto start_error;
+  }
+
+  pthread_mutex_lock(&start_lock);
+  for (int i = 0; i < count; i++) {
+    loops[i].run = 1;
+    pthread_detach(loops[i].thread);
+  }
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&start_lock);
   return 0;
-}
\ No newline at end of file
+
+start_error:
+  pthread_mutex_lock(&start_lock);
+  for (int i = 0; i < started; i++) {
+    loops[i].run = -1;
+  }
+  pthread_cond_broadcast(&start_cond);
+  pthread_mutex_unlock(&start_lock);
+  for (int i = 0; i < started; i++) {
+    pthread_join(loops[i].thread, NULL);
+  }
+  for (int i = 0; i < opened; i++) {
+    loop_close(&loops[i]);
+  }
+  free(loops);
+  return -1;
+}
+
+int tftpd_start(const char *dir, uint16_t port) {
+  tftpd_config_t config;
+  memset(&config, 0, sizeof(config));
+  config.dir = dir;
+  config.port = port;
+  return tftpd_start_config(&config);
+}
@@ -3,6 +3,58 @@
 
 #include "tftp_base.h"
 
+#define TFTPD_SHARDS_PER_CORE -1
+
+typedef enum _tftpd_engine_t {
+  TFTPD_ENGINE_EPOLL = 0,
+  TFTPD_ENGINE_URING,
+} tftpd_engine_t;
+
+typedef struct _tftpd_config_t {
+  const char *dir;
+  uint16_t port;
+
+  // 0: one event loop, otherwise one SO_REUSEPORT listener and cpu pinned
+  // loop per shard, TFTPD_SHARDS_PER_CORE for one per core
+  int shards;
+
+  // first address and port of the rfc 2090 multicast groups, multicast
+  // requests are served by unicast when not set
+  const char *mcast_addr;
+  uint16_t mcast_port;
+
+  // io_uring runs the loops on one io_uring_enter per iteration, falls back
+  // to epoll when the kernel lacks it
+  tftpd_engine_t engine;
+
+  // largest blksize granted, larger requests are clamped to it. 0 for the
+  // rfc 2348 maximum of TFTP_MAX_BLKSIZE
+  int max_blksize;
+
+  // send rate caps in bytes per second, 0 for none: one for all transfers,
+  // shared fairly by the sessions sending, and one for each client address
+  // or subnet of client_prefix bits (32 when 0)
+  int64_t rate_limit;
+  int64_t client_rate_limit;
+  int client_prefix;
+
+  // transfers served at once by all loops, 0 for no limit. past it each loop
+  // queues up to queue_size requests (TFTPD_QUEUE_SIZE when 0), clients of
+  // priority_net ("a.b.c.d/len") first and then the smaller files as far as
+  // the file cache knows their size, and answers the rest with a
+  // "Server busy" error
+  int max_sessions;
+  int queue_size;
+  const char *priority_net;
+
+  // live counters and histograms of all loops, served as text to every
+  // client of a unix socket and/or rewritten to a file every interval seconds
+  const char *stats_sock;
+  const char *stats_file;
+  int stats_interval;
+} tftpd_config_t;
+
 int tftpd_start(const char *dir, uint16_t port);
+int tftpd_start_config(const tftpd_config_t *config);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,315 @@
+#include "tftp_stats.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "tftp_log.h"
+
+static const char *stat_names[TFTP_STAT_COUNT] = {
+    "sessions_active", "sessions_total", "sessions_failed",
+    "rrq_total",       "wrq_total",      "sent_bytes_total",
+    "recv_bytes_total", "sent_blocks_total", "recv_blocks_total",
+    "retransmits_total", "timeouts_total", "dup_requests_total",
+    "requests_queued",   "busy_total",
+};
+
+static const char *hist_names[TFTP_HIST_COUNT] = {
+    "session_rtt_us",
+    "session_duration_ms",
+};
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static tftp_stats_t *stats_blocks[TFTP_STATS_MAX_BLOCKS];
+static int stats_count;
+
+static const char *stats_sock;
+static const char *stats_file;
+static int stats_interval;
+static int64_t stats_start_ms;
+// bytes per second over the last second, sampled by the stats thread
+static uint64_t stats_rate[2];
+
+static int64_t stats_now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+tftp_stats_t *tftp_stats_new(void) {
+  tftp_stats_t *stats = NULL;
+  if (posix_memalign((void **)&stats, 64, sizeof(tftp_stats_t)) != 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: alloc stats failed.\n");
+    return NULL;
+  }
+  memset(stats, 0, sizeof(tftp_stats_t));
+
+  pthread_mutex_lock(&stats_lock);
+  if (stats_count == TFTP_STATS_MAX_BLOCKS) {
+    pthread_mutex_unlock(&stats_lock);
+    tftp_log(TFTP_LOG_ERROR, "tftp: too many stats blocks.\n");
+    free(stats);
+    return NULL;
+  }
+  stats_blocks[stats_count++] = stats;
+  pthread_mutex_unlock(&stats_lock);
+  return stats;
+}
+
+// unregister and free a block whose thread is gone or never ran. the
+// readers walk the blocks under stats_lock, the loop numbers of the later
+// blocks move down by one
+void tftp_stats_free(tftp_stats_t *stats) {
+  if (stats == NULL) {
+    return;
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  for (int i = 0; i < stats_count; i++) {
+    if (stats_blocks[i] == stats) {
+      memmove(&stats_blocks[i], &stats_blocks[i + 1],
+              (stats_count - i - 1) * sizeof(tftp_stats_t *));
+      stats_count--;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&stats_lock);
+  free(stats);
+}
+
+// only the owning thread writes, a relaxed store is enough for the readers
+// to never see a torn value
+void tftp_stats_add(tftp_stats_t *stats, tftp_stat_t stat, int64_t value) {
+  uint64_t *counter = &stats->counters[stat];
+  __atomic_store_n(counter, *counter + (uint64_t)value, __ATOMIC_RELAXED);
+}
+
+void tftp_stats_observe(tftp_stats_t *stats, tftp_hist_t hist,
+                        uint64_t value) {
+  // bucket i counts the values up to 2^i
+  int idx = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+  if (idx >= TFTP_STATS_BUCKETS) {
+    idx = TFTP_STATS_BUCKETS - 1;
+  }
+
+  uint64_t *bucket = &stats->hists[hist][idx];
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+}
+
+static uint64_t stats_sum(tftp_stats_t **blocks, int count, tftp_stat_t stat) {
+  uint64_t sum = 0;
+  for (int i = 0; i < count; i++) {
+    sum += __atomic_load_n(&blocks[i]->counters[stat], __ATOMIC_RELAXED);
+  }
+
+  return sum;
+}
+
+// text snapshot in the prometheus exposition format, returns its length
+int tftp_stats_format(char *buf, int size) {
+  pthread_mutex_lock(&stats_lock);
+  tftp_stats_t **blocks = stats_blocks;
+  int count = stats_count;
+  int len = 0;
+
+#define STATS_PRINT(...)                                        \
+  do {                                                          \
+    if (len < size) {                                           \
+      len += snprintf(buf + len, size - len, __VA_ARGS__);      \
+    }                                                           \
+  } while (0)
+
+  STATS_PRINT("tftpd_uptime_seconds %" PRId64 "\n",
+              (stats_now_ms() - stats_start_ms) / 1000);
+  for (int stat = 0; stat < TFTP_STAT_COUNT; stat++) {
+    STATS_PRINT("tftpd_%s %" PRId64 "\n", stat_names[stat],
+                (int64_t)stats_sum(blocks, count, (tftp_stat_t)stat));
+  }
+  for (int i = 0; i < count; i++) {
+    STATS_PRINT("tftpd_sessions_active{loop=\"%d\"} %" PRId64 "\n", i,
+                (int64_t)__atomic_load_n(
+                    &blocks[i]->counters[TFTP_STAT_SESSIONS_ACTIVE],
+                    __ATOMIC_RELAXED));
+  }
+  STATS_PRINT("tftpd_sent_bytes_per_second %" PRIu64 "\n",
+              __atomic_load_n(&stats_rate[0], __ATOMIC_RELAXED));
+  STATS_PRINT("tftpd_recv_bytes_per_second %" PRIu64 "\n",
+              __atomic_load_n(&stats_rate[1], __ATOMIC_RELAXED));
+
+  for (int hist = 0; hist < TFTP_HIST_COUNT; hist++) {
+    uint64_t total = 0;
+    for (int idx = 0; idx < TFTP_STATS_BUCKETS; idx++) {
+      for (int i = 0; i < count; i++) {
+        total += __atomic_load_n(&blocks[i]->hists[hist][idx], __ATOMIC_RELAXED);
+      }
+      if (idx == TFTP_STATS_BUCKETS - 1) {
+        STATS_PRINT("tftpd_%s_bucket{le=\"+Inf\"} %" PRIu64 "\n",
+                    hist_names[hist], total);
+      } else {
+        STATS_PRINT("tftpd_%s_bucket{le=\"%" PRIu64 "\"} %" PRIu64 "\n",
+                    hist_names[hist], (uint64_t)1 << idx, total);
+      }
+    }
+    STATS_PRINT("tftpd_%s_count %" PRIu64 "\n", hist_names[hist], total);
+  }
+
+#undef STATS_PRINT
+  pthread_mutex_unlock(&stats_lock);
+  return len < size ? len : size - 1;
+}
+
+static void stats_dump(char *buf, int size) {
+  char tmp_path[512];
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", stats_file);
+
+  FILE *file = fopen(tmp_path, "w");
+  if (file == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: open stats file %s failed.\n", tmp_path);
+    return;
+  }
+
+  int len = tftp_stats_format(buf, size);
+  size_t written = fwrite(buf, 1, len, file);
+  if ((fclose(file) != 0) || (written != (size_t)len) ||
+      (rename(tmp_path, stats_file) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: write stats file %s failed.\n",
+             stats_file);
+    unlink(tmp_path);
+  }
+}
+
+static void stats_reply(int listen_fd, char *buf, int size) {
+  int fd = accept(listen_fd, NULL, NULL);
+  if (fd < 0) {
+    return;
+  }
+
+  // a reader that does not read must not hold up the next one for long
+  struct timeval tmo = {1, 0};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tmo, sizeof(tmo));
+
+  int len = tftp_stats_format(buf, size);
+  int sent = 0;
+  while (sent < len) {
+    ssize_t ret = write(fd, buf + sent, len - sent);
+    if (ret <= 0) {
+      break;
+    }
+    sent += (int)ret;
+  }
+  close(fd);
+}
+
+static int stats_listen(void) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(stats_sock) >= sizeof(addr.sun_path)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: stats socket path too long: %s\n",
+             stats_sock);
+    return -1;
+  }
+  strcpy(addr.sun_path, stats_sock);
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: create stats socket failed.\n");
+    return -1;
+  }
+
+  unlink(stats_sock);
+  if ((bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) ||
+      (listen(fd, 16) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: bind stats socket %s failed.\n",
+             stats_sock);
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+static void *stats_thread(void *arg) {
+  int listen_fd = (int)(intptr_t)arg;
+  static char buf[64 * 1024];
+
+  uint64_t last[2] = {0, 0};
+  int64_t last_ms = stats_now_ms();
+  int64_t next_dump = last_ms;
+
+  while (1) {
+    struct pollfd pfd;
+    pfd.fd = listen_fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    int64_t tmo = 1000 - (stats_now_ms() - last_ms);
+    if ((poll(&pfd, listen_fd >= 0 ? 1 : 0, tmo > 0 ? (int)tmo : 0) < 0) &&
+        (errno != EINTR)) {
+      tftp_log(TFTP_LOG_ERROR, "tftpd: stats poll failed.\n");
+      break;
+    }
+
+    int64_t now = stats_now_ms();
+    if (now - last_ms >= 1000) {
+      pthread_mutex_lock(&stats_lock);
+      uint64_t sent =
+          stats_sum(stats_blocks, stats_count, TFTP_STAT_BYTES_SENT);
+      uint64_t recv =
+          stats_sum(stats_blocks, stats_count, TFTP_STAT_BYTES_RECV);
+      pthread_mutex_unlock(&stats_lock);
+      __atomic_store_n(&stats_rate[0], (sent - last[0]) * 1000 / (now - last_ms),
+                       __ATOMIC_RELAXED);
+      __atomic_store_n(&stats_rate[1], (recv - last[1]) * 1000 / (now - last_ms),
+                       __ATOMIC_RELAXED);
+      last[0] = sent;
+      last[1] = recv;
+      last_ms = now;
+    }
+
+    if (pfd.revents & POLLIN) {
+      stats_reply(listen_fd, buf, sizeof(buf));
+    }
+    if (stats_file && (now >= next_dump)) {
+      stats_dump(buf, sizeof(buf));
+      next_dump = now + (int64_t)stats_interval * 1000;
+    }
+  }
+
+  return NULL;
+}
+
+// serve snapshots to every client of a unix stream socket and/or rewrite a
+// dump file every interval seconds
+int tftp_stats_serve(const char *sock_path, const char *file_path,
+                     int interval) {
+  stats_sock = sock_path;
+  stats_file = file_path;
+  stats_interval = interval > 0 ? interval : 1;
+  stats_start_ms = stats_now_ms();
+
+  int listen_fd = -1;
+  if (stats_sock && ((listen_fd = stats_listen()) < 0)) {
+    return -1;
+  }
+
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, stats_thread,
+                     (void *)(intptr_t)listen_fd) != 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftpd: create stats thread failed.\n");
+    if (listen_fd >= 0) {
+      close(listen_fd);
+    }
+    return -1;
+  }
+
+  pthread_detach(thread);
+  return 0;
+}
@@ -0,0 +1,48 @@
+#ifndef TFTP_STATS_H
+#define TFTP_STATS_H
+
+#include <stdint.h>
+
+#define TFTP_STATS_MAX_BLOCKS 256
+// log2 buckets, the last one also takes everything larger
+#define TFTP_STATS_BUCKETS 32
+
+typedef enum _tftp_stat_t {
+  TFTP_STAT_SESSIONS_ACTIVE = 0,
+  TFTP_STAT_SESSIONS_TOTAL,
+  TFTP_STAT_SESSIONS_FAILED,
+  TFTP_STAT_RRQ,
+  TFTP_STAT_WRQ,
+  TFTP_STAT_BYTES_SENT,
+  TFTP_STAT_BYTES_RECV,
+  TFTP_STAT_BLOCKS_SENT,
+  TFTP_STAT_BLOCKS_RECV,
+  TFTP_STAT_RETRANSMITS,
+  TFTP_STAT_TIMEOUTS,
+  TFTP_STAT_DUP_REQUESTS,
+  TFTP_STAT_QUEUED,
+  TFTP_STAT_BUSY,
+  TFTP_STAT_COUNT,
+} tftp_stat_t;
+
+typedef enum _tftp_hist_t {
+  TFTP_HIST_RTT_US = 0,
+  TFTP_HIST_DURATION_MS,
+  TFTP_HIST_COUNT,
+} tftp_hist_t;
+
+// written by one thread only, read by the stats thread without locks
+typedef struct _tftp_stats_t {
+  uint64_t counters[TFTP_STAT_COUNT];
+  uint64_t hists[TFTP_HIST_COUNT][TFTP_STATS_BUCKETS];
+} __attribute__((aligned(64))) tftp_stats_t;
+
+tftp_stats_t *tftp_stats_new(void);
+void tftp_stats_free(tftp_stats_t *stats);
+void tftp_stats_add(tftp_stats_t *stats, tftp_stat_t stat, int64_t value);
+void tftp_stats_observe(tftp_stats_t *stats, tftp_hist_t hist, uint64_t value);
+int tftp_stats_format(char *buf, int size);
+int tftp_stats_serve(const char *sock_path, const char *file_path,
+                     int interval);
+
+#endif
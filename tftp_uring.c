@@ -0,0 +1,181 @@
+#include "tftp_uring.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "tftp_log.h"
+
+static int uring_setup(unsigned entries, struct io_uring_params *params) {
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                       unsigned flags, void *arg, size_t arg_size) {
+  return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                      arg, arg_size);
+}
+
+int tftp_uring_init(tftp_uring_t *ring, unsigned entries, unsigned cq_entries) {
+  memset(ring, 0, sizeof(tftp_uring_t));
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_CQSIZE;
+  params.cq_entries = cq_entries;
+  ring->fd = uring_setup(entries, &params);
+  if (ring->fd < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: io_uring setup failed: %s\n",
+             strerror(errno));
+    return -1;
+  }
+
+  // waiting with a timeout needs the extended enter argument
+  if (!(params.features & IORING_FEAT_EXT_ARG)) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: io_uring lacks timed waits.\n");
+    close(ring->fd);
+    return -1;
+  }
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if ((ring->sq_ring == MAP_FAILED) || (ring->cq_ring == MAP_FAILED) ||
+      (ring->sqes == MAP_FAILED)) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: map io_uring failed.\n");
+    tftp_uring_free(ring);
+    return -1;
+  }
+
+  uint8_t *sq = (uint8_t *)ring->sq_ring;
+  ring->sq_entries = params.sq_entries;
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+
+  uint8_t *cq = (uint8_t *)ring->cq_ring;
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+}
+
+void tftp_uring_free(tftp_uring_t *ring) {
+  if (ring->sqes && (ring->sqes != MAP_FAILED)) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring && (ring->cq_ring != MAP_FAILED)) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring && (ring->sq_ring != MAP_FAILED)) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  close(ring->fd);
+  ring->fd = -1;
+}
+
+int tftp_uring_register(tftp_uring_t *ring, const struct iovec *iovs,
+                        unsigned count) {
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, iovs,
+              count) < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: register io_uring buffers failed: %s\n",
+             strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+// get a cleared sqe, the sq is flushed to the kernel when it is full
+struct io_uring_sqe *tftp_uring_sqe(tftp_uring_t *ring) {
+  unsigned tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+      ring->sq_entries) {
+    if (tftp_uring_submit(ring) < 0) {
+      return NULL;
+    }
+    if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >=
+        ring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  unsigned idx = tail & ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+// sqes the kernel has not consumed yet, it takes them on io_uring_enter
+static unsigned uring_pending(tftp_uring_t *ring) {
+  return *ring->sq_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+}
+
+int tftp_uring_submit(tftp_uring_t *ring) {
+  while (uring_pending(ring)) {
+    if (uring_enter(ring->fd, uring_pending(ring), 0, 0, NULL, 0) < 0) {
+      if ((errno == EINTR) || (errno == EAGAIN) || (errno == EBUSY)) {
+        continue;
+      }
+      tftp_log(TFTP_LOG_ERROR, "tftp: io_uring submit failed: %s\n",
+               strerror(errno));
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+// submit everything queued and wait for a completion or tmo_ms (-1 forever)
+int tftp_uring_wait(tftp_uring_t *ring, int64_t tmo_ms) {
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (tmo_ms >= 0) {
+    ts.tv_sec = tmo_ms / 1000;
+    ts.tv_nsec = (tmo_ms % 1000) * 1000000;
+    arg.ts = (uint64_t)(uintptr_t)&ts;
+  }
+
+  if (uring_enter(ring->fd, uring_pending(ring), 1,
+                  IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg,
+                  sizeof(arg)) < 0) {
+    if ((errno == ETIME) || (errno == EINTR) || (errno == EAGAIN) ||
+        (errno == EBUSY)) {
+      return 0;
+    }
+    tftp_log(TFTP_LOG_ERROR, "tftp: io_uring wait failed: %s\n",
+             strerror(errno));
+    return -1;
+  }
+
+  return 0;
+}
+
+struct io_uring_cqe *tftp_uring_peek(tftp_uring_t *ring) {
+  unsigned head = *ring->cq_head;
+  if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    return NULL;
+  }
+
+  return &ring->cqes[head & ring->cq_mask];
+}
+
+void tftp_uring_seen(tftp_uring_t *ring) {
+  __atomic_store_n(ring->cq_head, *ring->cq_head + 1, __ATOMIC_RELEASE);
+}
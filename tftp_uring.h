@@ -0,0 +1,41 @@
+#ifndef TFTP_URING_H
+#define TFTP_URING_H
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+// minimal io_uring over the raw syscalls: one submitter thread, no sqpoll
+typedef struct _tftp_uring_t {
+  int fd;
+  unsigned sq_entries;
+  unsigned sq_mask;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+
+  unsigned cq_mask;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  struct io_uring_cqe *cqes;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+} tftp_uring_t;
+
+int tftp_uring_init(tftp_uring_t *ring, unsigned entries, unsigned cq_entries);
+void tftp_uring_free(tftp_uring_t *ring);
+int tftp_uring_register(tftp_uring_t *ring, const struct iovec *iovs,
+                        unsigned count);
+struct io_uring_sqe *tftp_uring_sqe(tftp_uring_t *ring);
+int tftp_uring_submit(tftp_uring_t *ring);
+int tftp_uring_wait(tftp_uring_t *ring, int64_t tmo_ms);
+struct io_uring_cqe *tftp_uring_peek(tftp_uring_t *ring);
+void tftp_uring_seen(tftp_uring_t *ring);
+
+#endif
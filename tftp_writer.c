@@ -0,0 +1,290 @@
+#include "tftp_writer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "tftp_log.h"
+
+static void chunk_write(tftp_chunk_t *chunk) {
+  size_t done = 0;
+  while (done < chunk->size) {
+    ssize_t size = pwrite(chunk->fd, chunk->data + done, chunk->size - done,
+                          chunk->offset + (off_t)done);
+    if (size < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      chunk->err = errno;
+      return;
+    }
+    if (size == 0) {
+      chunk->err = ENOSPC;
+      return;
+    }
+    done += (size_t)size;
+  }
+}
+
+static void *writer_thread(void *arg) {
+  tftp_writer_t *writer = (tftp_writer_t *)arg;
+
+  pthread_mutex_lock(&writer->lock);
+  while (1) {
+    while ((writer->queue == NULL) && !writer->stop) {
+      pthread_cond_wait(&writer->cond, &writer->lock);
+    }
+    if (writer->queue == NULL) {
+      break;
+    }
+
+    tftp_chunk_t *chunk = writer->queue;
+    writer->queue = chunk->next;
+    if (writer->queue == NULL) {
+      writer->queue_tail = &writer->queue;
+    }
+    pthread_mutex_unlock(&writer->lock);
+
+    chunk_write(chunk);
+
+    pthread_mutex_lock(&writer->lock);
+    chunk->next = NULL;
+    *writer->done_tail = chunk;
+    writer->done_tail = &chunk->next;
+
+    uint64_t one = 1;
+    if (write(writer->event_fd, &one, sizeof(one)) < 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: notify writer event failed.\n");
+    }
+  }
+  pthread_mutex_unlock(&writer->lock);
+
+  return NULL;
+}
+
+static void writer_reset(tftp_writer_t *writer) {
+  writer->queue = NULL;
+  writer->queue_tail = &writer->queue;
+  writer->done = NULL;
+  writer->done_tail = &writer->done;
+  writer->event_fd = -1;
+  writer->stop = 0;
+  writer->ring = NULL;
+  writer->tag = 0;
+  writer->fixed = NULL;
+  writer->idle = NULL;
+  writer->idle_count = 0;
+  pthread_mutex_init(&writer->lock, NULL);
+  pthread_cond_init(&writer->cond, NULL);
+}
+
+static void writer_done(tftp_writer_t *writer, tftp_chunk_t *chunk) {
+  pthread_mutex_lock(&writer->lock);
+  chunk->next = NULL;
+  *writer->done_tail = chunk;
+  writer->done_tail = &chunk->next;
+  pthread_mutex_unlock(&writer->lock);
+}
+
+// queue the rest of a chunk to the ring, written in place when the ring
+// cannot take it
+static void writer_queue(tftp_writer_t *writer, tftp_chunk_t *chunk) {
+  struct io_uring_sqe *sqe = tftp_uring_sqe(writer->ring);
+  if (sqe == NULL) {
+    chunk_write(chunk);
+    writer_done(writer, chunk);
+    return;
+  }
+
+  if (chunk->buf_index >= 0) {
+    sqe->opcode = IORING_OP_WRITE_FIXED;
+    sqe->buf_index = (uint16_t)chunk->buf_index;
+  } else {
+    sqe->opcode = IORING_OP_WRITE;
+  }
+  sqe->fd = chunk->fd;
+  sqe->addr = (uint64_t)(uintptr_t)(chunk->data + chunk->done);
+  sqe->len = (uint32_t)(chunk->size - chunk->done);
+  sqe->off = (uint64_t)(chunk->offset + (off_t)chunk->done);
+  sqe->user_data = (uint64_t)(uintptr_t)chunk | writer->tag;
+}
+
+int tftp_writer_init_uring(tftp_writer_t *writer, tftp_uring_t *ring,
+                           uint64_t tag) {
+  writer_reset(writer);
+  writer->ring = ring;
+  writer->tag = tag;
+
+  if (posix_memalign((void **)&writer->fixed, 4096,
+                     (size_t)TFTP_WRITER_FIXED * TFTP_WRITER_CHUNK) != 0) {
+    writer->fixed = NULL;
+    tftp_log(TFTP_LOG_ERROR, "tftp: alloc write chunks failed.\n");
+    return -1;
+  }
+
+  struct iovec iovs[TFTP_WRITER_FIXED];
+  for (int i = 0; i < TFTP_WRITER_FIXED; i++) {
+    iovs[i].iov_base = writer->fixed + (size_t)i * TFTP_WRITER_CHUNK;
+    iovs[i].iov_len = TFTP_WRITER_CHUNK;
+  }
+  if (tftp_uring_register(ring, iovs, TFTP_WRITER_FIXED) < 0) {
+    free(writer->fixed);
+    writer->fixed = NULL;
+    return -1;
+  }
+
+  for (int i = 0; i < TFTP_WRITER_FIXED; i++) {
+    tftp_chunk_t *chunk = (tftp_chunk_t *)malloc(sizeof(tftp_chunk_t));
+    if (chunk == NULL) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: alloc write chunks failed.\n");
+      return -1;
+    }
+    chunk->buf_index = i;
+    chunk->data = (uint8_t *)iovs[i].iov_base;
+    chunk->next = writer->idle;
+    writer->idle = chunk;
+    writer->idle_count++;
+  }
+
+  return 0;
+}
+
+int tftp_writer_init(tftp_writer_t *writer) {
+  writer_reset(writer);
+
+  writer->event_fd = eventfd(0, EFD_NONBLOCK);
+  if (writer->event_fd < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: create writer event failed.\n");
+    return -1;
+  }
+
+  if (pthread_create(&writer->thread, NULL, writer_thread, writer) != 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: create writer thread failed.\n");
+    close(writer->event_fd);
+    writer->event_fd = -1;
+    return -1;
+  }
+
+  return 0;
+}
+
+// stop the writer thread once its queue is written and free the idle
+// chunks. chunks still out with the owner or the ring are not freed
+void tftp_writer_free(tftp_writer_t *writer) {
+  if (writer->event_fd >= 0) {
+    pthread_mutex_lock(&writer->lock);
+    writer->stop = 1;
+    pthread_cond_signal(&writer->cond);
+    pthread_mutex_unlock(&writer->lock);
+    pthread_join(writer->thread, NULL);
+    close(writer->event_fd);
+    writer->event_fd = -1;
+  }
+
+  while (writer->idle) {
+    tftp_chunk_t *chunk = writer->idle;
+    writer->idle = chunk->next;
+    if (chunk->buf_index < 0) {
+      free(chunk->data);
+    }
+    free(chunk);
+  }
+  writer->idle_count = 0;
+  free(writer->fixed);
+  writer->fixed = NULL;
+}
+
+tftp_chunk_t *tftp_writer_chunk(tftp_writer_t *writer, void *owner, int fd,
+                                off_t offset) {
+  tftp_chunk_t *chunk = writer->idle;
+  if (chunk) {
+    writer->idle = chunk->next;
+    writer->idle_count--;
+  } else {
+    chunk = (tftp_chunk_t *)malloc(sizeof(tftp_chunk_t));
+    if (chunk == NULL) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: alloc write chunk failed.\n");
+      return NULL;
+    }
+    if (posix_memalign((void **)&chunk->data, 4096, TFTP_WRITER_CHUNK) != 0) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: alloc write chunk failed.\n");
+      free(chunk);
+      return NULL;
+    }
+    chunk->buf_index = -1;
+  }
+
+  // end every chunk on a chunk aligned file offset
+  chunk->next = NULL;
+  chunk->owner = owner;
+  chunk->owner_next = NULL;
+  chunk->finished = 0;
+  chunk->fd = fd;
+  chunk->offset = offset;
+  chunk->size = 0;
+  chunk->capacity = TFTP_WRITER_CHUNK - (size_t)(offset % TFTP_WRITER_CHUNK);
+  chunk->done = 0;
+  chunk->err = 0;
+  return chunk;
+}
+
+void tftp_writer_submit(tftp_writer_t *writer, tftp_chunk_t *chunk) {
+  chunk->next = NULL;
+  if (writer->ring) {
+    writer_queue(writer, chunk);
+    return;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  *writer->queue_tail = chunk;
+  writer->queue_tail = &chunk->next;
+  pthread_cond_signal(&writer->cond);
+  pthread_mutex_unlock(&writer->lock);
+}
+
+// result of a ring write, a short write queues the rest of the chunk
+void tftp_writer_complete(tftp_writer_t *writer, tftp_chunk_t *chunk,
+                          int res) {
+  if (res < 0) {
+    chunk->err = -res;
+  } else if (res == 0) {
+    chunk->err = ENOSPC;
+  } else {
+    chunk->done += (size_t)res;
+    if (chunk->done < chunk->size) {
+      writer_queue(writer, chunk);
+      return;
+    }
+  }
+
+  writer_done(writer, chunk);
+}
+
+tftp_chunk_t *tftp_writer_reap(tftp_writer_t *writer) {
+  uint64_t count;
+  if ((writer->event_fd >= 0) &&
+      (read(writer->event_fd, &count, sizeof(count)) < 0)) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&writer->lock);
+  tftp_chunk_t *chunk = writer->done;
+  writer->done = NULL;
+  writer->done_tail = &writer->done;
+  pthread_mutex_unlock(&writer->lock);
+  return chunk;
+}
+
+void tftp_writer_release(tftp_writer_t *writer, tftp_chunk_t *chunk) {
+  if ((chunk->buf_index < 0) && (writer->idle_count >= TFTP_WRITER_MAX_IDLE)) {
+    free(chunk->data);
+    free(chunk);
+    return;
+  }
+
+  chunk->next = writer->idle;
+  writer->idle = chunk;
+  writer->idle_count++;
+}
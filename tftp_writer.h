@@ -0,0 +1,72 @@
+#ifndef TFTP_WRITER_H
+#define TFTP_WRITER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "tftp_uring.h"
+
+#define TFTP_WRITER_CHUNK (128 * 1024)
+// chunks one file may have queued before its acks are held back
+#define TFTP_WRITER_DEPTH 4
+#define TFTP_WRITER_MAX_IDLE 16
+// chunks registered with the io_uring of a ring mode writer
+#define TFTP_WRITER_FIXED 32
+
+typedef struct _tftp_chunk_t {
+  struct _tftp_chunk_t *next;
+  void *owner;
+  // the owner's chunks in flight in file order, and whether this one came
+  // back from the writer
+  struct _tftp_chunk_t *owner_next;
+  int finished;
+  int fd;
+  off_t offset;
+  size_t size;
+  size_t capacity;
+  size_t done;
+  int err;
+  // registered buffer index, -1 when allocated outside the fixed set
+  int buf_index;
+  uint8_t *data;
+} tftp_chunk_t;
+
+// write-behind stage: chunks are filled by one thread, written by the writer
+// thread in submission order and handed back through event_fd. a ring mode
+// writer has no thread, chunks go to the io_uring of the filling thread and
+// come back through tftp_writer_complete in any order
+typedef struct _tftp_writer_t {
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  tftp_chunk_t *queue;
+  tftp_chunk_t **queue_tail;
+  tftp_chunk_t *done;
+  tftp_chunk_t **done_tail;
+  int event_fd;
+  int stop;
+
+  tftp_uring_t *ring;
+  uint64_t tag;
+  uint8_t *fixed;
+
+  // owned by the submitting thread
+  tftp_chunk_t *idle;
+  int idle_count;
+} tftp_writer_t;
+
+int tftp_writer_init(tftp_writer_t *writer);
+int tftp_writer_init_uring(tftp_writer_t *writer, tftp_uring_t *ring,
+                           uint64_t tag);
+void tftp_writer_free(tftp_writer_t *writer);
+tftp_chunk_t *tftp_writer_chunk(tftp_writer_t *writer, void *owner, int fd,
+                                off_t offset);
+void tftp_writer_submit(tftp_writer_t *writer, tftp_chunk_t *chunk);
+void tftp_writer_complete(tftp_writer_t *writer, tftp_chunk_t *chunk,
+                          int res);
+tftp_chunk_t *tftp_writer_reap(tftp_writer_t *writer);
+void tftp_writer_release(tftp_writer_t *writer, tftp_chunk_t *chunk);
+
+#endif
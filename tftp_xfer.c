@@ -0,0 +1,442 @@
+#include "tftp_xfer.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "tftp_log.h"
+
+int tftp_xfer_init(tftp_xfer_t *xfer, const struct sockaddr *server,
+                   int is_read, const char *filename, int block_size,
+                   int window_size, int option, int64_t offset,
+                   const tftp_xfer_io_t *io) {
+  memset(xfer, 0, sizeof(tftp_xfer_t));
+  tftp_t *tftp = &xfer->tftp;
+
+  if (!option) {
+    block_size = TFTP_DEF_BLKSIZE;
+    window_size = TFTP_DEF_WINSIZE;
+  }
+  if (block_size < TFTP_MIN_BLKSIZE) {
+    block_size = TFTP_MIN_BLKSIZE;
+  } else if (block_size > TFTP_MAX_BLKSIZE) {
+    block_size = TFTP_MAX_BLKSIZE;
+  }
+  if (window_size < TFTP_DEF_WINSIZE) {
+    window_size = TFTP_DEF_WINSIZE;
+  } else if (window_size > TFTP_MAX_WINSIZE) {
+    window_size = TFTP_MAX_WINSIZE;
+  }
+
+  // the server never grants more than the blksize asked for, requests,
+  // errors and oacks fit a default sized packet
+  tftp->buf_size = TFTP_PKT_SIZE(
+      block_size > TFTP_DEF_BLKSIZE ? block_size : TFTP_DEF_BLKSIZE);
+  tftp->tx_packet = (tftp_packet_t *)malloc(tftp->buf_size);
+  if (tftp->tx_packet == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: alloc packet buffer failed.\n");
+    return -1;
+  }
+
+  tftp->socket = -1;
+  memcpy(&tftp->remote, server, sizeof(tftp->remote));
+  tftp->block_size = block_size;
+  tftp->window_size = window_size;
+  tftp->tmo_retry = TFTP_MAX_RETRY;
+  tftp_rtt_reset(tftp, TFTP_TMO_SEC, 0);
+  tftp->offset = offset;
+  if (is_read) {
+    tftp->offset_option = option && (offset > 0);
+  } else {
+    tftp->file_size = offset;
+    tftp->offset_option = option;
+  }
+
+  xfer->io = *io;
+  xfer->is_read = is_read;
+  xfer->option = option;
+  snprintf(xfer->filename, sizeof(xfer->filename), "%s", filename);
+
+  int size = tftp_make_request(tftp, is_read, filename, is_read ? 0 : offset,
+                               option);
+  if (size < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: make request failed, file %s\n",
+             filename);
+    tftp_xfer_free(xfer);
+    return -1;
+  }
+  xfer->ctrl_size = size;
+  return 0;
+}
+
+void tftp_xfer_free(tftp_xfer_t *xfer) {
+  free(xfer->tftp.tx_packet);
+  xfer->tftp.tx_packet = NULL;
+}
+
+// ends the transfer, the error packet is still handed out by next
+static void xfer_fail(tftp_xfer_t *xfer, uint16_t code, const char *msg) {
+  xfer->ctrl_size = tftp_make_error(&xfer->tftp, code, msg);
+  xfer->state = TFTP_XFER_FAILED;
+  xfer->err_code = code;
+  snprintf(xfer->err_msg, sizeof(xfer->err_msg), "%s",
+           msg ? msg : tftp_err_msg(code));
+}
+
+static void xfer_ack(tftp_xfer_t *xfer, int64_t block) {
+  tftp_packet_t *pkt = xfer->tftp.tx_packet;
+  pkt->opcode = htons(TFTP_PKT_ACK);
+  pkt->ack.block = htons((uint16_t)block);
+  xfer->ctrl_size = 4;
+  xfer->window_count = 0;
+}
+
+// progress, the timer restarts from the next packet with all its retries
+static void xfer_progress(tftp_xfer_t *xfer, int64_t now_us) {
+  tftp_t *tftp = &xfer->tftp;
+  if (!tftp->tx_resent) {
+    tftp_rtt_update(tftp, now_us - tftp->tx_time_us);
+  }
+  tftp->tx_resent = 0;
+  tftp->tmo_retry = TFTP_MAX_RETRY;
+  xfer->deadline_us = now_us + tftp->rto_us;
+}
+
+// a server that ignored the options answers as rfc 1350 says
+static void xfer_plain(tftp_xfer_t *xfer) {
+  tftp_t *tftp = &xfer->tftp;
+  tftp->block_size = TFTP_DEF_BLKSIZE;
+  tftp->window_size = TFTP_DEF_WINSIZE;
+  tftp->offset = 0;
+}
+
+static int xfer_on_oack(tftp_xfer_t *xfer, const tftp_packet_t *pkt,
+                        size_t size, int64_t now_us) {
+  tftp_t *tftp = &xfer->tftp;
+  xfer_progress(xfer, now_us);
+  if (tftp_parse_oack(tftp, pkt, size) < 0) {
+    xfer_fail(xfer, TFTP_ERR_OP, NULL);
+    return -1;
+  }
+
+  if (xfer->is_read) {
+    tftp_log(TFTP_LOG_INFO, "tftp: file size %" PRId64 " bytes\n",
+             tftp->file_size);
+  }
+  if (tftp->offset) {
+    tftp_log(TFTP_LOG_INFO, "tftp: restart at %" PRId64 " bytes\n",
+             tftp->offset);
+  }
+  return 0;
+}
+
+static void xfer_on_get(tftp_xfer_t *xfer, const tftp_packet_t *pkt,
+                        size_t size, int64_t now_us, int first) {
+  tftp_t *tftp = &xfer->tftp;
+  uint16_t opcode = ntohs(pkt->opcode);
+
+  if (first && xfer->option && (opcode == TFTP_PKT_OACK)) {
+    if (xfer_on_oack(xfer, pkt, size, now_us) == 0) {
+      xfer_ack(xfer, 0);
+    }
+    return;
+  }
+  if (opcode != TFTP_PKT_DATA) {
+    tftp->rx_dups++;
+    return;
+  }
+  if (first && xfer->option) {
+    xfer_plain(xfer);
+  }
+
+  int64_t block = xfer->acked + 1;
+  uint16_t got = ntohs(pkt->data.block);
+  if (got != (uint16_t)block) {
+    // a block past a loss, or an old one the server sent again after
+    // missing our ack: the last block in order is acked once per window and
+    // the server restarts after it (rfc 7440)
+    tftp->rx_dups++;
+    if (!xfer->gap_acked) {
+      xfer->gap_acked = 1;
+      xfer_ack(xfer, xfer->acked);
+    }
+    return;
+  }
+
+  size_t len = size - 4;
+  if (len > (size_t)tftp->block_size) {
+    xfer_fail(xfer, TFTP_ERR_OP, NULL);
+    return;
+  }
+  if (xfer->window_count == 0) {
+    xfer_progress(xfer, now_us);
+  } else {
+    tftp->tmo_retry = TFTP_MAX_RETRY;
+    xfer->deadline_us = now_us + tftp->rto_us;
+  }
+
+  int64_t offset = tftp->offset + (block - 1) * tftp->block_size;
+  if (len && (xfer->io.write(xfer->io.ctx, offset, pkt->data.data, len) < 0)) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: write file failed: %s\n", xfer->filename);
+    xfer_fail(xfer, TFTP_ERR_DISK_FULL, NULL);
+    return;
+  }
+
+  xfer->acked = block;
+  xfer->gap_acked = 0;
+  xfer->window_count++;
+  xfer->total_size += len;
+  xfer->total_block++;
+  if (len < (size_t)tftp->block_size) {
+    xfer->last = block;
+    xfer_ack(xfer, block);
+    xfer->state = TFTP_XFER_DONE;
+  } else if (xfer->window_count >= tftp->window_size) {
+    xfer_ack(xfer, block);
+  }
+}
+
+static void xfer_on_put(tftp_xfer_t *xfer, const tftp_packet_t *pkt,
+                        size_t size, int64_t now_us, int first) {
+  tftp_t *tftp = &xfer->tftp;
+  uint16_t opcode = ntohs(pkt->opcode);
+  uint16_t got = ntohs(pkt->ack.block);
+
+  if (first) {
+    if (xfer->option && (opcode == TFTP_PKT_OACK)) {
+      if (xfer_on_oack(xfer, pkt, size, now_us) < 0) {
+        return;
+      }
+    } else if ((opcode == TFTP_PKT_ACK) && (got == 0)) {
+      xfer_progress(xfer, now_us);
+      if (xfer->option) {
+        xfer_plain(xfer);
+      }
+    } else {
+      xfer_fail(xfer, TFTP_ERR_OP, NULL);
+      return;
+    }
+
+    xfer->next = 1;
+    return;
+  }
+
+  if (opcode != TFTP_PKT_ACK) {
+    tftp->rx_dups++;
+    return;
+  }
+
+  int64_t block = xfer->acked + (uint16_t)(got - (uint16_t)xfer->acked);
+  if ((block <= xfer->acked) || (block >= xfer->next)) {
+    tftp->rx_dups++;
+    return;
+  }
+
+  xfer_progress(xfer, now_us);
+  xfer->acked = block;
+  xfer->total_block = block;
+  xfer->total_size = block * tftp->block_size;
+  if (xfer->total_size > tftp->file_size - tftp->offset) {
+    xfer->total_size = tftp->file_size - tftp->offset;
+  }
+  if (block == xfer->last) {
+    xfer->state = TFTP_XFER_DONE;
+  } else if (block < xfer->next - 1) {
+    // acked short of the window, the rest is sent again after it
+    xfer->next = block + 1;
+  }
+}
+
+void tftp_xfer_feed(tftp_xfer_t *xfer, const struct sockaddr *from,
+                    const void *data, size_t size, int64_t now_us) {
+  tftp_t *tftp = &xfer->tftp;
+  const tftp_packet_t *pkt = (const tftp_packet_t *)data;
+  if ((xfer->state != TFTP_XFER_RUNNING) || (size < 4)) {
+    return;
+  }
+
+  // the server answers from a port of its own, packets from anywhere else
+  // belong to another transfer
+  const struct sockaddr_in *addr = (const struct sockaddr_in *)from;
+  struct sockaddr_in *remote = (struct sockaddr_in *)&tftp->remote;
+  if ((addr->sin_addr.s_addr != remote->sin_addr.s_addr) ||
+      (xfer->started && (addr->sin_port != remote->sin_port))) {
+    tftp->rx_dups++;
+    return;
+  }
+  int first = !xfer->started;
+  if (first) {
+    remote->sin_port = addr->sin_port;
+    xfer->started = 1;
+  }
+
+  if (ntohs(pkt->opcode) == TFTP_PKT_ERROR) {
+    int len = (int)size - 4;
+    if (len > (int)sizeof(xfer->err_msg) - 1) {
+      len = (int)sizeof(xfer->err_msg) - 1;
+    }
+    snprintf(xfer->err_msg, sizeof(xfer->err_msg), "%.*s", len,
+             pkt->err.msg);
+    xfer->err_code = ntohs(pkt->err.code);
+    xfer->state = TFTP_XFER_FAILED;
+    xfer->ctrl_size = 0;
+    tftp_log(TFTP_LOG_ERROR, "tftp: recv error = %d, reason: %s\n",
+             xfer->err_code, xfer->err_msg);
+    return;
+  }
+
+  if (xfer->is_read) {
+    xfer_on_get(xfer, pkt, size, now_us, first);
+  } else {
+    xfer_on_put(xfer, pkt, size, now_us, first);
+  }
+}
+
+// the packet stays valid until the next call. a put builds its data
+// packets here, as many as the window allows
+int tftp_xfer_next(tftp_xfer_t *xfer, int64_t now_us, const void **pkt,
+                   size_t *size) {
+  tftp_t *tftp = &xfer->tftp;
+  tftp_packet_t *tx = tftp->tx_packet;
+
+  if (xfer->ctrl_size) {
+    *pkt = tx;
+    *size = xfer->ctrl_size;
+    tftp->tx_size = xfer->ctrl_size;
+    tftp->tx_time_us = now_us;
+    xfer->ctrl_size = 0;
+    if (xfer->state == TFTP_XFER_RUNNING) {
+      xfer->deadline_us = now_us + tftp->rto_us;
+    }
+    return 1;
+  }
+
+  if ((xfer->state != TFTP_XFER_RUNNING) || xfer->is_read ||
+      (xfer->next == 0) || (xfer->last && (xfer->next > xfer->last)) ||
+      (xfer->next > xfer->acked + tftp->window_size)) {
+    return 0;
+  }
+
+  int64_t offset = tftp->offset + (xfer->next - 1) * tftp->block_size;
+  ssize_t len =
+      xfer->io.read(xfer->io.ctx, offset, tx->data.data, tftp->block_size);
+  if (len < 0) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: read file failed: %s\n", xfer->filename);
+    xfer_fail(xfer, TFTP_ERR_ACC_VIO, NULL);
+    return tftp_xfer_next(xfer, now_us, pkt, size);
+  }
+  if (len < tftp->block_size) {
+    xfer->last = xfer->next;
+  }
+
+  tx->opcode = htons(TFTP_PKT_DATA);
+  tx->data.block = htons((uint16_t)xfer->next);
+  xfer->next++;
+
+  *pkt = tx;
+  *size = 4 + (size_t)len;
+  tftp->tx_time_us = now_us;
+  xfer->deadline_us = now_us + tftp->rto_us;
+  return 1;
+}
+
+int64_t tftp_xfer_deadline(const tftp_xfer_t *xfer) {
+  if ((xfer->state != TFTP_XFER_RUNNING) || (xfer->deadline_us == 0)) {
+    return -1;
+  }
+
+  return xfer->deadline_us;
+}
+
+// the request is sent again until the server answers. after that a get
+// acks the last block in order, a put sends its window again from the
+// first block not acked
+void tftp_xfer_timer(tftp_xfer_t *xfer, int64_t now_us) {
+  tftp_t *tftp = &xfer->tftp;
+  int64_t deadline = tftp_xfer_deadline(xfer);
+  // a packet waiting for tftp_xfer_next restarts the timer once sent
+  if ((deadline < 0) || (now_us < deadline) || xfer->ctrl_size) {
+    return;
+  }
+
+  if (xfer->is_read && xfer->started && xfer->window_count) {
+    // blocks came in since the last ack but the end of the window did not,
+    // as when a window overruns the socket buffer. the ack of what is here
+    // is news to the server, not a retransmission, so the rto stays
+    xfer_ack(xfer, xfer->acked);
+    xfer->gap_acked = 0;
+    xfer->deadline_us = now_us + tftp->rto_us;
+    return;
+  }
+
+  if (--tftp->tmo_retry == 0) {
+    tftp_log(TFTP_LOG_WARN, "tftp: wait tmo\n");
+    xfer->state = TFTP_XFER_FAILED;
+    snprintf(xfer->err_msg, sizeof(xfer->err_msg), "timed out");
+    return;
+  }
+
+  tftp_rtt_backoff(tftp);
+  tftp->tx_resent = 1;
+  xfer->deadline_us = now_us + tftp->rto_us;
+  if (!xfer->started) {
+    xfer->ctrl_size = tftp->tx_size;
+  } else if (xfer->is_read) {
+    xfer_ack(xfer, xfer->acked);
+    xfer->gap_acked = 0;
+  } else {
+    xfer->next = xfer->acked + 1;
+  }
+}
+
+int tftp_xfer_run(tftp_xfer_t *xfer, int sockfd) {
+  tftp_t *tftp = &xfer->tftp;
+  uint8_t *buf = (uint8_t *)malloc(tftp->buf_size);
+  if (buf == NULL) {
+    tftp_log(TFTP_LOG_ERROR, "tftp: alloc packet buffer failed.\n");
+    return -1;
+  }
+
+  int64_t now = tftp_now_us();
+  while (1) {
+    const void *pkt;
+    size_t size;
+    while (tftp_xfer_next(xfer, now, &pkt, &size)) {
+      if (tftp_sendto(sockfd, pkt, size, &tftp->remote) < 0) {
+        tftp_log(TFTP_LOG_ERROR, "tftp: send error\n");
+        xfer->state = TFTP_XFER_FAILED;
+        break;
+      }
+    }
+    if (xfer->state != TFTP_XFER_RUNNING) {
+      break;
+    }
+
+    int64_t deadline = tftp_xfer_deadline(xfer);
+    int tmo = deadline < 0 ? -1 : (int)((deadline - now + 999) / 1000);
+    struct pollfd pfd = {sockfd, POLLIN, 0};
+    int ready = poll(&pfd, 1, tmo < 0 ? -1 : tmo);
+    if ((ready < 0) && (errno != EINTR)) {
+      tftp_log(TFTP_LOG_ERROR, "tftp: poll failed.\n");
+      xfer->state = TFTP_XFER_FAILED;
+      break;
+    }
+
+    now = tftp_now_us();
+    if (ready > 0) {
+      struct sockaddr from;
+      ssize_t len;
+      while ((len = tftp_recvfrom(sockfd, buf, tftp->buf_size, MSG_DONTWAIT,
+                                  &from)) >= 0) {
+        tftp_xfer_feed(xfer, &from, buf, (size_t)len, now);
+      }
+    }
+    tftp_xfer_timer(xfer, now);
+  }
+
+  free(buf);
+  return xfer->state == TFTP_XFER_DONE ? 0 : -1;
+}
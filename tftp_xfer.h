@@ -0,0 +1,77 @@
+#ifndef TFTP_XFER_H
+#define TFTP_XFER_H
+
+#include "tftp_base.h"
+
+// a client transfer as a state machine of its own, without sockets, clocks
+// or threads, so one event loop can run any number of them. while the state
+// is TFTP_XFER_RUNNING the caller
+//   - sends every packet tftp_xfer_next hands out to xfer->tftp.remote
+//   - feeds every datagram from the server to tftp_xfer_feed
+//   - calls tftp_xfer_timer once tftp_xfer_deadline has passed
+// and afterwards sends what tftp_xfer_next still has, a final ack or error.
+// tftp_xfer_run does all of it on a blocking socket
+
+typedef enum _tftp_xfer_state_t {
+  TFTP_XFER_RUNNING = 0,
+  TFTP_XFER_DONE,
+  TFTP_XFER_FAILED,
+} tftp_xfer_state_t;
+
+// file data at byte offsets of the whole file, blocks may be read again
+// after a loss. read returns less than size only at the end of the file,
+// both return -1 on errors
+typedef struct _tftp_xfer_io_t {
+  ssize_t (*read)(void *ctx, int64_t offset, void *buf, size_t size);
+  int (*write)(void *ctx, int64_t offset, const void *data, size_t size);
+  void *ctx;
+} tftp_xfer_io_t;
+
+typedef struct _tftp_xfer_t {
+  // negotiated options and timers, the server address whose port becomes
+  // the transfer id of the first reply. tx_packet holds the next packet
+  tftp_t tftp;
+  tftp_xfer_state_t state;
+  tftp_xfer_io_t io;
+  int is_read;
+  int option;
+  int started;
+
+  // blocks are counted from 1 without wrapping. acked is the last block in
+  // order, received by a get or acked to a put, next the next one a put
+  // sends and last the short block ending the file once known
+  int64_t acked;
+  int64_t next;
+  int64_t last;
+  // get: blocks since the last ack, and whether a gap was acked already
+  int window_count;
+  int gap_acked;
+  // a request, ack or error waiting in tx_packet
+  int ctrl_size;
+  int64_t deadline_us;
+
+  int64_t total_size;
+  int64_t total_block;
+  uint16_t err_code;
+  char err_msg[64];
+  char filename[TFTP_NAME_SIZE];
+} tftp_xfer_t;
+
+// offset is, for a get, the bytes of the file already held, the server is
+// asked to restart after them. for a put it is the size of the file, sent
+// as tsize and as the furthest point the server may restart at. without
+// option the transfer is plain rfc 1350: 512 byte blocks, no windows
+int tftp_xfer_init(tftp_xfer_t *xfer, const struct sockaddr *server,
+                   int is_read, const char *filename, int block_size,
+                   int window_size, int option, int64_t offset,
+                   const tftp_xfer_io_t *io);
+void tftp_xfer_free(tftp_xfer_t *xfer);
+void tftp_xfer_feed(tftp_xfer_t *xfer, const struct sockaddr *from,
+                    const void *data, size_t size, int64_t now_us);
+int tftp_xfer_next(tftp_xfer_t *xfer, int64_t now_us, const void **pkt,
+                   size_t *size);
+int64_t tftp_xfer_deadline(const tftp_xfer_t *xfer);
+void tftp_xfer_timer(tftp_xfer_t *xfer, int64_t now_us);
+int tftp_xfer_run(tftp_xfer_t *xfer, int sockfd);
+
+#endif